@@ -0,0 +1,45 @@
+#include "stdafx.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// 100,000 $(L+=...) appends, one per line, and then repeated reads of the
+// whole accumulated body, both expanded and quoted.
+
+BENCHMARK(Append)
+{
+	const int appends = 100000;
+	const int reads = 10;
+	string input;
+	string expected;
+	char item[32];
+	for (int i = 0; i < appends; ++ i) {
+		snprintf(item, sizeof item, "item %06d\n", i);
+		input += string("$(L+=") + item + ")\n";
+		expected += item;
+	}
+
+	double appending = bench::Time([&] {
+		stemple::Expander expander;
+		expander.Expand(input);
+	}, 3);
+	printf("  %d appends: %.3fs, %.2fus each\n", appends, appending, appending * 1e6 / appends);
+
+	stemple::Expander expander;
+	expander.Expand(input);
+	string body;
+	double reading = bench::Time([&] {
+		for (int i = 0; i < reads; ++ i) {
+			body = expander.Expand("$(L)");
+		}
+	}, 3);
+	bench::Check(body == expected, "expanded body");
+	double quoting = bench::Time([&] {
+		for (int i = 0; i < reads; ++ i) {
+			body = expander.Expand("$(L:q)");
+		}
+	}, 3);
+	bench::Check(body == expected, "quoted body");
+	printf("  %d reads of the %.1fMB body: %.3fs expanded, %.3fs quoted\n", reads, expected.length() / 1e6,
+		   reading, quoting);
+}
@@ -0,0 +1,76 @@
+#include "stdafx.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// 40,000 macro calls with several arguments each, padded with whitespace to
+// be trimmed and with a nested builtin call, with the default special
+// characters and with others, which the argument scanner looks up by class
+// rather than comparing with constants.
+
+static const int calls = 40000;
+
+static void arguments (const char *chars)
+{
+	char escape = chars[0], intro = chars[1], open = chars[2], argSep = chars[3], close = chars[4];
+	auto directive = [&](const string &text) {
+		return string(1, intro) + open + text + close;
+	};
+	string call = directive("M  alpha beta " + string(1, argSep) + "  gamma delta  " + argSep + " " +
+							directive("equal:i  one " + string(1, argSep) + " ONE ") + " " + argSep +
+							"  some longer argument text here ") + "\n";
+	string input = directive("M=[" + directive("1") + "|" + directive("2") + "|" + directive("3") + "|" +
+							 directive("4") + "]") + "\n";
+	string expected;
+	for (int i = 0; i < calls; ++ i) {
+		input += call;
+		expected += "[alpha beta|gamma delta|1|some longer argument text here]";	// Its line leaves no newline
+	}
+
+	string output;
+	double seconds = bench::Time([&] {
+		stemple::Expander expander;
+		expander.SetSpecialChars(escape, intro, open, argSep, close);
+		output = expander.Expand(input);
+	}, 3);
+	bench::Check(output == expected, "output");
+	printf("  %d calls with \"%s\": %.3fs, %.2fus each\n", calls, chars, seconds, seconds * 1e6 / calls);
+}
+
+BENCHMARK(Arguments)
+{
+	arguments("$$(,)");
+}
+
+BENCHMARK(ArgumentsCustomChars)
+{
+	arguments("\\%{;}");
+}
+
+//------------------------------------------------------------------------------
+// Once an expansion has warmed up, a macro call that expands its arguments
+// reuses the frames and streams of earlier calls, so it allocates nothing,
+// however much whitespace comes before its arguments.
+
+BENCHMARK(ArgumentCallAllocations)
+{
+	string input;
+	for (int i = 0; i < calls; ++ i) {
+		input += i % 2 ? "$(m a,b,c)\n" : "$(m   a, b,c)\n";
+	}
+	stemple::Expander expander;
+	expander.SetMacro("m", "$(1)$(2)$(3)");
+	stemple::Expansion expansion(expander, input.data(), input.size(), 4096);
+	size_t length = 0;
+	for (int i = 0; i < 3 && expansion.Next(); ++ i) {
+		length += expansion.GetChunk().size();
+	}
+	size_t before = bench::Allocations();
+	while (expansion.Next()) {
+		length += expansion.GetChunk().size();
+	}
+	size_t allocations = bench::Allocations() - before;
+	bench::Check(length == calls * 4, "output");
+	bench::Check(allocations == 0, "no allocations per call");
+	printf("  %d calls: %zu allocations after the first chunks\n", calls, allocations);
+}
@@ -0,0 +1,62 @@
+#include "stdafx.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Counting to 5,000 in a foreach loop with $((...)), against the way it had
+// to be done before: a five-digit counter of macros, each digit stepped by
+// a chain of $(if $(equal ...)) and carried into the next.
+
+static const int increments = 5000;
+
+static string items ()
+{
+	string items;
+	for (int i = 0; i < increments; ++ i) {
+		items += ",x";
+	}
+	return items;
+}
+
+BENCHMARK(Arithmetic)
+{
+	string input = "$(n=0)$(foreach I" + items() + ")$(n:=$((n + 1)))$(end)$(n)";
+	string output;
+	double seconds = bench::Time([&] {
+		stemple::Expander expander;
+		output = expander.Expand(input);
+	}, 3);
+	bench::Check(output == to_string(increments), "count");
+	printf("  %d increments with $((...)): %.3fs\n", increments, seconds);
+}
+
+BENCHMARK(ArithmeticEmulation)
+{
+	string next = "$(if $(equal $(1),0),1,";
+	for (int d = 1; d < 9; ++ d) {
+		next += "$(if $(equal $(1)," + to_string(d) + ")," + to_string(d + 1) + ",";
+	}
+	next += "0)))))))))";
+	string input = "$(next=" + next + ")";
+	for (int k = 0; k < 5; ++ k) {
+		input += "$(c" + to_string(k) + "=0)";
+	}
+	for (int k = 0; k < 5; ++ k) {
+		string c = "c" + to_string(k);
+		input += "$(inc" + to_string(k) + "=$(" + c + ":=$(next $(" + c + ")))";
+		if (k < 4) {
+			input += "$(if $(equal $(" + c + "),0))$(inc" + to_string(k + 1) + ")$(endif)";
+		}
+		input += ")";
+	}
+	input += "$(foreach I" + items() + ")$(inc0)$(end)$(c4)$(c3)$(c2)$(c1)$(c0)";
+	string output;
+	double seconds = bench::Time([&] {
+		stemple::Expander expander;
+		output = expander.Expand(input);
+	}, 3);
+	char expected[8];
+	snprintf(expected, sizeof expected, "%05d", increments);
+	bench::Check(output == expected, "count");
+	printf("  %d increments emulated with macros: %.3fs\n", increments, seconds);
+}
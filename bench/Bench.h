@@ -0,0 +1,55 @@
+// Bench
+// A small benchmark harness. Each benchmark registers itself by name with
+// BENCHMARK(), and the bench program runs them all, or those named on its
+// command line. Timings are the best of several runs. A benchmark can also
+// check a budget, eg, for memory, or that its output is right, and the run
+// fails if it's missed, so that regressions show up as failures rather than
+// only as larger numbers.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Bench__
+#define __stemple__Bench__
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace bench
+{
+	typedef void (*Benchmark) ();
+
+	//==========================================================================
+	//==========================================================================
+	struct Registration
+	{
+		Registration (const char *name, Benchmark benchmark);
+	};
+
+	// Best time, in seconds, of repeat runs of body.
+	double Time (const std::function<void()> &body, int repeat = 5);
+
+	// Bytes allocated with operator new, and not yet deleted.
+	size_t Allocated ();
+
+	// Calls to operator new so far.
+	size_t Allocations ();
+
+	// The most that Allocated() has been since the last call.
+	size_t Peak ();
+
+	// Reports a missed budget or a wrong result, and fails the run.
+	void Check (bool ok, const char *what);
+
+	// Creates an empty file, with a name no other file has, for a benchmark
+	// to write and then remove. Returns its pathname.
+	std::string TempFile ();
+}
+
+#define BENCHMARK(name) \
+	static void bench_##name (); \
+	static bench::Registration register_##name(#name, bench_##name); \
+	static void bench_##name ()
+
+#endif	// __stemple__Bench__
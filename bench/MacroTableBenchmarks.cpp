@@ -0,0 +1,98 @@
+#include "stdafx.h"
+
+#include <fstream>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// The memory that defined macros take, per macro, for 10k, 100k and 1M
+// generated definitions like MACRO_0000007 = "value 7 of the generated set",
+// about 45 characters of text each. Everything the expander allocates is
+// counted, but not what it had already before the first definition.
+
+static const size_t budget = 128;		// Bytes per macro
+
+static string name (int i)
+{
+	char text[24];
+	snprintf(text, sizeof text, "MACRO_%07d", i);
+	return text;
+}
+
+static string body (int i)
+{
+	return "value " + to_string(i) + " of the generated set";
+}
+
+BENCHMARK(MacroMemory)
+{
+	for (int count : { 10000, 100000, 1000000 }) {
+		stemple::Expander expander;
+		size_t before = bench::Allocated();
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < count; ++ i) {
+			expander.SetMacro(name(i), body(i));
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		size_t perMacro = (bench::Allocated() - before) / count;
+		bench::Check(perMacro <= budget, "bytes per macro");
+		bench::Check(expander.Expand("$(" + name(count - 1) + ")") == body(count - 1), "last macro");
+		printf("  %7d macros: %zu bytes each, %.3fs\n", count, perMacro, seconds);
+	}
+}
+
+//------------------------------------------------------------------------------
+// A million definitions from a defines file go straight into the table, so
+// the most memory used while reading them is hardly more than they take
+// once read.
+
+BENCHMARK(DefinesFileMemory)
+{
+	const int count = 1000000;
+	string pathname = bench::TempFile();
+	{
+		ofstream file(pathname, ios::binary);
+		for (int i = 0; i < count; ++ i) {
+			file << name(i) << '=' << body(i) << '\n';
+		}
+	}
+
+	stemple::Expander expander;
+	size_t before = bench::Allocated();
+	bench::Peak();
+	auto start = chrono::steady_clock::now();
+	bench::Check(expander.SetMacrosFromFile(pathname), "read");
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	size_t peak = (bench::Peak() - before) / count;
+	size_t perMacro = (bench::Allocated() - before) / count;
+	remove(pathname.c_str());
+	bench::Check(peak <= budget * 3 / 2, "peak bytes per macro");
+	bench::Check(expander.Expand("$(" + name(count - 1) + ")") == body(count - 1), "last macro");
+	printf("  %d macros: %zu bytes each, at most %zu while reading, %.3fs\n", count, perMacro, peak, seconds);
+}
+
+//------------------------------------------------------------------------------
+// A macro read and then redefined each time round a loop, as a counter or an
+// accumulator is. Once its expansion has been read, its body is written over
+// in place, so the table doesn't grow with the number of iterations.
+
+BENCHMARK(RedefineWhileReading)
+{
+	const int count = 100000;
+	const string padding(200, '.');
+	string items;
+	for (int i = 0; i < count; ++ i) {
+		items += ",x";
+	}
+	string input = "$(N=)$(foreach I" + items + ")$(if $(N))$(endif)$(N:=$(I)" + padding + ")$(end)";
+
+	stemple::Expander expander;
+	size_t before = bench::Allocated();
+	bench::Peak();
+	auto start = chrono::steady_clock::now();
+	bench::Check(expander.Expand(input).empty(), "expansion");
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	size_t perIteration = (bench::Peak() - before) / count;
+	bench::Check(perIteration < padding.size(), "bytes per iteration");
+	printf("  %d redefinitions: at most %zu bytes each, %.3fs\n", count, perIteration, seconds);
+}
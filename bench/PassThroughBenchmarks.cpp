@@ -0,0 +1,90 @@
+#include "stdafx.h"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#if defined _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <libstemple/cstream.h>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// About 8.4MB of text with no directives, passed through unchanged: from a
+// file, as the CLI opens a named input, and through a pipe read in blocks
+// from its descriptor, as the CLI reads standard input. The output must be
+// the input, byte for byte.
+
+static string text ()
+{
+	string text;
+	char line[80];
+	for (int i = 0; i < 142500; ++ i) {
+		snprintf(line, sizeof line, "The quick brown fox jumps over the lazy dog, line %07d.\n", i);
+		text += line;
+	}
+	return text;
+}
+
+BENCHMARK(PassThroughFile)
+{
+	const string input = text();
+	string pathname = bench::TempFile();
+	{
+		ofstream file(pathname, ios::binary);
+		file << input;
+	}
+
+	string output;
+	double seconds = bench::Time([&] {
+		stemple::Expander expander;
+		ifstream file(pathname, ios::binary);
+		ostringstream out;
+		expander.Expand(file, pathname, out);
+		output = out.str();
+	});
+	remove(pathname.c_str());
+	bench::Check(output == input, "output");
+	printf("  %.1fMB: %.3fs\n", input.length() / 1e6, seconds);
+}
+
+BENCHMARK(PassThroughPipe)
+{
+	const string input = text();
+
+	string output;
+	double seconds = bench::Time([&] {
+		int fds[2];
+#if defined _WIN32
+		if (_pipe(fds, 64 * 1024, _O_BINARY) != 0) {
+#else
+		if (pipe(fds) != 0) {
+#endif
+			bench::Check(false, "pipe");
+			return;
+		}
+		thread writer([&] {
+			for (size_t done = 0; done < input.length(); ) {
+				int n = (int)write(fds[1], input.data() + done, (unsigned)min<size_t>(input.length() - done, 64 * 1024));
+				if (n <= 0) break;
+				done += n;
+			}
+			close(fds[1]);
+		});
+		stemple::Expander expander;
+		stemple::fdreadbuf inputBuf(fds[0]);
+		istream in(&inputBuf);
+		ostringstream out;
+		expander.Expand(in, "Pipe", out);
+		writer.join();
+		close(fds[0]);
+		output = out.str();
+	});
+	bench::Check(output == input, "output");
+	printf("  %.1fMB: %.3fs\n", input.length() / 1e6, seconds);
+}
@@ -0,0 +1,159 @@
+// bench.cpp : Defines the entry point for the console application.
+//
+// Usage: bench [<name>...]
+// Runs the benchmarks whose names start with any of the arguments, or all of
+// them, in the order they were registered. Exits with 1 if any of them
+// missed a budget.
+
+#include "stdafx.h"
+
+#include <new>
+#if defined _WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Every allocation is counted, so that benchmarks can report the memory that
+// a structure takes, without depending on the platform's malloc statistics.
+// The size is kept in front of the block, where delete can find it.
+
+static atomic<size_t> allocated(0);
+static atomic<size_t> peak(0);
+static atomic<size_t> allocations(0);
+
+static const size_t header = sizeof(max_align_t);
+
+void *operator new (size_t size)
+{
+	char *block = (char *)malloc(size + header);
+	if (!block) throw bad_alloc();
+	*(size_t *)block = size;
+	++ allocations;
+	size_t now = allocated += size;
+	for (size_t was = peak; now > was && !peak.compare_exchange_weak(was, now); ) {
+	}
+	return block + header;
+}
+
+void operator delete (void *p) noexcept
+{
+	if (p) {
+		char *block = (char *)p - header;
+		allocated -= *(size_t *)block;
+		free(block);
+	}
+}
+
+void operator delete (void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+//------------------------------------------------------------------------------
+namespace bench
+{
+	struct Entry
+	{
+		const char *Name;
+		Benchmark Run;
+	};
+
+	static vector<Entry> &registry ()
+	{
+		static vector<Entry> entries;
+		return entries;
+	}
+
+	static bool failed = false;
+
+	//--------------------------------------------------------------------------
+	Registration::Registration (const char *name, Benchmark benchmark)
+	{
+		registry().push_back({ name, benchmark });
+	}
+
+	//--------------------------------------------------------------------------
+	double Time (const function<void()> &body, int repeat)
+	{
+		double best = 0;
+		for (int i = 0; i < repeat; ++ i) {
+			auto start = chrono::steady_clock::now();
+			body();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (i == 0 || seconds < best) best = seconds;
+		}
+		return best;
+	}
+
+	//--------------------------------------------------------------------------
+	size_t Allocated ()
+	{
+		return allocated;
+	}
+
+	//--------------------------------------------------------------------------
+	size_t Allocations ()
+	{
+		return allocations;
+	}
+
+	//--------------------------------------------------------------------------
+	size_t Peak ()
+	{
+		return peak.exchange(allocated);
+	}
+
+	//--------------------------------------------------------------------------
+	void Check (bool ok, const char *what)
+	{
+		if (!ok) {
+			printf("  FAILED: %s\n", what);
+			failed = true;
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	string TempFile ()
+	{
+#if defined _WIN32
+		char directory[MAX_PATH + 1], pathname[MAX_PATH + 1];
+		if (!GetTempPathA(sizeof directory, directory) || !GetTempFileNameA(directory, "bch", 0, pathname)) {
+			Check(false, "temporary file");
+			return string();
+		}
+		return pathname;
+#else
+		const char *directory = getenv("TMPDIR");
+		string pathname = string(directory && *directory ? directory : "/tmp") + "/benchXXXXXX";
+		int fd = mkstemp(&pathname[0]);
+		if (fd < 0) {
+			Check(false, "temporary file");
+			return string();
+		}
+		close(fd);
+		return pathname;
+#endif
+	}
+}
+
+//------------------------------------------------------------------------------
+int main (int argc, char **argv)
+{
+	vector<string> names(argv + 1, argv + argc);
+	for (auto &entry : bench::registry()) {
+		bool wanted = names.empty();
+		for (auto &name : names) {
+			wanted = wanted || string(entry.Name).compare(0, name.length(), name) == 0;
+		}
+		if (wanted) {
+			printf("%s\n", entry.Name);
+			entry.Run();
+			fflush(stdout);
+		}
+	}
+	return bench::failed ? 1 : 0;
+}
@@ -56,6 +56,16 @@ void test_SetMacroSimple (void)
 	free(expansion);
 }
 
+void test_SetMacros (void)
+{
+	const char *names[] = { "A", "B", "C" };
+	const char *bodies[] = { "aaa", "$(C)", "ccc" };
+	stemple_SetMacros(expander, names, bodies, 3);
+	char *expansion = stemple_ExpandString(expander, "$(A) $(B) $(C)");
+	TEST_ASSERT_EQUAL_STRING("aaa ccc ccc", expansion);
+	free(expansion);
+}
+
 void test_SetSpecialChars (void)
 {
 	stemple_SetSpecialChars(expander, '\\', '%', '{', ';', '}');
@@ -103,3 +113,132 @@ void test_ExpandFile (void)
 	fclose(fin);
 	fclose(fout);
 }
+
+void test_NextChunk (void)
+{
+	stemple_Expansion *expansion;
+	const char *chunk;
+	size_t length;
+	char output[256] = "";
+	int count = 0;
+
+	stemple_SetMacro(expander, "A", "aaa");
+	expansion = stemple_CreateStringExpansion(expander, "1: $(A)\n2: $(A)\n3: $(A)\n", 8);
+	TEST_ASSERT_NOT_NULL(expansion);
+	while ((chunk = stemple_NextChunk(expansion, &length)) != NULL) {
+		strncat(output, chunk, length);
+		++ count;
+	}
+	TEST_ASSERT_EQUAL_STRING("1: aaa\n2: aaa\n3: aaa\n", output);
+	TEST_ASSERT_EQUAL_INT(3, count);
+	TEST_ASSERT_NULL(stemple_NextChunk(expansion, &length));
+	TEST_ASSERT_EQUAL_INT(0, (int)length);
+	stemple_DestroyExpansion(expansion);
+}
+
+void test_ExpandStringN (void)
+{
+	const char *input = "$(A) $(A)XXXX";
+	char output[8];
+	size_t length;
+
+	stemple_SetMacro(expander, "A", "aaa");
+	length = stemple_ExpandStringN(expander, input, 9, output, sizeof(output));
+	TEST_ASSERT_EQUAL_INT(7, (int)length);
+	TEST_ASSERT_EQUAL_STRING("aaa aaa", output);
+
+	// Too small: truncated, but reports the size needed
+	length = stemple_ExpandStringN(expander, input, 9, output, 4);
+	TEST_ASSERT_EQUAL_INT(7, (int)length);
+	TEST_ASSERT_EQUAL_STRING_LEN("aaa ", output, 4);
+
+	// Just measure
+	length = stemple_ExpandStringN(expander, input, 9, NULL, 0);
+	TEST_ASSERT_EQUAL_INT(7, (int)length);
+}
+
+typedef struct
+{
+	const char *data;
+	size_t offset;
+	size_t length;
+} Buffer;
+
+static size_t readBuffer (void *context, char *buffer, size_t capacity)
+{
+	Buffer *in = (Buffer *)context;
+	size_t n = in->length - in->offset;
+	if (n > 3) n = 3;	// Force several reads
+	if (n > capacity) n = capacity;
+	memcpy(buffer, in->data + in->offset, n);
+	in->offset += n;
+	return n;
+}
+
+static size_t writeBuffer (void *context, const char *data, size_t length)
+{
+	Buffer *out = (Buffer *)context;
+	memcpy((char *)out->data + out->length, data, length);
+	out->length += length;
+	((char *)out->data)[out->length] = '\0';
+	return length;
+}
+
+static size_t failWrite (void *context, const char *data, size_t length)
+{
+	return 0;
+}
+
+void test_ExpandReaderAndWriter (void)
+{
+	char output[256];
+	Buffer in = { "$(if $(B))\nB\n$(else)\n$(A) $(A)\n$(endif)\n", 0, 0 };
+	Buffer out = { output, 0, 0 };
+	in.length = strlen(in.data);
+
+	stemple_SetMacro(expander, "A", "aaa");
+	TEST_ASSERT_TRUE(stemple_ExpandReader(expander, readBuffer, &in, "Reader", writeBuffer, &out));
+	TEST_ASSERT_EQUAL_STRING("aaa aaa\n", output);
+
+	out.length = 0;
+	TEST_ASSERT_TRUE(stemple_ExpandStringToWriter(expander, "[$(A)]", 6, writeBuffer, &out));
+	TEST_ASSERT_EQUAL_STRING("[aaa]", output);
+
+	TEST_ASSERT_FALSE(stemple_ExpandStringToWriter(expander, "[$(A)]", 6, failWrite, NULL));
+}
+
+static bool joinBuiltin (void *context, size_t count, const char *const *args, const size_t *lengths, stemple_Output *output)
+{
+	size_t i;
+	for (i = 0; i < count; ++ i) {
+		if (i) stemple_Write(output, (const char *)context, 1);
+		stemple_Write(output, args[i], lengths[i]);
+	}
+	return true;
+}
+
+static bool refBuiltin (void *context, size_t count, const char *const *args, const size_t *lengths, stemple_Output *output)
+{
+	if (count < 1) return false;
+	stemple_Write(output, "$(", 2);
+	stemple_Write(output, args[0], lengths[0]);
+	stemple_Write(output, ")", 1);
+	stemple_SetRescan(output, count > 1);
+	return true;
+}
+
+void test_RegisterBuiltin (void)
+{
+	stemple_RegisterBuiltin(expander, "join", joinBuiltin, "-");
+	stemple_RegisterBuiltin(expander, "ref", refBuiltin, NULL);
+	stemple_SetMacro(expander, "A", "aaa");
+
+	char *expansion = stemple_ExpandString(expander, "$(join x,$(A),y)");
+	TEST_ASSERT_EQUAL_STRING("x-aaa-y", expansion);
+	free(expansion);
+
+	// Taken literally, unless the builtin asks for a rescan
+	expansion = stemple_ExpandString(expander, "$(ref A) $(ref A,rescan)");
+	TEST_ASSERT_EQUAL_STRING("$(A) aaa", expansion);
+	free(expansion);
+}
@@ -5,15 +5,25 @@
 
 extern void test_SetMacro (void);
 extern void test_SetMacroSimple (void);
+extern void test_SetMacros (void);
 extern void test_SetSpecialChars (void);
 extern void test_ExpandFile (void);
+extern void test_NextChunk (void);
+extern void test_ExpandStringN (void);
+extern void test_ExpandReaderAndWriter (void);
+extern void test_RegisterBuiltin (void);
 
 int main (int argc, char **argv)
 {
 	UNITY_BEGIN();
 	RUN_TEST(test_SetMacro);
 	RUN_TEST(test_SetMacroSimple);
+	RUN_TEST(test_SetMacros);
 	RUN_TEST(test_SetSpecialChars);
 	RUN_TEST(test_ExpandFile);
+	RUN_TEST(test_NextChunk);
+	RUN_TEST(test_ExpandStringN);
+	RUN_TEST(test_ExpandReaderAndWriter);
+	RUN_TEST(test_RegisterBuiltin);
 	return UNITY_END();
 }
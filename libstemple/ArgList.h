@@ -7,15 +7,264 @@
 #ifndef __stemple__ArgList__
 #define __stemple__ArgList__
 
+#include <cstddef>
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace stemple
 {
-	// NOTE: This should really be vector<const string> but that causes
-	// compiler errors.
+	//==========================================================================
+	// Argument list passed to directives. The first few arguments are held
+	// inline, and clearing the list keeps the strings it has held, so that a
+	// list that's reused, as each directive being collected reuses its own,
+	// stops allocating once its strings are big enough.
+	//==========================================================================
+	class ArgList
+	{
+	public:
+		static const size_t InlineCount = 4;
 
-	typedef std::vector<std::string> ArgList;
+		//----------------------------------------------------------------------
+		class const_iterator
+		{
+		public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef std::string value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef const std::string *pointer;
+			typedef const std::string &reference;
+
+			const_iterator (const ArgList *list, size_t index) :
+				list(list),
+				index(index)
+			{
+			}
+
+			reference operator* () const
+			{
+				return (*list)[index];
+			}
+
+			pointer operator-> () const
+			{
+				return &(*list)[index];
+			}
+
+			const_iterator &operator++ ()
+			{
+				++ index;
+				return *this;
+			}
+
+			const_iterator operator++ (int)
+			{
+				return const_iterator(list, index ++);
+			}
+
+			const_iterator operator+ (size_t n) const
+			{
+				return const_iterator(list, index + n);
+			}
+
+			bool operator== (const const_iterator &other) const
+			{
+				return index == other.index;
+			}
+
+			bool operator!= (const const_iterator &other) const
+			{
+				return index != other.index;
+			}
+
+		private:
+			const ArgList *list;
+			size_t index;
+		};
+
+		//----------------------------------------------------------------------
+		ArgList () :
+			count(0)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		template<class Iterator>
+		ArgList (Iterator first, Iterator last) :
+			count(0)
+		{
+			for (; first != last; ++ first) {
+				push_back(*first);
+			}
+		}
+
+		//----------------------------------------------------------------------
+		ArgList (const ArgList &other) :
+			ArgList(other.begin(), other.end())
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// Moves are noexcept, so that a vector of lists, or of anything
+		// holding one, moves them rather than copying them when it grows.
+		ArgList (ArgList &&other) noexcept :
+			overflow(std::move(other.overflow)),
+			count(other.count)
+		{
+			for (size_t i = 0; i < InlineCount; ++ i) {
+				inlined[i].swap(other.inlined[i]);
+			}
+			other.count = 0;
+		}
+
+		//----------------------------------------------------------------------
+		ArgList &operator= (const ArgList &other)
+		{
+			if (this != &other) {
+				clear();
+				for (auto &arg : other) {
+					push_back(arg);
+				}
+			}
+			return *this;
+		}
+
+		//----------------------------------------------------------------------
+		// Takes other's strings, and leaves it with these, to be reused.
+		ArgList &operator= (ArgList &&other) noexcept
+		{
+			if (this != &other) {
+				overflow.swap(other.overflow);
+				for (size_t i = 0; i < InlineCount; ++ i) {
+					inlined[i].swap(other.inlined[i]);
+				}
+				count = other.count;
+				other.count = 0;
+			}
+			return *this;
+		}
+
+		//----------------------------------------------------------------------
+		size_t size () const
+		{
+			return count;
+		}
+
+		//----------------------------------------------------------------------
+		bool empty () const
+		{
+			return !count;
+		}
+
+		//----------------------------------------------------------------------
+		const std::string &operator[] (size_t index) const
+		{
+			return index < InlineCount ? inlined[index] : overflow[index - InlineCount];
+		}
+
+		//----------------------------------------------------------------------
+		const_iterator begin () const
+		{
+			return const_iterator(this, 0);
+		}
+
+		//----------------------------------------------------------------------
+		const_iterator end () const
+		{
+			return const_iterator(this, count);
+		}
+
+		//----------------------------------------------------------------------
+		void clear ()
+		{
+			count = 0;
+		}
+
+		//----------------------------------------------------------------------
+		// Adds an empty argument, to be filled in, reusing the string of one
+		// that was cleared.
+		std::string &Add ()
+		{
+			if (count >= InlineCount && count - InlineCount == overflow.size()) {
+				overflow.emplace_back();
+			}
+			std::string &arg = count < InlineCount ? inlined[count] : overflow[count - InlineCount];
+			++ count;
+			arg.clear();
+			return arg;
+		}
+
+		//----------------------------------------------------------------------
+		void push_back (const std::string &arg)
+		{
+			Add() = arg;
+		}
+
+	private:
+		std::string					inlined[InlineCount];
+		std::vector<std::string>	overflow;	// Beyond the first InlineCount
+		size_t						count;
+	};
+
+	// Arguments are held, never copied, by the stream that refers to them
+	typedef std::shared_ptr<const ArgList> SharedArgList;
+
+	//--------------------------------------------------------------------------
+	inline SharedArgList ShareArgs (ArgList &&args)
+	{
+		return args.empty() ? nullptr : std::make_shared<const ArgList>(std::move(args));
+	}
+
+	//--------------------------------------------------------------------------
+	// Copies arguments that are to be reused, such as a directive's.
+	inline SharedArgList ShareArgs (const ArgList &args)
+	{
+		return args.empty() ? nullptr : std::make_shared<const ArgList>(args);
+	}
+
+	//==========================================================================
+	// The arguments of macro expansions, each with the name of its macro. A
+	// frame goes back on the free list when its expansion ends, so a macro
+	// call takes one that's already allocated, and whose strings are already
+	// big enough. Frames last as long as the list, so a frame's name does
+	// too, even once the frame has been reused.
+	//==========================================================================
+	class ArgFrames
+	{
+	public:
+		struct Frame
+		{
+			ArgList Args;
+			std::string Name;
+		};
+
+		//----------------------------------------------------------------------
+		// Swaps args into a frame, leaving args with the frame's old strings.
+		std::shared_ptr<Frame> Take (const std::string &name, ArgList &args)
+		{
+			std::shared_ptr<Frame> frame;
+			if (free.empty()) {
+				frame = std::make_shared<Frame>();
+			} else {
+				frame = std::move(free.back());
+				free.pop_back();
+			}
+			frame->Args = std::move(args);
+			frame->Name = name;
+			return frame;
+		}
+
+		//----------------------------------------------------------------------
+		// Once the expansion has ended, and nothing is reading the arguments.
+		void Return (std::shared_ptr<Frame> &&frame)
+		{
+			free.push_back(std::move(frame));
+		}
+
+	private:
+		std::vector<std::shared_ptr<Frame>> free;
+	};
 }
 
 #endif // __stemple__ArgList__
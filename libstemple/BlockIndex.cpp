@@ -0,0 +1,162 @@
+// BlockIndex
+// Index of the block directive structure of template text.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	// Source adapter that lets the scanner read directly from a string.
+
+	struct TextSource
+	{
+		const char *text;
+		size_t length;
+		size_t offset;
+
+		bool get (char &c)
+		{
+			if (offset >= length) return false;
+			c = text[offset ++];
+			return true;
+		}
+
+		int peek ()
+		{
+			return offset < length ? text[offset] : char_traits<char>::eof();
+		}
+
+		size_t tell ()
+		{
+			return offset;
+		}
+	};
+
+	//--------------------------------------------------------------------------
+	// Source adapter that reads text in extents, moving on from one to the
+	// next as each is exhausted.
+
+	struct ExtentSource
+	{
+		const StringView *extent;
+		const StringView *next;
+		const StringView *end;
+		size_t at;				// Within the extent
+		size_t offset;			// Within the whole text
+
+		bool ready ()
+		{
+			while (at == extent->Length) {
+				if (next == end) return false;
+				extent = next ++;
+				at = 0;
+			}
+			return true;
+		}
+
+		bool get (char &c)
+		{
+			if (!ready()) return false;
+			c = extent->Data[at ++];
+			++ offset;
+			return true;
+		}
+
+		int peek ()
+		{
+			return ready() ? extent->Data[at] : char_traits<char>::eof();
+		}
+
+		size_t tell ()
+		{
+			return offset;
+		}
+	};
+
+	//--------------------------------------------------------------------------
+	void BlockIndex::Build (const char *text, size_t length, const Syntax &s)
+	{
+		syntax = s;
+		targets.clear();
+		built = true;
+
+		// Only text containing at least one directive can contain blocks
+		if (memchr(text, syntax.Intro, length)) {
+			build(TextSource{ text, length, 0 }, s);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	void BlockIndex::Build (const StringView &first, const vector<StringView> &rest, const Syntax &s)
+	{
+		if (rest.empty()) {
+			Build(first.Data, first.Length, s);
+			return;
+		}
+		syntax = s;
+		targets.clear();
+		built = true;
+
+		bool directives = memchr(first.Data, syntax.Intro, first.Length) != nullptr;
+		for (size_t i = 0; i < rest.size() && !directives; ++ i) {
+			directives = memchr(rest[i].Data, syntax.Intro, rest[i].Length) != nullptr;
+		}
+		if (directives) {
+			build(ExtentSource{ &first, rest.data(), rest.data() + rest.size(), 0, 0 }, s);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Source is copied, so that the text can be read a second time.
+
+	template<typename Source>
+	void BlockIndex::build (Source src, const Syntax &syntax)
+	{
+		Source text(src);
+
+		// Match up the block directives. Each level of the stack holds the end
+		// offsets of the directives at that level of block nesting that are
+		// still waiting for their next sibling. An $(endif) waits for the next
+		// sibling of its enclosing block.
+		BlockScanner scanner(syntax);
+		vector<vector<size_t>> waiting(1);
+		vector<pair<size_t, size_t>> links;
+		size_t start;
+		BlockScanner::Kind kind;
+		while ((kind = scanner.Next(src, start)) != BlockScanner::NONE) {
+			if (kind == BlockScanner::IF) {
+				waiting.push_back({ src.tell() });
+			} else if (kind == BlockScanner::FOREACH || kind == BlockScanner::END) {
+				continue;
+			} else if (waiting.size() > 1) {
+				for (size_t end : waiting.back()) {
+					links.push_back({ end, start });
+				}
+				if (kind == BlockScanner::ENDIF) {
+					waiting.pop_back();
+					waiting.back().push_back(src.tell());
+				} else {
+					waiting.back().assign(1, src.tell());
+				}
+			}
+		}
+
+		// Work out line and column of each sibling so that stream positions
+		// remain correct after a jump.
+		sort(begin(links), end(links), [](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+			return a.second < b.second;
+		});
+		Position position("");
+		char c;
+		for (auto &link : links) {
+			while (text.tell() < link.second && text.get(c)) {
+				position.Update(c);
+			}
+			targets[link.first] = { link.second, position.GetNextLine(), position.GetNextColumn() };
+		}
+	}
+}
@@ -0,0 +1,426 @@
+// BlockIndex
+// Raw (non-expanding) scanner for the block directive structure of template
+// text - $(if), $(elseif), $(else) and $(endif), and $(foreach) and $(end) -
+// and an index built from it that maps each block directive to the start of
+// its next sibling. Used to jump over false branches without expanding
+// anything inside them, and to find the end of a loop body.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__BlockIndex__
+#define __stemple__BlockIndex__
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Builtin.h"
+
+namespace stemple
+{
+	//==========================================================================
+	// What each character is to the lexer, found with a single lookup rather
+	// than by searching a string of delimiters, or by isspace(), which also
+	// depends on the locale.
+	//==========================================================================
+	class CharClasses
+	{
+	public:
+		enum Class : uint8_t
+		{
+			SPACE		= 0x01,		// ' ', '\t', '\n', '\v', '\f' and '\r' only
+			NAME_END	= 0x02,		// Ends a directive's name
+			MOD_END		= 0x04,		// Ends a modifier
+			ARG_END		= 0x08,		// Ends an argument
+			TEXT_END	= 0x10,		// Ends the body of an assignment
+		};
+
+		//----------------------------------------------------------------------
+		CharClasses ()
+		{
+			memset(table, 0, sizeof table);
+			Add(" \t\n\v\f\r", SPACE);
+		}
+
+		//----------------------------------------------------------------------
+		void Add (const char *chars, uint8_t classes)
+		{
+			for (; *chars; ++ chars) {
+				Add(*chars, classes);
+			}
+		}
+
+		//----------------------------------------------------------------------
+		void Add (char c, uint8_t classes)
+		{
+			table[(unsigned char)c] |= classes;
+		}
+
+		//----------------------------------------------------------------------
+		// Whether c is in any of classes.
+		bool Is (char c, uint8_t classes) const
+		{
+			return (table[(unsigned char)c] & classes) != 0;
+		}
+
+		//----------------------------------------------------------------------
+		bool IsSpace (char c) const
+		{
+			return Is(c, SPACE);
+		}
+
+	private:
+		uint8_t table[256];
+	};
+
+	//==========================================================================
+	// The special characters the scanner needs to recognize directives.
+	//==========================================================================
+	struct Syntax
+	{
+		char Escape;
+		char Intro;
+		char Open;
+		char ArgSep;
+		char Close;
+		char Mods;
+		CharClasses Classes;	// Filled in from the above by Classify()
+
+		//----------------------------------------------------------------------
+		void Classify ()
+		{
+			Classes = CharClasses();
+			Classes.Add(" \t:+=", CharClasses::NAME_END | CharClasses::MOD_END);
+			Classes.Add(Mods, CharClasses::MOD_END);
+			Classes.Add(ArgSep, CharClasses::ARG_END);
+			Classes.Add(Close, CharClasses::NAME_END | CharClasses::MOD_END | CharClasses::ARG_END | CharClasses::TEXT_END);
+		}
+
+		//----------------------------------------------------------------------
+		bool operator== (const Syntax &other) const
+		{
+			return Escape == other.Escape && Intro == other.Intro && Open == other.Open &&
+				   ArgSep == other.ArgSep && Close == other.Close && Mods == other.Mods;
+		}
+	};
+
+	//==========================================================================
+	// Lexes directives the same way Expander does, but without expanding
+	// anything, so that it can be run over text that is going to be skipped.
+	// Only directives at the top level of the scanned text (ie, not nested in
+	// the arguments of another directive) are reported.
+	//==========================================================================
+	class BlockScanner
+	{
+	public:
+		enum Kind { NONE, IF, ELSEIF, ELSE, ENDIF, FOREACH, END };
+
+		//----------------------------------------------------------------------
+		BlockScanner (const Syntax &syntax) :
+			syntax(syntax),
+			capture(nullptr)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// If set, the raw text of each top-level directive is collected here.
+		void SetCapture (std::string *text)
+		{
+			capture = text;
+		}
+
+		//----------------------------------------------------------------------
+		// Whether the last character read was within a directive.
+		bool IsInDirective () const
+		{
+			return !frames.empty();
+		}
+
+		//----------------------------------------------------------------------
+		// Reads from src until a complete top-level block directive has been
+		// consumed and returns its kind, with start set to the offset of its
+		// intro character. Returns NONE at the end of src.
+		//
+		// Source must provide bool get(char &), int peek() and size_t tell().
+		template<typename Source>
+		Kind Next (Source &src, size_t &start)
+		{
+			char c;
+			while (read(src, c)) {
+				char p = src.peek();
+				bool escaped = false;
+				if (c == syntax.Escape && (p == syntax.Intro || p == syntax.Escape)) {
+					// Escaped intro or escape is a literal character
+					read(src, c);
+					escaped = true;
+					p = src.peek();
+				}
+
+				if (frames.empty()) {
+					if (!escaped && c == syntax.Intro && p == syntax.Open) {
+						start = src.tell() - 1;
+						read(src, c);
+						frames.push_back(Frame());
+						if (capture) {
+							capture->assign(1, syntax.Intro);
+							capture->push_back(syntax.Open);
+						}
+					}
+					continue;
+				}
+
+				Kind kind = NONE;
+				if (process(src, c, p, escaped, kind) && kind != NONE) {
+					return kind;
+				}
+			}
+			return NONE;
+		}
+
+	private:
+		struct Frame
+		{
+			enum State { NAME, TOKEN, MODS, ARGS, TEXT, RAWTEXT };
+			State state = NAME;
+			std::string name;
+			bool dynamic = false;	// Name contains a nested directive
+			bool spaced = false;	// Whitespace seen while looking for a token
+			int args = 0;			// Number of arguments seen so far
+			int nested = 0;			// Nested parentheses in an unexpanded body
+		};
+
+		//----------------------------------------------------------------------
+		template<typename Source>
+		bool read (Source &src, char &c)
+		{
+			if (!src.get(c)) return false;
+			if (capture && frames.size()) capture->push_back(c);
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		// Handles character c within the innermost open directive. Returns true
+		// if that closes a top-level directive, setting its kind.
+		template<typename Source>
+		bool process (Source &src, char c, char p, bool escaped, Kind &kind)
+		{
+			Frame *f = &frames.back();
+			for (;;) {
+				switch (f->state) {
+				case Frame::TOKEN:
+					// Mirrors Expander::getToken(), which never expands
+					if (syntax.Classes.IsSpace(c)) {
+						f->spaced = true;
+						return false;
+					} else if (c == ':') {
+						if (p == '+') {
+							read(src, c);
+							if (src.peek() == '=') {
+								read(src, c);
+								f->state = Frame::TEXT;
+								return false;
+							}
+							return close(kind);
+						} else if (p == '=') {
+							read(src, c);
+							f->state = Frame::TEXT;
+							return false;
+						} else if (syntax.Mods == ':') {
+							f->state = Frame::MODS;
+							return false;
+						}
+						return close(kind);
+					} else if (c == '+') {
+						if (p == '=') {
+							read(src, c);
+							f->state = Frame::RAWTEXT;
+							return false;
+						} else if (syntax.Mods == '+') {
+							f->state = Frame::MODS;
+							return false;
+						}
+						return close(kind);
+					} else if (c == syntax.Mods) {
+						f->state = Frame::MODS;
+						return false;
+					} else if (c == '=') {
+						f->state = Frame::RAWTEXT;
+						return false;
+					} else if (c == syntax.Close) {
+						return close(kind);
+					} else if (f->spaced) {
+						// First character of the first argument
+						f->state = Frame::ARGS;
+						f->args = 1;
+						continue;
+					}
+					return close(kind);
+
+				case Frame::RAWTEXT:
+					// Mirrors collectString() with expand == false
+					if (c == syntax.Escape && p == syntax.Close) {
+						read(src, c);
+					} else if (c == syntax.Close && !f->nested) {
+						return close(kind);
+					} else if (!escaped && c == syntax.Open) {
+						++ f->nested;
+					} else if (!escaped && c == syntax.Close) {
+						-- f->nested;
+					}
+					return false;
+
+				default:
+					if (f->state == Frame::NAME && f->name.empty() && !f->dynamic &&
+						!escaped && c == syntax.Open) {
+						// $((<expr>)), which is collected raw up to the
+						// matching pair of closing delimiters
+						f->state = Frame::RAWTEXT;
+						f->nested = 1;
+						return false;
+					}
+					// Mirrors collectString() with expand == true
+					if (!escaped && c == syntax.Intro && p == syntax.Open) {
+						read(src, c);
+						if (f->state == Frame::NAME) f->dynamic = true;
+						frames.push_back(Frame());
+						return false;
+					}
+					uint8_t delims =
+						f->state == Frame::NAME ? CharClasses::NAME_END :
+						f->state == Frame::MODS ? CharClasses::MOD_END :
+						f->state == Frame::ARGS ? CharClasses::ARG_END : CharClasses::TEXT_END;
+					if (c == syntax.Escape && syntax.Classes.Is(p, delims)) {
+						read(src, c);
+						if (f->state == Frame::NAME) f->name += c;
+						return false;
+					}
+					if (!syntax.Classes.Is(c, delims)) {
+						if (f->state == Frame::NAME) f->name += c;
+						return false;
+					}
+					if (f->state == Frame::ARGS && c == syntax.ArgSep) {
+						++ f->args;
+						return false;
+					}
+					if (f->state == Frame::ARGS || f->state == Frame::TEXT) {
+						// The closing delimiter
+						return close(kind);
+					}
+					// End of name or modifier - look for the following token
+					f->state = Frame::TOKEN;
+					f->spaced = false;
+					continue;
+				}
+			}
+		}
+
+		//----------------------------------------------------------------------
+		bool close (Kind &kind)
+		{
+			const Frame &f = frames.back();
+			kind = NONE;
+			if (frames.size() == 1 && !f.dynamic) {
+				if (f.name == "if") {
+					// Only the one-argument form opens a block
+					if (f.args != 2 && f.args != 3) kind = IF;
+				} else if (f.name == "elseif") {
+					kind = ELSEIF;
+				} else if (f.name == "else") {
+					kind = ELSE;
+				} else if (f.name == "endif") {
+					kind = ENDIF;
+				} else if (f.name == "foreach") {
+					kind = FOREACH;
+				} else if (f.name == "end") {
+					kind = END;
+				}
+			}
+			frames.pop_back();
+			return frames.empty();
+		}
+
+		const Syntax &syntax;
+		std::string *capture;
+		std::vector<Frame> frames;
+	};
+
+	//==========================================================================
+	// Maps the end of each top-level block directive in a piece of text to the
+	// start of its next sibling, ie, the matching $(elseif), $(else) or
+	// $(endif). Built once per text (eg, a macro body) and reused.
+	//==========================================================================
+	class BlockIndex
+	{
+	public:
+		// Where to resume reading: the intro of the sibling directive
+		struct Target
+		{
+			size_t Offset;
+			int Line;
+			int Column;
+		};
+
+		//----------------------------------------------------------------------
+		BlockIndex () :
+			built(false)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		bool IsBuiltFor (const Syntax &s) const
+		{
+			return built && syntax == s;
+		}
+
+		//----------------------------------------------------------------------
+		void Build (const char *text, size_t length, const Syntax &syntax);
+
+		//----------------------------------------------------------------------
+		void Build (const std::string &text, const Syntax &syntax)
+		{
+			Build(text.data(), text.length(), syntax);
+		}
+
+		// Text in more than one extent, eg, a macro body that has grown large
+		// by appending, indexed as if it were all in one.
+		void Build (const StringView &first, const std::vector<StringView> &rest, const Syntax &syntax);
+
+		//----------------------------------------------------------------------
+		// Installs targets built earlier, eg, loaded from a compiled template.
+		void Assign (const Syntax &s, std::map<size_t, Target> &&t)
+		{
+			syntax = s;
+			targets = std::move(t);
+			built = true;
+		}
+
+		//----------------------------------------------------------------------
+		const std::map<size_t, Target> &GetTargets () const
+		{
+			return targets;
+		}
+
+		//----------------------------------------------------------------------
+		// Returns the sibling of the block directive that ends at offset end,
+		// or nullptr if there is no such directive (or it is unmatched).
+		const Target *Find (size_t end) const
+		{
+			auto entry = targets.find(end);
+			return entry != targets.end() ? &entry->second : nullptr;
+		}
+
+	private:
+		template<typename Source>
+		void build (Source src, const Syntax &syntax);
+
+		bool built;
+		Syntax syntax;
+		std::map<size_t, Target> targets;
+	};
+}
+
+#endif	// __stemple__BlockIndex__
@@ -0,0 +1,97 @@
+// Builtin
+// Native builtin directives, written in C++ and registered with an Expander,
+// for template logic that would be too slow as macros. A native builtin gets
+// its arguments as views of the expanded text, and writes its result to a
+// BuiltinOutput. The result is taken literally, as if quoted, unless the
+// builtin asks for it to be read again as input, directives and all.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Builtin__
+#define __stemple__Builtin__
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace stemple
+{
+	//==========================================================================
+	// Read-only view of a string owned by someone else: here, an argument,
+	// which is only valid for the duration of the call.
+	//==========================================================================
+	struct StringView
+	{
+		const char *Data;
+		size_t Length;
+
+		//----------------------------------------------------------------------
+		std::string ToString () const
+		{
+			return std::string(Data, Length);
+		}
+
+		//----------------------------------------------------------------------
+		bool operator== (const char *s) const
+		{
+			return strlen(s) == Length && memcmp(Data, s, Length) == 0;
+		}
+	};
+
+	//==========================================================================
+	// Where a native builtin writes its result.
+	//==========================================================================
+	class BuiltinOutput
+	{
+		friend class Expander;
+
+	public:
+		//----------------------------------------------------------------------
+		void Write (const char *data, size_t length)
+		{
+			text.append(data, length);
+		}
+
+		//----------------------------------------------------------------------
+		void Write (const std::string &s)
+		{
+			text += s;
+		}
+
+		//----------------------------------------------------------------------
+		void Write (const StringView &s)
+		{
+			text.append(s.Data, s.Length);
+		}
+
+		//----------------------------------------------------------------------
+		void Put (char c)
+		{
+			text += c;
+		}
+
+		//----------------------------------------------------------------------
+		// Has the result read again as input, so that directives in it are
+		// expanded, rather than taken literally.
+		void SetRescan (bool rescan = true)
+		{
+			this->rescan = rescan;
+		}
+
+	private:
+		BuiltinOutput () :
+			rescan(false)
+		{
+		}
+
+		std::string text;
+		bool rescan;
+	};
+
+	// Returns false on an error, eg, the wrong number of arguments.
+	typedef std::function<bool(const std::vector<StringView> &args, BuiltinOutput &output)> NativeBuiltin;
+}
+
+#endif	// __stemple__Builtin__
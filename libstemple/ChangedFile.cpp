@@ -0,0 +1,155 @@
+// ChangedFile
+// Output stream for a file that is only replaced if its contents change.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#include <sys/stat.h>
+#if defined _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	// The temporary file is named for this process and stream, so that two
+	// writing the same file at once each have their own, and a file of the
+	// user's beside it is left alone.
+
+	static string uniqueTempPath (const string &pathname)
+	{
+#if defined _WIN32
+		int pid = _getpid();
+#else
+		int pid = getpid();
+#endif
+		static atomic<unsigned> streams(0);
+		return pathname + "." + to_string(pid) + "." + to_string(++ streams) + ".tmp";
+	}
+
+	//--------------------------------------------------------------------------
+	// An empty file can't be mapped, so check separately that there is one.
+
+	changedfilebuf::changedfilebuf (const string &pathname, size_t size):
+		std::streambuf(),
+		pathname(pathname),
+		tempPath(uniqueTempPath(pathname)),
+		original(new MappedFile(pathname)),
+		exists(original->IsOpen() || ifstream(pathname).good()),
+		matched(0),
+		changed(false),
+		buffer(size ? size : 1)
+	{
+		setp(buffer.data(), buffer.data() + buffer.size());
+	}
+
+	//--------------------------------------------------------------------------
+	// Without a Commit(), the original is kept.
+
+	changedfilebuf::~changedfilebuf ()
+	{
+		if (temp.is_open()) {
+			temp.close();
+			remove(tempPath.c_str());
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	int changedfilebuf::overflow (int c)
+	{
+		if (sync() != 0) {
+			return EOF;
+		}
+		if (c != EOF) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	//--------------------------------------------------------------------------
+	int changedfilebuf::sync ()
+	{
+		bool ok = write(pbase(), pptr() - pbase());
+		setp(buffer.data(), buffer.data() + buffer.size());
+		return ok ? 0 : -1;
+	}
+
+	//--------------------------------------------------------------------------
+	// Compares a block of output with the next part of the original, until
+	// they differ; from then on, writes it to the temporary file.
+
+	bool changedfilebuf::write (const char *data, size_t n)
+	{
+		if (!n) return true;
+		if (!changed) {
+			size_t size = original->GetSize();
+			if (n <= size - matched && memcmp(original->GetData() + matched, data, n) == 0) {
+				matched += n;
+				return true;
+			}
+			if (!diverge()) return false;
+		}
+		temp.write(data, n);
+		return temp.good();
+	}
+
+	//--------------------------------------------------------------------------
+	// Starts the temporary file with the part of the original that matched.
+
+	bool changedfilebuf::diverge ()
+	{
+		changed = true;
+		temp.open(tempPath, ios_base::out | ios_base::binary | ios_base::trunc);
+		if (matched) {
+			temp.write(original->GetData(), matched);
+		}
+		return temp.good();
+	}
+
+	//--------------------------------------------------------------------------
+	// A replaced file keeps its permissions, such as being executable.
+
+	bool changedfilebuf::Commit ()
+	{
+		if (sync() != 0) {
+			return false;
+		}
+		if (!changed) {
+			if (exists && matched == original->GetSize()) {
+				// Identical, so leave the file alone
+				return true;
+			}
+			// The output is just the start of the original, or it's empty
+			// and there's no file yet
+			if (!diverge()) return false;
+		}
+		temp.close();
+		original.reset();	// Unmap before replacing
+		if (!temp) {
+			remove(tempPath.c_str());
+			return false;
+		}
+#if !defined _WIN32
+		struct stat st;
+		if (exists && stat(pathname.c_str(), &st) == 0 && chmod(tempPath.c_str(), st.st_mode & 07777) != 0) {
+			remove(tempPath.c_str());
+			return false;
+		}
+#endif
+#if defined _WIN32
+		// rename() won't replace an existing file on Windows
+		remove(pathname.c_str());
+#endif
+		if (rename(tempPath.c_str(), pathname.c_str()) != 0) {
+			remove(tempPath.c_str());
+			return false;
+		}
+		return true;
+	}
+}
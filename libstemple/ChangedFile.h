@@ -0,0 +1,89 @@
+// ChangedFile
+// Output stream for a file that is only replaced if what's written differs
+// from what it already holds, so that an unchanged file keeps its
+// modification time. Output is compared with the existing file as it's
+// written; nothing is written to disk unless and until they differ, when the
+// part that matched is copied to a temporary file and the rest follows it.
+// Commit() then renames the temporary file over the original.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__ChangedFile__
+#define __stemple__ChangedFile__
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+namespace stemple
+{
+	class changedfilebuf: public std::streambuf
+	{
+	public:
+		changedfilebuf (const std::string &pathname, size_t size = 64 * 1024);
+
+		virtual ~changedfilebuf ();
+
+		bool Commit ();
+
+		bool IsChanged () const
+		{
+			return changed || !exists;
+		}
+
+	protected:
+		virtual int overflow (int c = EOF);
+
+		virtual int sync ();
+
+		bool write (const char *data, size_t n);
+
+		bool diverge ();
+
+	private:
+		std::string pathname;
+		std::string tempPath;
+		std::unique_ptr<MappedFile> original;
+		bool exists;				// There is a file to compare with
+		size_t matched;				// Length of output that matches it so far
+		bool changed;				// Output differs, so is going to temp
+		std::ofstream temp;
+		std::vector<char> buffer;
+	};
+
+	//--------------------------------------------------------------------------
+	class ChangedFile: public std::ostream
+	{
+	public:
+		ChangedFile (const std::string &pathname):
+			std::ostream(&buf),
+			buf(pathname)
+		{
+		}
+
+		// Replaces the file if the output differs from it, or creates it if
+		// it didn't exist. Returns false if it couldn't be written. If this
+		// isn't called, the file is left as it was.
+		bool Commit ()
+		{
+			flush();
+			return good() && buf.Commit();
+		}
+
+		// Whether the output differs from the file, so far.
+		bool IsChanged () const
+		{
+			return buf.IsChanged();
+		}
+
+	private:
+		changedfilebuf buf;
+	};
+}
+
+#endif	// __stemple__ChangedFile__
@@ -0,0 +1,221 @@
+// CompiledTemplate
+// A template precompiled into a versioned binary file.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#include <cstdint>
+#include <sys/stat.h>
+#if defined _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace stemple
+{
+	const char *CompiledTemplate::Extension = ".stc";
+
+	namespace
+	{
+		// File layout: Header, the template text, then IndexCount Entries
+		// starting at IndexOffset (8-byte aligned). All values are in the byte
+		// order of the compiling machine, which ByteOrder is used to check.
+		const char Magic[8] = { 's', 't', 'e', 'm', 'p', 'l', 'e', '\0' };
+		const uint32_t ByteOrder = 0x01020304;
+
+		struct Header
+		{
+			char		Magic[8];
+			uint32_t	Version;
+			uint32_t	ByteOrder;
+			char		Chars[8];		// Special chars the index was built for
+			uint64_t	SourceSize;		// Size and time of the source when compiled,
+			int64_t		SourceTime;		// so that a stale file can be detected
+			uint64_t	TextOffset;
+			uint64_t	TextLength;
+			uint64_t	IndexOffset;
+			uint64_t	IndexCount;
+		};
+
+		struct Entry
+		{
+			uint64_t	End;
+			uint64_t	Offset;
+			int32_t		Line;
+			int32_t		Column;
+		};
+	}
+
+	//--------------------------------------------------------------------------
+	// Gets the size and modification time of a source file, which identify
+	// the version of it that was compiled. The time is as fine as the system
+	// keeps it (ns, or 100ns on Windows), not just to the second, so that an
+	// edit that keeps the length is noticed even within the same second.
+
+	bool CompiledTemplate::GetSourceInfo (const string &sourcePath, uint64_t &size, int64_t &time)
+	{
+#if defined _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExA(sourcePath.c_str(), GetFileExInfoStandard, &data)) return false;
+		size = (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+		time = (int64_t)((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime);
+#else
+		struct stat st;
+		if (stat(sourcePath.c_str(), &st) != 0) return false;
+		size = (uint64_t)st.st_size;
+#if defined __APPLE__
+		time = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Compiles sourcePath into GetCompiledPath(sourcePath), for expansion with
+	// the given syntax. The file is written under a temporary name and then
+	// renamed, so a concurrent Load never sees a partial file. The name is
+	// unique to this process and call, so that concurrent compiles of the
+	// same template each write their own.
+
+	bool CompiledTemplate::Compile (const string &sourcePath, const Syntax &syntax)
+	{
+		Header header = {};
+		if (!GetSourceInfo(sourcePath, header.SourceSize, header.SourceTime)) {
+			return false;
+		}
+		ifstream source(sourcePath, ios_base::in | ios_base::binary);
+		if (!source.good()) {
+			return false;
+		}
+		string text((istreambuf_iterator<char>(source)), istreambuf_iterator<char>());
+		if (text.size() != header.SourceSize) {
+			return false;
+		}
+
+		BlockIndex index;
+		index.Build(text, syntax);
+
+		memcpy(header.Magic, Magic, sizeof header.Magic);
+		header.Version = Version;
+		header.ByteOrder = ByteOrder;
+		header.Chars[0] = syntax.Escape;
+		header.Chars[1] = syntax.Intro;
+		header.Chars[2] = syntax.Open;
+		header.Chars[3] = syntax.ArgSep;
+		header.Chars[4] = syntax.Close;
+		header.Chars[5] = syntax.Mods;
+		header.TextOffset = sizeof header;
+		header.TextLength = text.size();
+		header.IndexOffset = (header.TextOffset + header.TextLength + 7) & ~(uint64_t)7;
+		header.IndexCount = index.GetTargets().size();
+
+		string compiledPath = GetCompiledPath(sourcePath);
+#if defined _WIN32
+		int pid = _getpid();
+#else
+		int pid = getpid();
+#endif
+		static atomic<unsigned> compiles(0);
+		string tempPath = compiledPath + "." + to_string(pid) + "." + to_string(++ compiles) + ".tmp";
+		{
+			ofstream out(tempPath, ios_base::out | ios_base::binary | ios_base::trunc);
+			out.write((const char *)&header, sizeof header);
+			out.write(text.data(), text.size());
+			static const char padding[8] = {};
+			out.write(padding, header.IndexOffset - header.TextOffset - header.TextLength);
+			for (auto &target : index.GetTargets()) {
+				Entry entry = { target.first, target.second.Offset, target.second.Line, target.second.Column };
+				out.write((const char *)&entry, sizeof entry);
+			}
+			out.flush();
+			if (!out.good()) {
+				out.close();
+				remove(tempPath.c_str());
+				return false;
+			}
+		}
+#if defined _WIN32
+		// rename() won't replace an existing file on Windows
+		remove(compiledPath.c_str());
+#endif
+		if (rename(tempPath.c_str(), compiledPath.c_str()) != 0) {
+			remove(tempPath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Maps the compiled form of sourcePath. Returns nullptr if there is none,
+	// or if it can't be used: a different format version or byte order, or a
+	// source file that has changed since it was compiled.
+
+	shared_ptr<CompiledTemplate> CompiledTemplate::Load (const string &sourcePath)
+	{
+		uint64_t sourceSize;
+		int64_t sourceTime;
+		if (!GetSourceInfo(sourcePath, sourceSize, sourceTime)) {
+			return nullptr;
+		}
+
+		shared_ptr<CompiledTemplate> compiled(new CompiledTemplate(sourcePath));
+		const MappedFile &file = compiled->file;
+		if (!file.IsOpen() || file.GetSize() < sizeof(Header)) {
+			return nullptr;
+		}
+		Header header;
+		memcpy(&header, file.GetData(), sizeof header);
+		if (memcmp(header.Magic, Magic, sizeof header.Magic) != 0 ||
+			header.Version != Version || header.ByteOrder != ByteOrder ||
+			header.SourceSize != sourceSize || header.SourceTime != sourceTime ||
+			header.TextLength != sourceSize ||
+			header.TextOffset + header.TextLength > file.GetSize() ||
+			header.IndexOffset > file.GetSize() ||
+			header.IndexCount > (file.GetSize() - header.IndexOffset) / sizeof(Entry)) {
+			return nullptr;
+		}
+
+		Syntax syntax;
+		syntax.Escape = header.Chars[0];
+		syntax.Intro = header.Chars[1];
+		syntax.Open = header.Chars[2];
+		syntax.ArgSep = header.Chars[3];
+		syntax.Close = header.Chars[4];
+		syntax.Mods = header.Chars[5];
+		syntax.Classify();
+		map<size_t, BlockIndex::Target> targets;
+		const char *entries = file.GetData() + header.IndexOffset;
+		for (uint64_t i = 0; i < header.IndexCount; ++ i) {
+			Entry entry;
+			memcpy(&entry, entries + i * sizeof entry, sizeof entry);
+			targets.emplace_hint(targets.end(), (size_t)entry.End,
+								 BlockIndex::Target { (size_t)entry.Offset, entry.Line, entry.Column });
+		}
+		compiled->index->Assign(syntax, move(targets));
+		compiled->text = file.GetData() + header.TextOffset;
+		compiled->length = (size_t)header.TextLength;
+		return compiled;
+	}
+
+	//--------------------------------------------------------------------------
+	// Reads and indexes sourcePath in memory, without a compiled file. For a
+	// process that keeps templates to expand them again, such as a server.
+
+	shared_ptr<CompiledTemplate> CompiledTemplate::Read (const string &sourcePath, const Syntax &syntax)
+	{
+		ifstream source(sourcePath, ios_base::in | ios_base::binary);
+		if (!source.good()) {
+			return nullptr;
+		}
+		string text((istreambuf_iterator<char>(source)), istreambuf_iterator<char>());
+		shared_ptr<CompiledTemplate> compiled(new CompiledTemplate(sourcePath, move(text)));
+		compiled->index->Build(compiled->text, compiled->length, syntax);
+		return compiled;
+	}
+}
@@ -0,0 +1,95 @@
+// CompiledTemplate
+// A template precompiled into a versioned binary file that holds the template
+// text together with its prebuilt block index. The file is memory mapped and
+// the text expanded in place, so nothing has to be read, copied or scanned
+// before expansion starts. A compiled file is only used while it matches its
+// source file, so editing the source silently falls back to the text.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__CompiledTemplate__
+#define __stemple__CompiledTemplate__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "BlockIndex.h"
+#include "MappedFile.h"
+
+namespace stemple
+{
+	class CompiledTemplate
+	{
+	public:
+		static const char *Extension;		// Appended to the source pathname
+		static const uint32_t Version = 2;
+
+		static bool Compile (const std::string &sourcePath, const Syntax &syntax);
+
+		static std::shared_ptr<CompiledTemplate> Load (const std::string &sourcePath);
+
+		static std::shared_ptr<CompiledTemplate> Read (const std::string &sourcePath, const Syntax &syntax);
+
+		static bool GetSourceInfo (const std::string &sourcePath, uint64_t &size, int64_t &time);
+
+		static std::string GetCompiledPath (const std::string &sourcePath)
+		{
+			return sourcePath + Extension;
+		}
+
+		//----------------------------------------------------------------------
+		const char *GetText () const
+		{
+			return text;
+		}
+
+		//----------------------------------------------------------------------
+		size_t GetLength () const
+		{
+			return length;
+		}
+
+		//----------------------------------------------------------------------
+		const std::shared_ptr<BlockIndex> &GetBlockIndex () const
+		{
+			return index;
+		}
+
+		//----------------------------------------------------------------------
+		const std::string &GetSourcePath () const
+		{
+			return sourcePath;
+		}
+
+	protected:
+		CompiledTemplate (const std::string &sourcePath) :
+			sourcePath(sourcePath),
+			file(GetCompiledPath(sourcePath)),
+			text(nullptr),
+			length(0),
+			index(std::make_shared<BlockIndex>())
+		{
+		}
+
+		CompiledTemplate (const std::string &sourcePath, std::string &&contents) :
+			sourcePath(sourcePath),
+			file(std::string()),
+			contents(std::move(contents)),
+			text(this->contents.data()),
+			length(this->contents.size()),
+			index(std::make_shared<BlockIndex>())
+		{
+		}
+
+		std::string					sourcePath;
+		MappedFile					file;
+		std::string					contents;	// The text, if it was read
+		const char					*text;		// Points into the mapped file or contents
+		size_t						length;
+		std::shared_ptr<BlockIndex>	index;
+	};
+}
+
+#endif	// __stemple__CompiledTemplate__
@@ -0,0 +1,136 @@
+// DefinesFile
+// Reads many macro definitions at once from a file.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+using namespace std;
+
+namespace stemple
+{
+	// Binary layout: Magic, then for each definition a 32-bit name length,
+	// a 32-bit body length, and the name and body characters, with lengths in
+	// little-endian order.
+	const char DefinesFile::Magic[8] = { 's', 't', 'e', 'm', 'p', 'l', 'e', 'D' };
+
+	namespace
+	{
+		//----------------------------------------------------------------------
+		uint32_t getLength (const char *data)
+		{
+			const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+			return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		}
+
+		//----------------------------------------------------------------------
+		void putLength (ostream &out, size_t length)
+		{
+			char bytes[4] = { (char)length, (char)(length >> 8), (char)(length >> 16), (char)(length >> 24) };
+			out.write(bytes, sizeof bytes);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// The file is mapped rather than read, so that names and bodies can be
+	// handed on where they are, to be copied just once, into their macros.
+
+	bool DefinesFile::Read (const string &pathname, const Visitor &define)
+	{
+		MappedFile file(pathname);
+		if (!file.IsOpen()) {
+			// An empty file can't be mapped, but holds no definitions
+			ifstream empty(pathname);
+			return empty.good() && empty.peek() == char_traits<char>::eof();
+		}
+		const char *data = file.GetData();
+		size_t size = file.GetSize();
+		if (size >= sizeof Magic && memcmp(data, Magic, sizeof Magic) == 0) {
+			return readBinary(data + sizeof Magic, size - sizeof Magic, define);
+		}
+		readText(data, size, define);
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	bool DefinesFile::Read (const string &pathname, MacroDefinitions &definitions)
+	{
+		return Read(pathname, [&](StringView name, StringView body) {
+			definitions.emplace_back(name.ToString(), body.ToString());
+		});
+	}
+
+	//--------------------------------------------------------------------------
+	bool DefinesFile::WriteBinary (const string &pathname, const MacroDefinitions &definitions)
+	{
+		ofstream out(pathname, ios_base::out | ios_base::binary | ios_base::trunc);
+		out.write(Magic, sizeof Magic);
+		for (auto &definition : definitions) {
+			if (definition.first.size() > UINT32_MAX || definition.second.size() > UINT32_MAX) {
+				return false;
+			}
+			putLength(out, definition.first.size());
+			putLength(out, definition.second.size());
+			out.write(definition.first.data(), definition.first.size());
+			out.write(definition.second.data(), definition.second.size());
+		}
+		out.flush();
+		return out.good();
+	}
+
+	//--------------------------------------------------------------------------
+	// One name=body definition per line, like the argument of --define. A line
+	// without '=' defines an empty macro. Blank lines, and lines starting with
+	// '#', are ignored.
+
+	void DefinesFile::readText (const char *data, size_t size, const Visitor &define)
+	{
+		const char *end = data + size;
+		for (const char *line = data; line < end; ) {
+			const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+			if (!eol) eol = end;
+			const char *last = eol;
+			if (last > line && last[-1] == '\r') -- last;
+			if (last > line && *line != '#') {
+				const char *eq = static_cast<const char *>(memchr(line, '=', last - line));
+				if (eq) {
+					define({ line, (size_t)(eq - line) }, { eq + 1, (size_t)(last - eq - 1) });
+				} else {
+					define({ line, (size_t)(last - line) }, { last, 0 });
+				}
+			}
+			line = eol + 1;
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// The lengths are all checked before any definition is passed on, so
+	// that a truncated file defines nothing.
+
+	bool DefinesFile::readBinary (const char *data, size_t size, const Visitor &define)
+	{
+		const char *end = data + size;
+		for (const char *p = data; p < end; ) {
+			if (end - p < 8) {
+				return false;
+			}
+			size_t nameLength = getLength(p);
+			size_t bodyLength = getLength(p + 4);
+			p += 8;
+			if ((size_t)(end - p) < nameLength || (size_t)(end - p) - nameLength < bodyLength) {
+				return false;
+			}
+			p += nameLength + bodyLength;
+		}
+		while (data < end) {
+			size_t nameLength = getLength(data);
+			size_t bodyLength = getLength(data + 4);
+			data += 8;
+			define({ data, nameLength }, { data + nameLength, bodyLength });
+			data += nameLength + bodyLength;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,48 @@
+// DefinesFile
+// Reads many macro definitions at once from a file, either text with one
+// name=body definition per line, or a binary file of length-prefixed names and
+// bodies that needs no scanning or unescaping.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__DefinesFile__
+#define __stemple__DefinesFile__
+
+#include <functional>
+#include <string>
+
+#include "Builtin.h"
+#include "MacroTable.h"
+
+namespace stemple
+{
+	class DefinesFile
+	{
+	public:
+		// Called with each definition in turn, its name and body pointing
+		// into the file, which is only mapped for the duration of Read().
+		typedef std::function<void(StringView name, StringView body)> Visitor;
+
+		// Passes each of the file's definitions to define, in order, without
+		// copying them. The format is detected from the contents. Returns
+		// false, having passed on none of them, if the file can't be read or
+		// is malformed.
+		static bool Read (const std::string &pathname, const Visitor &define);
+
+		// Appends the file's definitions.
+		static bool Read (const std::string &pathname, MacroDefinitions &definitions);
+
+		// Writes the definitions in the binary format.
+		static bool WriteBinary (const std::string &pathname, const MacroDefinitions &definitions);
+
+		static const char Magic[8];		// Starts a binary file
+
+	protected:
+		static void readText (const char *data, size_t size, const Visitor &define);
+
+		static bool readBinary (const char *data, size_t size, const Visitor &define);
+	};
+}
+
+#endif	// __stemple__DefinesFile__
@@ -5,6 +5,9 @@
 
 #include "stdafx.h"
 
+#include <cerrno>
+#include <cstdint>
+
 using namespace std;
 using namespace std::placeholders;
 
@@ -12,14 +15,97 @@ using namespace std::placeholders;
 //==============================================================================
 namespace stemple
 {
+	//==========================================================================
+	// The special characters, for the parts of the expander that look at
+	// every character, which are templated on them. Nearly everything uses
+	// the defaults, which are constants, so that the common case compares
+	// against immediates rather than members. Sets of characters, such as
+	// delimiters, are looked up in the syntax's CharClasses either way.
+	//==========================================================================
+	struct DefaultChars
+	{
+		static const char Escape = '$';
+		static const char Intro = '$';
+		static const char Open = '(';
+		static const char ArgSep = ',';
+		static const char Close = ')';
+		static const char Mods = ':';
+	};
+
+	const char DefaultChars::Escape;
+	const char DefaultChars::Intro;
+	const char DefaultChars::Open;
+	const char DefaultChars::ArgSep;
+	const char DefaultChars::Close;
+	const char DefaultChars::Mods;
+
+	//==========================================================================
+	// Whatever special characters SetSpecialChars() was given.
+	//==========================================================================
+	struct CustomChars
+	{
+		const char Escape;
+		const char Intro;
+		const char Open;
+		const char ArgSep;
+		const char Close;
+		const char Mods;
+
+		//----------------------------------------------------------------------
+		CustomChars (const Syntax &syntax) :
+			Escape(syntax.Escape),
+			Intro(syntax.Intro),
+			Open(syntax.Open),
+			ArgSep(syntax.ArgSep),
+			Close(syntax.Close),
+			Mods(syntax.Mods)
+		{
+		}
+	};
+
+	//--------------------------------------------------------------------------
+	// Whether c ends the kind of string being collected.
+
+	inline bool Expander::isEnd (Directive::State state, char c) const
+	{
+		switch (state) {
+		case Directive::NAME:	return syntax.Classes.Is(c, CharClasses::NAME_END);
+		case Directive::MOD:	return syntax.Classes.Is(c, CharClasses::MOD_END);
+		case Directive::ARG:	return syntax.Classes.Is(c, CharClasses::ARG_END);
+		default:				return syntax.Classes.Is(c, CharClasses::TEXT_END);
+		}
+	}
 
 	//--------------------------------------------------------------------------
 	Expander::Expander () :
+		maxOpenFiles(16),
+		expanding(nullptr),
+		mainOutput(nullptr),
+		redirect(nullptr),
+		defaultChars(false),
 		trimArgs(true),
 		skipping(0),
-		invoking(0)
+		maxDepth(DefaultMaxDepth),
+		parallelism(1),
+		minSegment(0),
+		footprint(nullptr),
+		abandoned(false),
+		exceededMaxDepth(false),
+		arithmeticFailed(false),
+		wasEscaped(false),
+		wasVerbatim(false)
 	{
 		SetSpecialChars('$', '$', '(', ',', ')');
+		registerStandardBuiltins();
+	}
+
+	//--------------------------------------------------------------------------
+	// Replaces all the builtins with the standard ones, dropping any native
+	// ones, and any standard one they overrode.
+
+	void Expander::registerStandardBuiltins ()
+	{
+		natives.clear();
 		builtins = {
 			{ "if",			bind(&Expander::do_if,			this, _1, _2) },
 			{ "else",		bind(&Expander::do_else,		this, _1, _2) },
@@ -34,12 +120,115 @@ namespace stemple
 			{ "or",			bind(&Expander::do_or,			this, _1, _2) },
 			{ "not",		bind(&Expander::do_not,			this, _1, _2) },
 			{ "defined",	bind(&Expander::do_defined,		this, _1, _2) },
+			{ "foreach",	bind(&Expander::do_foreach,		this, _1, _2) },
+			{ "output",		bind(&Expander::do_output,		this, _1, _2) },
 		};
 	}
 
+	//--------------------------------------------------------------------------
+	// Copies the macros and settings of other, but none of its input. A copy
+	// of an expander with a standard set of macros already defined is a quick
+	// way to get a fresh one, since nothing needs to be parsed again.
+
+	Expander::Expander (const Expander &other) :
+		Expander()
+	{
+		copySettings(other);
+		macros = other.macros;
+		base = other.base;
+	}
+
+	//--------------------------------------------------------------------------
+	// Starts with the settings of base, and its macros, which are shared rather
+	// than copied: any macro that isn't defined here is looked up in base. A
+	// base expander with a large set of macros can be shared, without change,
+	// by any number of expanders, each starting out fresh at no cost.
+
+	Expander::Expander (const shared_ptr<const Expander> &base) :
+		Expander()
+	{
+		copySettings(*base);
+		this->base = base;
+	}
+
 	//--------------------------------------------------------------------------
 	Expander::~Expander ()
 	{
+		inStreams.clear();	// Before the macros they may be reading
+	}
+
+	//--------------------------------------------------------------------------
+	// Takes on everything but the macros and input of other. Compiled
+	// expressions are only thrown away if the special characters differ. The
+	// builtins are exactly other's: the standard ones, overridden by its
+	// native ones.
+
+	void Expander::copySettings (const Expander &other)
+	{
+		if (!(syntax == other.syntax)) {
+			SetSpecialChars(other.escapeChar, other.introChar, other.openChar, other.argSepChar, other.closeChar);
+		}
+		trimArgs = other.trimArgs;
+		maxDepth = other.maxDepth;
+		parallelism = other.parallelism;
+		minSegment = other.minSegment;
+		templateCache = other.templateCache;
+		directory = other.directory;
+		outputRoot = other.outputRoot;
+		maxOpenFiles = other.maxOpenFiles;
+		if (!natives.empty()) {
+			registerStandardBuiltins();	// Only natives ever change them
+		}
+		for (auto &native : other.natives) {
+			RegisterBuiltin(native.first, native.second);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Abandons any expansion in progress, as after an exception, leaving the
+	// expander ready for another. What it has built up along the way, such as
+	// its compiled expressions and the capacity of its buffers, is kept. If
+	// restoreBaseline is set, its macros and settings go back to those saved
+	// by SetBaseline(), or, if none were, it's left with no macros of its own.
+
+	void Expander::Reset (bool restoreBaseline)
+	{
+		inStreams.clear();
+		directives.clear();
+		while (!ifContext.empty()) {
+			ifContext.pop();
+		}
+		skipping = 0;
+		abandoned = false;
+		exceededMaxDepth = false;
+		arithmeticFailed = false;
+		wasEscaped = false;
+		wasVerbatim = false;
+		footprint = nullptr;
+		outputSwitches.clear();
+		expanding = nullptr;
+		mainOutput = nullptr;
+		redirect = nullptr;
+		if (outputFiles) {
+			outputFiles->Close();
+		}
+		if (restoreBaseline) {
+			if (baseline) {
+				copySettings(*baseline);
+				macros = baseline->macros;
+				base = baseline->base;
+			} else {
+				macros.Clear();
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Saves the macros and settings as they are now, for Reset() to restore.
+
+	void Expander::SetBaseline ()
+	{
+		baseline = make_shared<const Expander>(*this);
 	}
 
 	//--------------------------------------------------------------------------
@@ -54,101 +243,703 @@ namespace stemple
 		argSepChar = argSep;
 		closeChar = close;
 		modsChar = ':';
-		(nameEndChars = " \t:+=") += closeChar;
-		(argEndChars = argSepChar) += closeChar;
-		textEndChars = closeChar;
-		(modEndChars = " \t:+=") += closeChar;
-		if (modEndChars.find(modsChar) == string::npos) modEndChars += modsChar;
+		syntax.Escape = escapeChar;
+		syntax.Intro = introChar;
+		syntax.Open = openChar;
+		syntax.ArgSep = argSepChar;
+		syntax.Close = closeChar;
+		syntax.Mods = modsChar;
+		syntax.Classify();
+		defaultChars = escape == DefaultChars::Escape && intro == DefaultChars::Intro && open == DefaultChars::Open &&
+					   argSep == DefaultChars::ArgSep && close == DefaultChars::Close;
+		expressions.clear();
+	}
+
+	//--------------------------------------------------------------------------
+	// Limits how deeply directives may nest within one another, and input
+	// streams (macro expansions, includes, etc.) within one another, so that
+	// runaway recursion ends rather than exhausting memory. If the limit is
+	// exceeded, the rest of the input is discarded, and the expansion fails.
+	// Zero means no limit; the default is DefaultMaxDepth.
+
+	void Expander::SetMaxDepth (size_t depth)
+	{
+		maxDepth = depth;
+	}
+
+	//--------------------------------------------------------------------------
+	// Expands inputs of at least twice minSegment in pieces, on up to threads
+	// threads at once, speculatively: see expandParallel(). The output is the
+	// same either way. One thread, the default, expands everything in order.
+	// Native builtins are still called only once each, in document order, on
+	// the calling thread.
+
+	void Expander::SetParallelism (unsigned threads, size_t minSegment)
+	{
+		parallelism = threads ? threads : 1;
+		this->minSegment = minSegment ? minSegment : 1;
 	}
 
 	//--------------------------------------------------------------------------
+	// Adds a builtin directive implemented by a function, or replaces one,
+	// even one of the standard ones. Copies of the expander, and expanders
+	// layered over it, have it too, so it may be called on other threads.
+
+	void Expander::RegisterBuiltin (const string &name, const NativeBuiltin &builtin)
+	{
+		natives[name] = builtin;
+		builtins[name] = [this, name, builtin](const ArgList &args, const Mods &mods) {
+			return callNative(name, builtin, args, mods);
+		};
+	}
+
+	//--------------------------------------------------------------------------
+	// Included files are taken from the cache, which keeps them in memory,
+	// rather than being read each time.
+
+	void Expander::SetTemplateCache (const shared_ptr<TemplateCache> &cache)
+	{
+		templateCache = cache;
+	}
+
+	//--------------------------------------------------------------------------
+	// Sets the directory from which includes are resolved when the input has
+	// no path of its own, as when it's a stream, instead of the current one.
+
+	void Expander::SetDirectory (const string &directory)
+	{
+		this->directory = directory;
+	}
+
+	//--------------------------------------------------------------------------
+	// Sets the directory that files named by $(output) are relative to, and
+	// how many of them may be open at once. A relative root is itself taken
+	// from the directory set by SetDirectory(), if any.
+
+	void Expander::SetOutputRoot (const string &root, size_t maxOpenFiles)
+	{
+		outputRoot = root;
+		this->maxOpenFiles = maxOpenFiles;
+	}
+
+	//--------------------------------------------------------------------------
+	// The name and body are copied into the macro table's own storage. A
+	// simple body is expanded first.
+
 	void Expander::SetMacro (const std::string &name, const std::string &body, bool simple)
 	{
-		macros[name] = Macro(name, simple ? Expand(body) : body, simple);
+		SetMacro(StringView{ name.data(), name.length() }, StringView{ body.data(), body.length() }, simple);
+	}
+
+	//--------------------------------------------------------------------------
+	// The text only has to last for the call, so it can be defined from
+	// wherever it is, eg, a mapped file, without being copied on the way.
+
+	void Expander::SetMacro (StringView name, StringView body, bool simple)
+	{
+		if (footprint) {
+			noteWrite(name.ToString());
+		}
+		if (simple) {
+			string expanded = Expand(body.ToString());
+			macros.Set(name.Data, name.Length, expanded.data(), expanded.length());
+		} else {
+			macros.Set(name.Data, name.Length, body.Data, body.Length);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Undefines a macro of this expander's own, uncovering any in its base.
+
+	void Expander::unsetMacro (const string &name)
+	{
+		if (footprint) {
+			noteWrite(name);
+		}
+		auto id = macros.Find(name);
+		if (id != MacroTable::None) {
+			macros.Remove(id);
+		}
 	}
 
 	//--------------------------------------------------------------------------
+	// Defines each of the macros in turn, as if by SetMacro. Later
+	// definitions of the same name replace earlier ones.
+
+	void Expander::SetMacros (const MacroDefinitions &definitions, bool simple)
+	{
+		for (auto &definition : definitions) {
+			SetMacro(definition.first, definition.second, simple);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Defines the macros in a defines file, straight from the file, as if by
+	// SetMacros. Returns false, having defined none of them, if the file can't
+	// be read or is malformed.
+
+	bool Expander::SetMacrosFromFile (const std::string &pathname, bool simple)
+	{
+		return DefinesFile::Read(pathname, [&](StringView name, StringView body) {
+			SetMacro(name, body, simple);
+		});
+	}
+
+	//--------------------------------------------------------------------------
+	// The output is all there is, so whether it was cut short, or had an
+	// expression it couldn't evaluate, is left to ExceededMaxDepth() and
+	// ArithmeticFailed().
+
 	string Expander::Expand (const string &inputString)
 	{
+		if (inStreams.empty()) {
+			exceededMaxDepth = false;
+			arithmeticFailed = false;
+		}
 		return expand(inputString, "Input string");
 	}
 
 	//--------------------------------------------------------------------------
 	bool Expander::Expand (istream &input, const string &inputName, ostream &output)
 	{
-		inStreams.push_front(make_shared<CopiedStream>(input, inputName));
+		beginOutput(output);
+		if (parallelism > 1) {
+			// It takes all of the input to split it up, but only input that's
+			// long enough to split is worth reading in full first
+			string text;
+			size_t least = minSegment < SIZE_MAX / 2 ? minSegment * 2 : SIZE_MAX;
+			char buffer[4096];
+			while (text.size() < least && input.read(buffer, sizeof buffer).gcount()) {
+				text.append(buffer, (size_t)input.gcount());
+			}
+			if (text.size() < least) {
+				pushStream(make_shared<ViewStream>(text.data(), text.length(), inputName));
+				expand(output);
+				return endOutput();
+			}
+			text.append(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+			if (!expandParallel(text.data(), text.length(), inputName, output)) {
+				pushStream(make_shared<ViewStream>(text.data(), text.length(), inputName));
+				expand(output);
+			}
+			return endOutput();
+		}
+		pushStream(make_shared<CopiedStream>(input, inputName));
 		expand(output);
-		return true;
+		return endOutput();
+	}
+
+	//--------------------------------------------------------------------------
+	// Like the istream form, the input has no path, so relative includes are
+	// resolved from the current directory.
+
+	bool Expander::Expand (const shared_ptr<CompiledTemplate> &input, const string &inputName, ostream &output)
+	{
+		beginOutput(output);
+		if (parallelism > 1 && expandParallel(input->GetText(), input->GetLength(), inputName, output)) {
+			return endOutput();
+		}
+		pushStream(make_shared<MappedStream>(input, inputName));
+		expand(output);
+		return endOutput();
+	}
+
+	//--------------------------------------------------------------------------
+	// Precompiles a template file for expansion with the current special
+	// characters. Included files are picked up in their compiled form too, if
+	// they've been compiled.
+
+	bool Expander::Compile (const string &sourcePath)
+	{
+		return CompiledTemplate::Compile(sourcePath, syntax);
 	}
 
 	//--------------------------------------------------------------------------
 	string Expander::expand (const string &inputString, const string &source)
 	{
-		inStreams.push_front(make_shared<StringStream>(inputString, source));
+		pushStream(make_shared<StringStream>(inputString, source));
 		ostringstream output;
 		expand(output);
 		return output.str();
 	}
 
 	//--------------------------------------------------------------------------
+	// Only the output given to Expand() can be redirected by $(output), not
+	// that of a nested expansion, such as of the body of a simple assignment.
+
 	void Expander::expand (ostream &output)
 	{
-		string leadingWhitespace;
+		string chunk;
+		HeldOutput held;
+		const string *outer = expanding;
+		expanding = &output == mainOutput ? &chunk : nullptr;
+		while (expand(chunk, Expansion::DefaultChunkSize, held)) {
+			write(output, chunk);
+		}
+		expanding = outer;
+	}
+
+	//--------------------------------------------------------------------------
+	// Writes a chunk of output, or the parts of it, to wherever the $(output)
+	// directives within it sent them.
+
+	void Expander::write (ostream &output, const string &chunk)
+	{
+		size_t pos = 0;
+		if (&output == mainOutput) {
+			for (auto &change : outputSwitches) {
+				(redirect ? *redirect : output).write(chunk.data() + pos, change.Offset - pos);
+				pos = change.Offset;
+				if (change.Pathname.empty()) {
+					redirect = nullptr;
+				} else {
+					if (!outputFiles) {
+						outputFiles.reset(new OutputFiles(maxOpenFiles));
+					}
+					redirect = &outputFiles->Get(change.Pathname);
+				}
+			}
+			outputSwitches.clear();
+		}
+		(redirect && &output == mainOutput ? *redirect : output).write(chunk.data() + pos, chunk.size() - pos);
+	}
+
+	//--------------------------------------------------------------------------
+	void Expander::beginOutput (ostream &output)
+	{
+		exceededMaxDepth = false;
+		arithmeticFailed = false;
+		mainOutput = &output;
+		redirect = nullptr;
+		outputSwitches.clear();
+	}
+
+	//--------------------------------------------------------------------------
+	// Closes any files written by $(output). Returns false if they couldn't
+	// all be written, the expansion went too deep to finish, or an expression
+	// couldn't be evaluated.
+
+	bool Expander::endOutput ()
+	{
+		mainOutput = nullptr;
+		redirect = nullptr;
+		bool closed = !outputFiles || outputFiles->Close();
+		return closed && !exceededMaxDepth && !arithmeticFailed;
+	}
+
+	//--------------------------------------------------------------------------
+	string Expander::getOutputPath (const string &pathname) const
+	{
+		auto isAbsolute = [](const string &p) {
+			return p.size() && (p[0] == '/' || p[0] == '\\' || (p.size() > 1 && p[1] == ':'));
+		};
+		if (isAbsolute(pathname)) {
+			return pathname;
+		}
+		string root = outputRoot;
+		if (!directory.empty() && !isAbsolute(root)) {
+			root = root.empty() ? directory : directory + '/' + root;
+		}
+		return root.empty() ? pathname : root + '/' + pathname;
+	}
+
+	//--------------------------------------------------------------------------
+	// Expands the text in segments on several threads at once. Each segment is
+	// expanded against a snapshot of the macros as they were at the start,
+	// noting which macros it looks up and which it defines. A segment that
+	// calls a native builtin is stopped there, and left until its turn, since
+	// the builtin may have side effects that mustn't happen early, or twice;
+	// the standard builtins only have effects here, or read. The results are
+	// then taken in order: a segment that looked up nothing defined by one
+	// before it is kept as it is, and its definitions made here; any other is
+	// expanded again, here, in its proper turn. So the output, and the macros
+	// left defined, are the same as if the text had been expanded in one go,
+	// and it pays off as long as most segments only use the macros they were
+	// given. Returns false, having done nothing, if the text doesn't split.
+	//
+	// The snapshot isn't a copy: the macros are moved, as they are, into a
+	// frozen layer that the workers, and this expander, look them up in for
+	// the rest of the expansion. What's defined meanwhile is defined here, on
+	// top, and once it's over, it's put back into the table taken from the
+	// layer, so that each expansion leaves the same single table behind.
+
+	bool Expander::expandParallel (const char *data, size_t length, const string &inputName, ostream &output)
+	{
+		if (inStreams.size()) {
+			return false;	// The table may be being read in place
+		}
+		vector<Segment> segments = findSegments(data, length);
+		if (segments.size() < 2) {
+			return false;
+		}
+
+		auto frozen = make_shared<Expander>();
+		frozen->copySettings(*this);
+		frozen->macros = move(macros);
+		frozen->base = base;
+		macros = MacroTable();
+		base = frozen;
+		shared_ptr<const Expander> snapshot = frozen;
+		atomic<size_t> next(0);
+		auto work = [&] {
+			for (size_t i; (i = next ++) < segments.size(); ) {
+				Segment &segment = segments[i];
+				try {
+					Expander worker(snapshot);
+					worker.footprint = &segment.Access;
+					segment.Access.Speculative = true;
+					Position position(inputName);
+					worker.pushStream(make_shared<ViewStream>(data + segment.Start, segment.Length,
+															  position.Skip(0, segment.Line, 1)));
+					ostringstream out;
+					worker.expand(out);
+					segment.Output = out.str();
+					segment.ArithmeticFailed = worker.arithmeticFailed;
+					for (auto &name : segment.Access.Writes) {
+						auto id = worker.macros.Find(name);
+						if (id != MacroTable::None) {
+							segment.Written.emplace(name, worker.macros.GetString(id));
+						}
+					}
+				} catch (const exception &) {
+					segment.Failed = true;
+				}
+			}
+		};
+		vector<thread> threads;
+		for (size_t t = 1; t < min<size_t>(parallelism, segments.size()); ++ t) {
+			threads.emplace_back(work);
+		}
+		work();
+		for (auto &t : threads) {
+			t.join();
+		}
+
+		unordered_set<string> changed;		// Defined by segments so far
+		for (auto &segment : segments) {
+			bool stale = any_of(begin(segment.Access.Reads), end(segment.Access.Reads), [&](const string &name) {
+				return changed.count(name) != 0;
+			});
+			if (!stale && !segment.Failed && !segment.Access.Halted && !segment.Access.Deferred) {
+				write(output, segment.Output);
+				arithmeticFailed = arithmeticFailed || segment.ArithmeticFailed;
+				for (auto &macro : segment.Written) {
+					macros.Set(macro.first, macro.second.data(), macro.second.length());
+				}
+				changed.insert(begin(segment.Access.Writes), end(segment.Access.Writes));
+				continue;
+			}
+
+			// Expand it again, now that the macros are as they should be. If
+			// it was abandoned, or failed, so is the rest of the input; if it
+			// redirected the output, the rest may have to go elsewhere.
+			bool rest = segment.Failed || segment.Access.Halted;
+			Footprint access;
+			footprint = &access;
+			Position position(inputName);
+			pushStream(make_shared<ViewStream>(data + segment.Start, rest ? length - segment.Start : segment.Length,
+											   position.Skip(0, segment.Line, 1)));
+			try {
+				expand(output);
+			} catch (...) {
+				footprint = nullptr;
+				throw;
+			}
+			footprint = nullptr;
+			changed.insert(begin(access.Writes), end(access.Writes));
+			if (rest) {
+				break;
+			}
+		}
+
+		// Nothing else holds the layer now. A macro undefined here is left as
+		// the layer has it, which is what was seen anyway.
+		snapshot = nullptr;
+		if (frozen.use_count() == 2 && inStreams.empty()) {
+			MacroTable defined = move(macros);
+			macros = move(frozen->macros);
+			base = frozen->base;
+			for (auto &name : changed) {
+				auto id = defined.Find(name);
+				if (id != MacroTable::None) {
+					string body = defined.GetString(id);
+					macros.Set(name, body.data(), body.length());
+				}
+			}
+		}
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Feeds text to a BlockScanner, keeping a note of the line ends that it
+	// passes outside any directive or block, where the text can be split.
+
+	class SegmentSource
+	{
+	public:
+		//----------------------------------------------------------------------
+		SegmentSource (const char *data, size_t length, const BlockScanner &scanner, const int &depth,
+					   char escape) :
+			data(data),
+			length(length),
+			pos(0),
+			line(1),
+			scanner(scanner),
+			depth(depth),
+			escape(escape)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// An escaped newline joins two lines into one.
+		bool get (char &c)
+		{
+			if (pos == length) {
+				return false;
+			}
+			c = data[pos ++];
+			if (c == '\n') {
+				++ line;
+				size_t escapes = 0;
+				while (escapes < pos - 1 && data[pos - 2 - escapes] == escape) {
+					++ escapes;
+				}
+				if (!depth && !scanner.IsInDirective() && !(escapes & 1)) {
+					Ends.push_back({ pos, line });
+				}
+			}
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		int peek ()
+		{
+			return pos < length ? data[pos] : char_traits<char>::eof();
+		}
+
+		//----------------------------------------------------------------------
+		size_t tell () const
+		{
+			return pos;
+		}
+
+		struct End
+		{
+			size_t Offset;		// Just after the newline
+			int Line;			// Of the next character
+		};
+		vector<End> Ends;
+
+	private:
+		const char *data;
+		size_t length;
+		size_t pos;
+		int line;
+		const BlockScanner &scanner;
+		const int &depth;
+		char escape;
+	};
+
+	//--------------------------------------------------------------------------
+	// Splits text at line ends outside of any directive or block, into about
+	// four segments per thread but none smaller than minSegment. Returns no
+	// segments if the text has an unmatched block directive.
+
+	vector<Expander::Segment> Expander::findSegments (const char *data, size_t length) const
+	{
+		vector<Segment> segments;
+		size_t target = max(minSegment, length / (parallelism * 4));
+		if (length < target * 2) {
+			return segments;
+		}
+
+		BlockScanner scanner(syntax);
+		int depth = 0;
+		SegmentSource source(data, length, scanner, depth, escapeChar);
+		size_t start;
+		for (BlockScanner::Kind kind; (kind = scanner.Next(source, start)) != BlockScanner::NONE; ) {
+			if (kind == BlockScanner::IF || kind == BlockScanner::FOREACH) {
+				++ depth;
+			} else if (!depth) {
+				return segments;
+			} else if (kind == BlockScanner::ENDIF || kind == BlockScanner::END) {
+				-- depth;
+			}
+		}
+
+		Segment segment;
+		segment.Start = 0;
+		segment.Line = 1;
+		for (auto &end : source.Ends) {
+			if (end.Offset - segment.Start >= target && length - end.Offset >= target) {
+				segment.Length = end.Offset - segment.Start;
+				segments.push_back(segment);
+				segment.Start = end.Offset;
+				segment.Line = end.Line;
+			}
+		}
+		segment.Length = length - segment.Start;
+		segments.push_back(segment);
+		return segments;
+	}
+
+	//--------------------------------------------------------------------------
+	// Expands from the current input until size characters of output have
+	// been produced, or the input is exhausted, replacing the contents of
+	// chunk. Returns false if there was no more output. Leading whitespace on
+	// the current line, and output that didn't fit in the last chunk, are held
+	// back in held between calls, so no chunk is ever longer than size.
+
+	bool Expander::expand (string &chunk, size_t size, HeldOutput &held)
+	{
+		return defaultChars ? expand(DefaultChars(), chunk, size, held) :
+							  expand(CustomChars(syntax), chunk, size, held);
+	}
+
+	//--------------------------------------------------------------------------
+	template<class Chars>
+	bool Expander::expand (const Chars &chars, string &chunk, size_t size, HeldOutput &held)
+	{
+		chunk.clear();
+		if (held.OverflowStart < held.Overflow.size()) {
+			size_t n = min(size, held.Overflow.size() - held.OverflowStart);
+			chunk.assign(held.Overflow, held.OverflowStart, n);
+			held.OverflowStart += n;
+		}
+		if (held.OverflowStart == held.Overflow.size()) {
+			held.Overflow.clear();
+			held.OverflowStart = 0;
+		}
+		string &leadingWhitespace = held.LeadingWhitespace;
 		char c;
-		while (get(c)) {
+		while (chunk.size() < size && get(chars, c, true)) {
 			if (!skipping) {
 				if (c == '\n') {
 					if (!currentStream().GraphSeen) {
 						// Only output a blank line if we haven't processed any non-
 						// printing directives on it, otherwise skip.
 						if (!currentStream().DirectiveSeen) {
-							output << leadingWhitespace;
+							put(chunk, size, leadingWhitespace.data(), leadingWhitespace.size(), held);
 							DBG("put(): ws='%s'\n", leadingWhitespace.c_str());
-							output.put('\n');
-							DBG("put(): c=%s\n", printchar(c));
+							put(chunk, size, &c, 1, held);
+							DBG("put(): c=%s\n", printchar(c).c_str());
 						}
 					} else {
-						output.put('\n');
-						DBG("put(): c=%s\n", printchar(c));
+						put(chunk, size, &c, 1, held);
+						DBG("put(): c=%s\n", printchar(c).c_str());
 					}
 					// Reset for new line...
 					leadingWhitespace.clear();
 					currentStream().GraphSeen = false;
 					currentStream().DirectiveSeen = false;
-				} else if (isspace(c) && !currentStream().GraphSeen) {
+				} else if (syntax.Classes.IsSpace(c) && !currentStream().GraphSeen) {
 					// Collect leading whitespace rather than immediately outputting
 					// it. Then we can decide later if we want to skip a blank
 					// line containing just a non-printing directive or not.
 					leadingWhitespace.append(1, c);
 				} else {
-					if (!isspace(c) && !currentStream().GraphSeen) {	// NOTE: using !isspace() instead of isgraph() - better for Unicode?
+					if (!syntax.Classes.IsSpace(c) && !currentStream().GraphSeen) {	// NOTE: using !isspace() instead of isgraph() - better for Unicode?
 						// Flush collected leading whitespace now that we're
 						// outputting a printing character on this line.
 						currentStream().GraphSeen = true;
 						if (leadingWhitespace.length()) {
-							output << leadingWhitespace;
+							put(chunk, size, leadingWhitespace.data(), leadingWhitespace.size(), held);
 							DBG("put(): ws='%s'\n", leadingWhitespace.c_str());
 							leadingWhitespace.clear();
 						}
 					}
-					output.put(c);
-					DBG("put(): c=%s\n", printchar(c));
+					put(chunk, size, &c, 1, held);
+					DBG("put(): c=%s\n", printchar(c).c_str());
 				}
 			}
 		}
+		return chunk.size() > 0;
 	}
 
 	//--------------------------------------------------------------------------
+	// Adds output to the chunk, as much as fits in size; the rest overflows,
+	// to start the next chunk.
+
+	void Expander::put (string &chunk, size_t size, const char *text, size_t length, HeldOutput &held)
+	{
+		size_t n = held.Overflow.empty() && chunk.size() < size ? min(size - chunk.size(), length) : 0;
+		chunk.append(text, n);
+		held.Overflow.append(text + n, length - n);
+	}
+
+	//--------------------------------------------------------------------------
+	// Returns the next character of expanded output. Directives are processed
+	// as they're read, with those nested within a directive's name, modifiers
+	// or arguments kept on the directives stack rather than the C++ stack: the
+	// characters read while it isn't empty are collected by the innermost
+	// directive rather than returned. Only directives begun by this call are
+	// collected by it, so it may be called again from within a builtin.
+
 	bool Expander::get (char &c, bool expand)
+	{
+		return defaultChars ? get(DefaultChars(), c, expand) : get(CustomChars(syntax), c, expand);
+	}
+
+	//--------------------------------------------------------------------------
+	template<class Chars>
+	bool Expander::get (const Chars &chars, char &c, bool expand)
+	{
+		if (!expand) {
+			return read(chars, c);
+		}
+		const size_t base = directives.size();
+		char x;
+		for (;;) {
+			if (!read(chars, x)) {
+				if (directives.size() == base) {
+					c = '\0';
+					return false;
+				}
+				// Input ended within a directive: finish it with what there is
+				endString(true);
+				continue;
+			}
+			if (x == chars.Intro && !wasEscaped && !wasVerbatim && peek() == chars.Open) {
+				// Start of a stemple directive
+				Position introPos = currentStream().GetPosition();
+				if (read(chars, x)) {	// Eat opening '('
+					beginDirective(introPos);
+				}
+				continue;
+			}
+			if (directives.size() == base) {
+				c = x;
+				return true;
+			}
+			collect(chars, x);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Gets the next character without expanding anything.
+
+	bool Expander::read (char &c)
+	{
+		return defaultChars ? read(DefaultChars(), c) : read(CustomChars(syntax), c);
+	}
+
+	//--------------------------------------------------------------------------
+	template<class Chars>
+	bool Expander::read (const Chars &chars, char &c)
 	{
 		wasEscaped = false;
+		wasVerbatim = false;
+
+		// If we went too deep, give up on the input altogether
+		if (abandoned) {
+			inStreams.clear();
+			abandoned = false;
+		}
 
 		// If we've reached the end of the current stream, detect it now. We
 		// don't want the next istream::get() to return eof, since we want
 		// the next character to come from the 'parent' stream if there is one.
-		while (inStreams.size() && currentStream().peek() == char_traits<char>::eof()) {
-			inStreams.pop_front();
-		}
+		popEndedStreams();
 
 		// End of input?
 		if (!inStreams.size()) {
@@ -158,146 +949,355 @@ namespace stemple
 		}
 
 		char x;
-		if (!currentStream().get(x)) {
+		InStream &stream = currentStream();
+		if (!stream.get(x)) {
 			c = '\0';
 			DBG("get(): Error from InStream::get()\n");
 			return false;
 		}
 
-		DBG("get(): x=%s gs=%s (%s)\n", printchar(x), currentStream().GraphSeen ? "true" : "false", currentStream().GetPosition().GetCString());
+		DBG("get(): x=%s gs=%s (%s)\n", printchar(x).c_str(), stream.GraphSeen ? "true" : "false", stream.GetPosition().GetString().c_str());
+
+		// Verbatim text is taken as it is, escapes and all
+		if (stream.IsVerbatim()) {
+			wasVerbatim = true;
+			c = x;
+			return true;
+		}
 
 		// Treat single-character (putback) streams as ephemeral
-		if (currentStream().IsCharStream()) {
+		if (stream.IsCharStream()) {
 			inStreams.pop_front();
 		}
 
-		if (x == escapeChar) {
+		if (x == chars.Escape) {
 			// Handle escape
 			char p = peek();
-			if (p == introChar || p == escapeChar) {
+			if (p == chars.Intro || p == chars.Escape) {
 				// Escaped '$' cannot start a macro
 				if (!currentStream().get(x)) return false;	// Eat '$' so it doesn't trigger a macro on the next call
-				DBG("  esc: x=%s\n", printchar(x));
+				DBG("  esc: x=%s\n", printchar(x).c_str());
 				wasEscaped = true;
-				goto end;
 			} else if (p == '\n') {
 				// Escaped newline causes blank line to be output, even if it
 				// contains only a non-printing directive
 				currentStream().DirectiveSeen = false;
-				if (!get(x)) return false;	// Get the newline, skipping the escape
-				DBG("  esc: x=%s\n", printchar(x));
+				if (!read(chars, x)) return false;	// Get the newline, skipping the escape
+				DBG("  esc: x=%s\n", printchar(x).c_str());
 				wasEscaped = true;
-				goto end;
 			}
 		}
-		if (expand && x == introChar) {
-			// Handle macro expansion and stemple directives
-			if (peek() == openChar) {
-				// Start of a stemple directive
-				Position introPos = currentStream().GetPosition();
-				if (get(x)) {	// Eat opening '('
-					if (processDirective(introPos)) {
-					}
-					// Get first character of expansion, or character following ')'
-					if (!get(x)) {
-						return false;
-					}
+		c = x;
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Pops the streams that have been read to the end, so that the current one
+	// has something left in it, if any does. A loop body starts over in place
+	// rather than being popped.
+
+	void Expander::popEndedStreams ()
+	{
+		while (inStreams.size() && currentStream().peek() == char_traits<char>::eof()) {
+			if (!currentStream().Repeat()) {
+				shared_ptr<InStream> ended = move(inStreams.front());
+				inStreams.pop_front();
+				if (inStreams.size()) {
+					ended->Unlink(currentStream());
 				}
 			}
 		}
-end:
-		c = x;
-		return true; //good();
 	}
 
 	//--------------------------------------------------------------------------
-	bool Expander::good ()
+	bool Expander::good ()
+	{
+		return inStreams.size() && currentStream().good();
+	}
+
+	//--------------------------------------------------------------------------
+	bool Expander::eof ()
+	{
+		return !inStreams.size() ? true : currentStream().eof();
+	}
+
+	//--------------------------------------------------------------------------
+	static inline bool is_number (const string &s)
+	{
+		return !s.empty() && find_if(begin(s), end(s), [](char c) { return !isdigit(c); }) == end(s);
+	}
+
+	//--------------------------------------------------------------------------
+	// We've seen opening "$(". Either evaluate an expression straight away, or
+	// start collecting the directive, beginning with its name.
+
+	void Expander::beginDirective (const Position &introPos)
+	{
+		if (maxDepth && directives.size() >= maxDepth) {
+			exceededMaxDepth = true;
+			abandon();
+			return;
+		}
+		if (peek() == openChar) {
+			processArithmetic();
+			return;
+		}
+		directives.emplace_back(introPos, trimArgs);
+		beginString(Directive::NAME);
+	}
+
+	//--------------------------------------------------------------------------
+	void Expander::Directive::Reset (const Position &introPos, bool trimArgs)
 	{
-		return inStreams.size() && currentStream().good();
+		this->introPos = introPos;
+		state = NAME;
+		text.clear();
+		name.clear();
+		mods = Mods(trimArgs);
+		args.clear();
+		tok = ERR;
+		savedSkipping = 0;
+		abandoned = false;
 	}
 
 	//--------------------------------------------------------------------------
-	bool Expander::eof ()
+	void Expander::DirectiveStack::emplace_back (const Position &introPos, bool trimArgs)
 	{
-		return !inStreams.size() ? true : currentStream().eof();
+		static_assert(is_nothrow_move_constructible<Directive>::value, "Directives must move, not copy, as the stack grows");
+		if (count < entries.size()) {
+			entries[count].Reset(introPos, trimArgs);
+		} else {
+			entries.emplace_back(introPos, trimArgs);
+		}
+		++ count;
 	}
 
 	//--------------------------------------------------------------------------
-	static inline bool is_number (const string &s)
+	void Expander::beginString (Directive::State state)
 	{
-		return !s.empty() && find_if(begin(s), end(s), [](char c) { return !isdigit(c); }) == end(s);
+		Directive &directive = directives.back();
+		directive.state = state;
+		directive.text.clear();
 	}
 
 	//--------------------------------------------------------------------------
-	bool Expander::processDirective (const Position &introPos)
+	// Adds a character of expanded input to the string the innermost directive
+	// is collecting, or ends the string at an unescaped delimiter, which is put
+	// back. Escapes are handled as by collectString(), and verbatim text is
+	// kept as it is.
+
+	template<class Chars>
+	void Expander::collect (const Chars &chars, char c)
 	{
-		// We've seen opening "$(", now collect first token
-		string name = collectString(nameEndChars);
+		Directive &directive = directives.back();
+		if (wasVerbatim) {
+			// Neither an escape nor a delimiter
+		} else if (c == chars.Escape) {
+			char p = peek();
+			// If escaping a delimiter, skip the escape and get the delimiter,
+			// else just keep the escape
+			if (isEnd(directive.state, p)) {
+				read(chars, c);
+			}
+		} else if (isEnd(directive.state, c)) {
+			putback(c);
+			endString(false);
+			return;
+		}
+		directive.text += c;
+	}
 
-		Mods mods(trimArgs);
-		ArgList args;
+	//--------------------------------------------------------------------------
+	// Moves the innermost directive on from the string it has just collected,
+	// as far as the next string to be expanded, or the end of the directive.
+	// The rest is read without expansion, so needs no stack of its own.
 
-		{
+	void Expander::endString (bool eof)
+	{
+		Directive &directive = directives.back();
+		switch (directive.state) {
+		case Directive::NAME:
+			directive.name.swap(directive.text);
 			// If this is an elseif directive, temporarily disable skipping so
 			// we can fully expand the argument to see if this branch should be
 			// taken or not.
-			variable_guard<int> restore_skipping(skipping, name == "elseif" ? 0 : skipping);
+			directive.savedSkipping = skipping;
+			if (directive.name == "elseif") {
+				skipping = 0;
+			}
+			endToken(getToken());
+			break;
+		case Directive::MOD:
+		{
+			const string &mod = directive.text;
+			if (mod == "n") {
+				directive.mods.TrimArgs = false;
+			} else if (mod == "i") {
+				directive.mods.IgnoreCase = true;
+			} else if (mod == "x") {
+				directive.mods.ExpandArgs = false;
+			} else if (mod == "q") {
+				directive.mods.Quote = true;
+			}
+			endToken(getToken());
+			break;
+		}
+		case Directive::ARG:
+		{
+			string &arg = directive.args.Add();
+			arg.swap(directive.text);
+			if (directive.mods.TrimArgs) {
+				trimWhitespace(arg);
+			}
+			char c;
+			if (!eof && read(c)) {
+				if (c == argSepChar) {
+					beginString(Directive::ARG);
+					break;
+				}
+				putback(c);
+			}
+			getToken();	// Get closing ')'
+			endDirective();
+			break;
+		}
+		case Directive::TEXT:
+			getToken();	// Get closing ')'
+			endAssignment();
+			break;
+		}
+	}
 
-			// Examine token after first word
-			Token tok = getToken();
+	//--------------------------------------------------------------------------
+	// Acts on the token following the innermost directive's name or a
+	// modifier.
 
-			if (tok == MOD) {
-				tok = collectMods(mods);
+	void Expander::endToken (Token tok)
+	{
+		Directive &directive = directives.back();
+		switch (tok) {
+		case MOD:
+			beginString(Directive::MOD);
+			return;
+		case ARGS:
+			if (directive.mods.ExpandArgs) {
+				beginString(Directive::ARG);
+				return;
+			}
+			collectArgs(directive.args, directive.mods.TrimArgs, false);
+			getToken();	// Get closing ')'
+			break;
+		case ASSIGN:
+		case SIMPLE_ASSIGN:
+		case APPEND:
+		case SIMPLE_APPEND:
+			if (inStreams.size()) {
+				currentStream().DirectiveSeen = true;
+			}
+			directive.tok = tok;
+			if (tok == SIMPLE_ASSIGN || tok == SIMPLE_APPEND) {
+				beginString(Directive::TEXT);
+				return;
 			}
+			directive.text.clear();
+			collectString(directive.text, Directive::TEXT, false);
+			getToken();	// Get closing ')'
+			endAssignment();
+			return;
+		case CLOSE:
+		case END:
+		case ERR:
+			break;
+		}
+		endDirective();
+	}
 
-			switch (tok) {
-			case ARGS:
-			{
-				variable_guard<int> restore_invoking(invoking, invoking + 1);
-				args = collectArgs(mods.TrimArgs, mods.ExpandArgs);
-				tok = getToken();	// Get closing ')'
-				break;
+	//--------------------------------------------------------------------------
+	void Expander::endAssignment ()
+	{
+		Directive &directive = directives.back();
+		skipping = directive.savedSkipping;
+		if (!directive.abandoned && !skipping) {
+			bool append = directive.tok == APPEND || directive.tok == SIMPLE_APPEND;
+			if (append) {
+				noteRead(directive.name);
+				noteWrite(directive.name);
 			}
-			case ASSIGN:
-			case SIMPLE_ASSIGN:
-			case APPEND:
-			case SIMPLE_APPEND:
-			{
-				currentStream().DirectiveSeen = true;
-				bool append = tok == APPEND || tok == SIMPLE_APPEND;
-				bool simple = tok == SIMPLE_ASSIGN || tok == SIMPLE_APPEND;
-				string text = collectString(textEndChars, simple);
-				tok = getToken();	// Get closing ')'
-				if (append) {
-					auto macro = macros.find(name);
-					if (macro != end(macros)) {
-						macro->second.GetBody() += text;
-					} else {
-						SetMacro(name, text);
-					}
-				} else {
-					SetMacro(name, text);
+			auto id = append ? macros.Find(directive.name) : MacroTable::None;
+			const MacroTable *baseMacros;
+			MacroTable::Id baseId;
+			if (id == MacroTable::None && append && base && (baseMacros = base->findMacro(directive.name, baseId))) {
+				// Appending to a base macro: make a copy of it here
+				MacroTable::Text baseBody = baseMacros->GetBody(baseId);
+				id = macros.Set(directive.name, baseBody.First.Data, baseBody.First.Length);
+				for (const StringView &extent : baseBody.Rest) {
+					macros.Append(id, extent.Data, extent.Length);
 				}
-				return true;
 			}
-			case CLOSE:
-			case END:
-			case ERR:
-			case MOD:
-				break;
+			if (id != MacroTable::None) {
+				macros.Append(id, directive.text.data(), directive.text.length());
+			} else {
+				SetMacro(directive.name, directive.text);
 			}
 		}
+		directives.pop_back();
+	}
+
+	//--------------------------------------------------------------------------
+	// The innermost directive has been read in full; process it. It stays on
+	// the stack while it's processed, so that builtins can tell whether it's
+	// nested within another directive.
+
+	void Expander::endDirective ()
+	{
+		Directive &directive = directives.back();
+		skipping = directive.savedSkipping;
+		if (!directive.abandoned) {
+			// Builtins don't collect directives of their own, so the directive
+			// stays put while it's processed
+			processDirective(directive.name, directive.args, directive.mods);
+		}
+		directives.pop_back();
+	}
+
+	//--------------------------------------------------------------------------
+	// Stops expanding: the input is discarded, and directives still being
+	// collected are ended without being processed. Used when limits are
+	// exceeded, typically by unbounded recursion.
+
+	void Expander::abandon ()
+	{
+		abandoned = true;
+		if (footprint && !footprint->Deferred) footprint->Halted = true;
+		for (auto &directive : directives) {
+			directive.abandoned = true;
+		}
+	}
 
-		// assert(tok == CLOSE);
+	//--------------------------------------------------------------------------
+	// The directive is the innermost one, still on the stack: see endDirective().
+	// A macro expansion takes the directive's arguments, leaving it with the
+	// strings of a frame that's been used before.
 
+	bool Expander::processDirective (const string &name, ArgList &args, const Mods &mods)
+	{
+#if defined _DEBUG || defined DEBUG
+		const Position &introPos = directives.back().introPos;
+#endif
 		if (!skipping || name == "if" || name == "else" || name == "elseif" || name == "endif") {
 			auto builtinEntry = builtins.find(name);
 			if (builtinEntry != end(builtins)) {
-				currentStream().DirectiveSeen = true;
-				// Process builtin directive
-				DBG("expanding %s at %s:\n", name.c_str(), introPos.GetCString()); {
-					int n = 1; for (string a : args) DBG("    arg %d: %s\n", n++, a.c_str());
+				// Unless the input ended within the directive, so there's no
+				// line left to skip
+				if (inStreams.size()) {
+					currentStream().DirectiveSeen = true;
 				}
+				// Process builtin directive
+				DBG("expanding %s at %s:\n", name.c_str(), introPos.GetString().c_str());
+#if defined _DEBUG || defined DEBUG
+				int n = 1;
+				for (const string &a : args) DBG("    arg %d: %s\n", n++, a.c_str());
+#endif
 				return builtinEntry->second(args, mods);
 			} else if (is_number(name)) {
 				// An argument to an enclosing expansion. Look for the closest
@@ -305,125 +1305,258 @@ end:
 				InStream *baseStream = findStreamWithArgs();
 				if (baseStream) {
 					int index = atoi(name.c_str()) - 1;
-					DBG("expanding arg %s of %s at %s\n", name.c_str(), baseStream->GetSource().c_str(), introPos.GetCString());
-					string text = baseStream->GetArg(index);
-					if (mods.Quote) {
-						text = escapeString(text);
-					}
+					DBG("expanding arg %s of %s at %s\n", name.c_str(), baseStream->GetSource().c_str(), introPos.GetString().c_str());
+					const string &text = baseStream->GetArg(index);
 					if (text.length()) {
-						putback(text, string("Expansion of arg ") + name + " of " + baseStream->GetSource());
+						// Read in place: the argument stays put as long as the
+						// stream it belongs to, which outlasts this one
+						Position source("Expansion of an argument of", baseStream->GetPosition());
+						if (mods.Quote) {
+							putbackVerbatim(text, source);
+						} else {
+							pushStream(streamPool.Make<ViewStream>(text.data(), text.length(), source));
+						}
 					}
 					return true;
 				} else {
-					DBG("empty expansion of arg %s at %s\n", name.c_str(), introPos.GetCString());
+					DBG("empty expansion of arg %s at %s\n", name.c_str(), introPos.GetString().c_str());
 				}
 			} else {
 				// Lookup macro and insert replacement text if any
-				auto macroEntry = macros.find(name);
-				if (macroEntry != end(macros)) {
-					DBG("expanding %s at %s:\n", name.c_str(), introPos.GetCString()); {
-						int n = 1; for (string a : args) DBG("    arg %d: %s\n", n++, a.c_str());
-					}
-					string text = macroEntry->second.GetBody();
+				noteRead(name);
+				auto id = macros.Find(name);
+				const MacroTable *baseMacros = nullptr;
+				MacroTable::Id baseId;
+				if (id != MacroTable::None || (base && (baseMacros = base->findMacro(name, baseId)))) {
+					DBG("expanding %s at %s:\n", name.c_str(), introPos.GetString().c_str());
+#if defined _DEBUG || defined DEBUG
+					int n = 1;
+					for (const string &a : args) DBG("    arg %d: %s\n", n++, a.c_str());
+#endif
 					if (mods.Quote) {
-						text = escapeString(text);
-					}
-					if (text.length()) {
-						putback(text, string("Expansion of ") + name, args);
+						string text = id != MacroTable::None ? macros.GetString(id) : baseMacros->GetString(baseId);
+						if (text.length()) {
+							putbackVerbatim(text, string("Expansion of ") + name);
+						}
+					} else {
+						// Read the body in place, however large it has grown
+						if (id != MacroTable::None) {
+							if (macros.GetLength(id)) {
+								pushStream(streamPool.Make<MacroStream>(macros, id, frames, frames.Take(name, args)));
+							}
+						} else if (baseMacros->GetLength(baseId)) {
+							// The index of a base macro isn't shared, since the
+							// base may be shared by other threads
+							pushStream(streamPool.Make<BodyStream>(baseMacros->GetBody(baseId), frames, frames.Take(name, args)));
+						}
 					}
 					return true;
 				} else {
-					DBG("empty expansion of %s at %s\n", name.c_str(), introPos.GetCString());
+					DBG("empty expansion of %s at %s\n", name.c_str(), introPos.GetString().c_str());
 				}
 			}
 		}
 		return false;
 	}
 
+	//--------------------------------------------------------------------------
+	// A result that isn't to be rescanned is put back verbatim, as by :q. A
+	// segment being expanded ahead of its turn stops instead, to call it in
+	// its turn: see expandParallel().
+
+	bool Expander::callNative (const string &name, const NativeBuiltin &builtin, const ArgList &args, const Mods &mods)
+	{
+		if (footprint && footprint->Speculative) {
+			footprint->Deferred = true;
+			abandon();
+			return true;
+		}
+		vector<StringView> views;
+		views.reserve(args.size());
+		for (auto &arg : args) {
+			views.push_back({ arg.data(), arg.length() });
+		}
+		BuiltinOutput output;
+		bool ok = builtin(views, output);
+		if (output.text.length()) {
+			if (output.rescan && !mods.Quote) {
+				putback(output.text, string("Result of ") + name);
+			} else {
+				putbackVerbatim(output.text, string("Result of ") + name);
+			}
+		}
+		return ok;
+	}
+
+	//--------------------------------------------------------------------------
+	// $((<expr>)) - Substitutes the value of an integer expression. Its text
+	// is collected without expansion, so that it can be compiled just once
+	// however many times it is evaluated; operands are looked up each time.
+
+	bool Expander::processArithmetic ()
+	{
+		char c;
+		get(c, false);	// Eat inner '('
+		string text;
+		collectString(text, Directive::TEXT, false);
+		if (!get(c, false) || !get(c, false)) {	// Get inner ')' and the closing one
+			DBG("unterminated $(( at end of input\n");
+			arithmeticFailed = arithmeticFailed || !skipping;
+			return false;
+		}
+		if (c != closeChar) {
+			DBG("$(( not closed by ))\n");
+			arithmeticFailed = arithmeticFailed || !skipping;
+			putback(c);
+			return false;
+		}
+		if (skipping) {
+			return false;
+		}
+
+		auto entry = expressions.find(text);
+		if (entry == end(expressions)) {
+			entry = expressions.emplace(text, Expression::Compile(text, syntax)).first;
+		}
+		int64_t value;
+		if (!entry->second || !entry->second->Evaluate([this](const string &name, int64_t &value) {
+				return lookupOperand(name, value);
+			}, value)) {
+			DBG("cannot evaluate $((%s))\n", text.c_str());
+			arithmeticFailed = true;
+			return false;
+		}
+		putbackVerbatim(to_string((long long)value), "Arithmetic result");
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Gets an integer operand of an expression: the body of a macro, or an
+	// argument to the enclosing macro if name is a number. Undefined and
+	// empty operands are 0.
+
+	bool Expander::lookupOperand (const string &name, int64_t &value)
+	{
+		string text;
+		if (is_number(name)) {
+			InStream *baseStream = findStreamWithArgs();
+			if (baseStream) {
+				text = baseStream->GetArg(atoi(name.c_str()) - 1);
+			}
+		} else {
+			noteRead(name);
+			MacroTable::Id id;
+			const MacroTable *table = findMacro(name, id);
+			if (table) {
+				text = table->GetString(id);
+			}
+		}
+		trimWhitespace(text);
+		if (text.empty()) {
+			value = 0;
+			return true;
+		}
+		const char *start = text.c_str();
+		bool negative = *start == '-';
+		if (negative || *start == '+') ++ start;
+		bool hex = start[0] == '0' && (start[1] == 'x' || start[1] == 'X');
+		if (!isxdigit((unsigned char)start[hex ? 2 : 0])) {
+			return false;
+		}
+		char *stop;
+		errno = 0;
+		uint64_t magnitude = strtoull(start, &stop, hex ? 16 : 10);
+		if (*stop || errno == ERANGE) {
+			return false;
+		}
+		// As for literals, hex values may use all 64 bits
+		if (!hex && magnitude > (uint64_t)INT64_MAX + negative) {
+			return false;
+		}
+		value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+		return true;
+	}
+
 	//--------------------------------------------------------------------------
 	// The only time this is called with expand==false is when collecting the
 	// contents of a normal recursive variable assignment. In this case, nested
 	// directives need to be tracked since they are also terminated by the same
 	// end-delimiter we are looking for.
 
-	string Expander::collectString (const string &delims, bool expand)
+	void Expander::collectString (string &output, Directive::State state, bool expand)
+	{
+		if (defaultChars) {
+			collectString(DefaultChars(), output, state, expand);
+		} else {
+			collectString(CustomChars(syntax), output, state, expand);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	template<class Chars>
+	void Expander::collectString (const Chars &chars, string &output, Directive::State state, bool expand)
 	{
 		int nested = 0;
-		ostringstream output;
 		char c;
-		while (get(c, expand)) {
+		while (get(chars, c, expand)) {
 			bool escaped = false;
-			if (c == escapeChar) {
+			if (wasVerbatim) {
+				escaped = true;
+			} else if (c == chars.Escape) {
 				char p = peek();
 				// If escaping a delimiter, skip the escape and get the delimiter,
 				// else just keep the escape
-				if (delims.find(p) != string::npos) {
-					get(c, expand);
+				if (isEnd(state, p)) {
+					get(chars, c, expand);
 					escaped = true;
 				}
-			} else if (!nested && delims.find(c) != string::npos) {
+			} else if (!nested && isEnd(state, c)) {
 				putback(c);
 				break;
 			}
 			if (!expand && !escaped) {
 				// Keep track of nested directives when not expanding
 				// TODO: This doesn't really match full directives, just '(' and ')'
-				if (c == openChar) {
+				if (c == chars.Open) {
 					++ nested;
-				} else if (c == closeChar) {
+				} else if (c == chars.Close) {
 					-- nested;
 				}
 			}
-			output.put(c);
+			output += c;
 		}
-		return output.str();
 	}
 
 	//--------------------------------------------------------------------------
-	ArgList Expander::collectArgs (bool trim, bool expand)
+	void Expander::collectArgs (ArgList &args, bool trim, bool expand)
 	{
-		ArgList args;
 		char c;
 		do {
-			string arg = collectString(argEndChars, expand);
-			args.push_back(trim ? trimWhitespace(arg) : arg);
-			get(c);
+			string &arg = args.Add();
+			collectString(arg, Directive::ARG, expand);
+			if (trim) {
+				trimWhitespace(arg);
+			}
+			if (!get(c, false)) {
+				return;
+			}
 		} while (c == argSepChar);
 		putback(c);
-		return args;
 	}
 
 	//--------------------------------------------------------------------------
-	Expander::Token Expander::collectMods (Mods &mods)
-	{
-		Token tok;
-		do {
-			string mod = collectString(modEndChars);
-			if (mod == "n") {
-				mods.TrimArgs = false;
-			} else if (mod == "i") {
-				mods.IgnoreCase = true;
-			} else if (mod == "x") {
-				mods.ExpandArgs = false;
-			} else if (mod == "q") {
-				mods.Quote = true;
-			}
-			tok = getToken();
-		} while (tok == MOD);
-		return tok;
-	}
+	// Trims s in place, so that an argument keeps its buffer.
 
-	//--------------------------------------------------------------------------
-	string Expander::trimWhitespace (const string &s)
+	void Expander::trimWhitespace (string &s)
 	{
-		if (!s.length()) return s;
+		if (!s.length()) return;
 
 		// Look for initial whitespace. If <escape><whitespace> found, stop
 		bool escaped = false;
 		size_t i;
 		for (i = 0; i < s.length(); ++ i) {
-			if (!isspace(s[i])) {
-				if (s[i] == escapeChar && i + 1 < s.length() && isspace(s[i + 1])) {
+			if (!syntax.Classes.IsSpace(s[i])) {
+				if (s[i] == escapeChar && i + 1 < s.length() && syntax.Classes.IsSpace(s[i + 1])) {
 					++ i;	// Omit escape, leaving subsequent leading whitespace
 					escaped = true;
 				}
@@ -434,7 +1567,7 @@ end:
 		size_t j = s.length() - 1;
 		if (!escaped) {	// TODO: escape before leading whitespace also preserves trailing whitespace - make that configurable?
 			for (; j >= i; -- j) {
-				if (!isspace(s[j])) {
+				if (!syntax.Classes.IsSpace(s[j])) {
 					break;
 				}
 			}
@@ -444,41 +1577,39 @@ end:
 			// String will consist only of escaped whitespace
 			count = s.length() - i;
 		}
-		return s.substr(i, count);
+		s.erase(i + count);
+		s.erase(0, i);
 	}
 
 	//--------------------------------------------------------------------------
-	std::string Expander::escapeString (const std::string &s)
+	Expander::Token Expander::getToken ()
 	{
-		if (!s.length()) return s;
-		std::string out = "";
-		for (size_t i = 0; i < s.length(); ++ i) {
-			if (   s[i] == introChar				// Start of a directive.
-//				|| s[i] == openChar					// Start of a directive.
-				|| s[i] == closeChar && invoking	// End of a directive. Only escaped in invocation.
-				|| s[i] == argSepChar && invoking	// Separator between arguments. Only escaped in invocation.
-				|| s[i] == escapeChar				// Escapes other special chars.
-//				|| s[i] == modsChar					// The start of modifiers to expansion.
-				) {
-				out += escapeChar;
-			}
-			out += s[i];
-		}
-		return out;
+		return defaultChars ? getToken(DefaultChars()) : getToken(CustomChars(syntax));
 	}
 
 	//--------------------------------------------------------------------------
-	Expander::Token Expander::getToken ()
+	template<class Chars>
+	Expander::Token Expander::getToken (const Chars &chars)
 	{
 		string whitespace;
+		InStream *marked = nullptr;		// Where whitespace after the first can be read again
+		InStream::Mark mark = { nullptr, 0, "" };
+		size_t depth = 0;
+		bool plain = true;				// No escapes or verbatim text in the whitespace
 		char c;
-		while (get(c, false)) {
-			if (isspace(c)) {
+		while (read(chars, c)) {
+			if (syntax.Classes.IsSpace(c)) {
+				if (whitespace.empty() && inStreams.size()) {
+					marked = &currentStream();
+					mark = marked->GetMark();
+					depth = inStreams.size();
+				}
+				plain = plain && !wasEscaped && !wasVerbatim;
 				whitespace += c;
 			} else if (c == ':') {
-				if (get(c, false)) {
+				if (read(chars, c)) {
 					if (c == '+') {
-						if (get(c, false)) {
+						if (read(chars, c)) {
 							if (c == '=') {
 								return SIMPLE_APPEND;
 							} else {
@@ -488,38 +1619,44 @@ end:
 						return ERR;
 					} else if (c == '=') {
 						return SIMPLE_ASSIGN;
-					} else if (modsChar == ':') {
+					} else if (chars.Mods == ':') {
 						putback(c);
 						return MOD;
 					}
 				}
-				if (modsChar == ':') {
+				if (chars.Mods == ':') {
 					return MOD;
 				} else {
 					return ERR;
 				}
 			} else if (c == '+') {
-				if (get(c, false)) {
+				if (read(chars, c)) {
 					if (c == '=') {
 						return APPEND;
 					}
 				}
-				if (modsChar == '+') {
+				if (chars.Mods == '+') {
 					return MOD;
 				} else {
 					return ERR;
 				}
-			} else if (c == modsChar) {
+			} else if (c == chars.Mods) {
 				return MOD;
 			} else if (c == '=') {
 				return ASSIGN;
-			} else if (c == closeChar) {
+			} else if (c == chars.Close) {
 				return CLOSE;
 			} else {
 				if (whitespace.length() > 0) {
-					putback(c);
-					if (whitespace.length() > 1) {
-						putback(whitespace.substr(1, whitespace.size() - 1), "Whitespace putback");
+					// All but the first whitespace character are taken as the
+					// start of the arguments: read them again in place if they
+					// came from the current stream, else put them back
+					if (whitespace.length() == 1 || !plain || !marked || inStreams.size() != depth ||
+						&currentStream() != marked || !marked->Rewind(mark)) {
+						putback(c);
+						if (whitespace.length() > 1) {
+							putback(whitespace.substr(1, whitespace.size() - 1), "Whitespace putback");
+						}
 					}
 					return ARGS;
 				}
@@ -530,48 +1667,53 @@ end:
 	}
 
 	//--------------------------------------------------------------------------
-	// Returns a pointer rather than a reference because we want the result to
-	// be nullable to denote not found.
+	// Looks for a macro here, then in the base expander, if there is one.
+	// Returns the table it's in, or nullptr if there's no such macro.
 
-	InStream *Expander::findStream (function<bool(const shared_ptr<InStream> &ptr)> pred)
+	const MacroTable *Expander::findMacro (const string &name, MacroTable::Id &id) const
 	{
-		for (auto &ptr : inStreams) {
-			if (pred(ptr)) {
-				return ptr.get();
-			}
+		id = macros.Find(name);
+		if (id != MacroTable::None) {
+			return &macros;
 		}
-		return nullptr;
+		return base ? base->findMacro(name, id) : nullptr;
 	}
 
 	//--------------------------------------------------------------------------
-	InStream *Expander::findStreamWithNamePrefix (const string &prefix)
+	// Each stream records the closest one with arguments as it's pushed, so
+	// there's no need to search the stack.
+
+	InStream *Expander::findStreamWithArgs ()
 	{
-		return findStream([prefix](const shared_ptr<InStream> &ptr) {
-			return ptr->GetSource().compare(0, prefix.length(), prefix) == 0;
-		});
+		return inStreams.size() ? currentStream().GetArgFrame() : nullptr;
 	}
 
 	//--------------------------------------------------------------------------
-	InStream *Expander::findStreamWithArgs ()
+	InStream *Expander::findStreamWithPath ()
 	{
-		return findStream([](const shared_ptr<InStream> &ptr) {
-			return ptr->GetArgCount() > 0;
-		});
+		return inStreams.size() ? currentStream().GetPathFrame() : nullptr;
 	}
 
 	//--------------------------------------------------------------------------
-	InStream *Expander::findStreamWithPath ()
+	void Expander::pushStream (const shared_ptr<InStream> &stream)
 	{
-		return findStream([](const shared_ptr<InStream> &ptr) {
-			return ptr->GetPath() != nullptr;
-		});
+		// Nothing can be reading macro bodies in place between expansions
+		if (inStreams.empty()) {
+			macros.Compact();
+		}
+		stream->Link(inStreams.size() ? &currentStream() : nullptr);
+		inStreams.push_front(stream);
+		if (maxDepth && inStreams.size() > maxDepth) {
+			exceededMaxDepth = true;
+			abandon();
+		}
 	}
 
 	//--------------------------------------------------------------------------
 	const path Expander::getCurrentPath ()
 	{
 		InStream *is = findStreamWithPath();
-		return is ? path(*is->GetPath()).remove_filename() : current_path();
+		return is ? path(*is->GetPath()).remove_filename() : !directory.empty() ? path(directory) : current_path();
 	}
 
 	//--------------------------------------------------------------------------
@@ -585,27 +1727,196 @@ end:
 	{
 		// Putback for file streams seems to be problematic (in my Mac OS X
 		// build, it always fails). So we no longer use std::istream's putback
-		// facility and use separate putback storage. The simplest way to do it
-		// is to push a new InStream holding a single character.
+		// facility and use separate putback storage. Usually c is the character
+		// just read, and the current stream can simply step back over it;
+		// otherwise push a new InStream holding a single character.
 		// TODO: What if c is .NUL. (EOF)? Do nothing?
-		// TODO: Optimize single-character putback to use a lighter-weight mechanism?
-		DBG("putback(): %s\n", printchar(c));
+		DBG("putback(): %s\n", printchar(c).c_str());
+		if (!wasEscaped && currentStream().Unget(c, wasVerbatim)) {
+			return true;
+		}
 		Position p = currentStream().GetPutbackPosition();	// TODO: What if there is no current stream? (end of input)
-		inStreams.push_front(make_shared<CharStream>(c, p));
+		if (wasVerbatim) {
+			pushStream(make_shared<VerbatimStream>(string(1, c), p));
+			return good();
+		}
+		pushStream(make_shared<CharStream>(c, p));
 		if (wasEscaped) {
-			DBG("putback(): %s\n", printchar(escapeChar));
-			inStreams.push_front(make_shared<CharStream>(escapeChar, p.Putback()));
+			DBG("putback(): %s\n", printchar(escapeChar).c_str());
+			pushStream(make_shared<CharStream>(escapeChar, p.Putback()));
 		}
 		return good();
 	}
 
 	//--------------------------------------------------------------------------
-	bool Expander::putback (const string &s, const string &streamName, const ArgList &args)
+	bool Expander::putback (const string &s, const string &streamName, const SharedArgList &args,
+							const shared_ptr<BlockIndex> &index)
+	{
+		pushStream(make_shared<StringStream>(s, streamName, args, index));
+		return good();
+	}
+
+	//--------------------------------------------------------------------------
+	// Puts back text that is only to be output, such as the result of a
+	// builtin. It isn't scanned for directives, or unescaped, when it's read.
+
+	bool Expander::putbackVerbatim (const string &s, const Position &streamName)
 	{
-		inStreams.push_front(make_shared<StringStream>(s, streamName, args));
+		pushStream(make_shared<VerbatimStream>(s, streamName));
 		return good();
 	}
 
+	//--------------------------------------------------------------------------
+	// Source adapter that lets the block scanner read raw characters from an
+	// InStream.
+
+	struct InStreamSource
+	{
+		InStream &stream;
+
+		bool get (char &c)
+		{
+			return stream.get(c);
+		}
+
+		int peek ()
+		{
+			return stream.peek();
+		}
+
+		size_t tell ()
+		{
+			return (size_t)(stream.GetPosition().Offset + 1);
+		}
+	};
+
+	//--------------------------------------------------------------------------
+	// Called after a block directive when we are skipping. Rather than reading
+	// through the rest of the branch with every nested directive still being
+	// collected and expanded, jump straight to the next $(elseif), $(else) or
+	// $(endif) at the same level, which is then processed as usual. Anything
+	// in the branch that isn't in the current stream is skipped the slow way.
+	// The directive may have come from a stream of its own, such as the one a
+	// sibling found by scanning was put back in, so the branch is skipped in
+	// whichever stream follows it.
+
+	void Expander::skipBranch ()
+	{
+		// The directive must not be nested inside another one, and there must
+		// be something left to skip
+		if (directives.size() > 1) {
+			return;
+		}
+		popEndedStreams();
+		if (!inStreams.size() || currentStream().IsCharStream() || currentStream().IsVerbatim()) {
+			return;
+		}
+		InStream &stream = currentStream();
+
+		// Text streams (input strings, macro bodies, etc.) have an index
+		const BlockIndex *index = stream.GetBlockIndex(syntax);
+		if (index) {
+			const BlockIndex::Target *target = index->Find(stream.GetPosition().Offset + 1);
+			if (target) {
+				DBG("skipBranch(): jump from %s", stream.GetPosition().GetString().c_str());
+				stream.Seek(*target);
+				DBG(" to %s\n", stream.GetPosition().GetString().c_str());
+				return;
+			}
+		}
+
+		// Otherwise scan forward for the sibling without expanding anything,
+		// then put it back to be processed
+		BlockScanner scanner(syntax);
+		string directive;
+		scanner.SetCapture(&directive);
+		InStreamSource src{ stream };
+		int level = 0;
+		size_t start;
+		BlockScanner::Kind kind;
+		while ((kind = scanner.Next(src, start)) != BlockScanner::NONE) {
+			if (kind == BlockScanner::IF) {
+				++ level;
+			} else if (kind == BlockScanner::FOREACH || kind == BlockScanner::END) {
+				continue;
+			} else if (level) {
+				if (kind == BlockScanner::ENDIF) -- level;
+			} else {
+				DBG("skipBranch(): scanned to %s\n", stream.GetPosition().GetString().c_str());
+				putback(directive, "Skipped block");
+				return;
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Source adapter that reads the raw text following a directive: any
+	// characters that were put back, then the rest of the directive's stream.
+	// Everything read is kept.
+
+	struct BodySource
+	{
+		deque<shared_ptr<InStream>> &streams;
+		InStream &stream;
+		string &text;
+
+		bool get (char &c)
+		{
+			if (streams.front()->IsCharStream()) {
+				bool ok = streams.front()->get(c);
+				streams.pop_front();
+				if (!ok) return false;
+			} else if (!stream.get(c)) {
+				return false;
+			}
+			text.push_back(c);
+			return true;
+		}
+
+		int peek ()
+		{
+			return streams.front()->IsCharStream() ? streams.front()->peek() : stream.peek();
+		}
+
+		size_t tell ()
+		{
+			return text.size();
+		}
+	};
+
+	//--------------------------------------------------------------------------
+	// Reads the body of a $(foreach), without expanding it, up to and
+	// including the matching $(end). Returns false if there's no $(end), in
+	// which case the body is the rest of the stream.
+
+	bool Expander::collectBody (string &body)
+	{
+		body.clear();
+		auto base = find_if(begin(inStreams), end(inStreams), [](const shared_ptr<InStream> &ptr) {
+			return !ptr->IsCharStream();
+		});
+		if (base == end(inStreams)) {
+			return false;
+		}
+		BlockScanner scanner(syntax);
+		BodySource src{ inStreams, **base, body };
+		int level = 0;
+		size_t start;
+		BlockScanner::Kind kind;
+		while ((kind = scanner.Next(src, start)) != BlockScanner::NONE) {
+			if (kind == BlockScanner::FOREACH) {
+				++ level;
+			} else if (kind == BlockScanner::END) {
+				if (!level) {
+					body.resize(start);
+					return true;
+				}
+				-- level;
+			}
+		}
+		return false;
+	}
+
 	//--------------------------------------------------------------------------
 	bool Expander::do_if (const ArgList &args, const Mods &mods)
 	{
@@ -633,6 +1944,7 @@ end:
 				ifContext.push({ IfContext::Phase::ElseOrEnd, false, true });
 				++ skipping;
 			}
+			if (skipping) skipBranch();
 			return true;
 		}
 	}
@@ -652,6 +1964,7 @@ end:
 				}
 			}
 			ifContext.top().phase = IfContext::Phase::EndOnly;
+			if (skipping) skipBranch();
 			return true;
 		} else {
 			// TODO: Report error
@@ -688,6 +2001,7 @@ end:
 					++ skipping;
 				}
 			}
+			if (skipping) skipBranch();
 			return true;
 		} else {
 			// TODO: Report error
@@ -703,6 +2017,7 @@ end:
 				-- skipping;
 			}
 			ifContext.pop();
+			if (skipping) skipBranch();
 			return true;
 		} else {
 			// TODO: Report error
@@ -729,9 +2044,14 @@ end:
 	bool Expander::do_include (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() && args[0].size()) {
-			const vector<string> restArgs(args.begin() + 1, args.end());
+			auto restArgs = ShareArgs(ArgList(args.begin() + 1, args.end()));
 			path p = canonical(args[0], getCurrentPath());
-			inStreams.push_front(make_shared<FileStream>(p.string(), restArgs));
+			auto compiled = templateCache ? templateCache->Get(p.string()) : CompiledTemplate::Load(p.string());
+			if (compiled) {
+				pushStream(make_shared<MappedStream>(compiled, p.string(), restArgs, true));
+			} else {
+				pushStream(make_shared<FileStream>(p.string(), restArgs));
+			}
 			return currentStream().good();
 		} else {
 			// TODO: Report error
@@ -743,11 +2063,11 @@ end:
 	bool Expander::do_equal (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() > 1) {
-			putback(compare(args[0], args[1], mods.IgnoreCase) ? "1" : "0", "Equal result");
+			putbackVerbatim(compare(args[0], args[1], mods.IgnoreCase) ? "1" : "0", "Equal result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Equal error");
+			putbackVerbatim("0", "Equal error");
 			return false;
 		}
 	}
@@ -756,11 +2076,11 @@ end:
 	bool Expander::do_notequal (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() > 1) {
-			putback(!compare(args[0], args[1], mods.IgnoreCase) ? "1" : "0", "Notequal result");
+			putbackVerbatim(!compare(args[0], args[1], mods.IgnoreCase) ? "1" : "0", "Notequal result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Notequal error");
+			putbackVerbatim("0", "Notequal error");
 			return false;
 		}
 	}
@@ -775,11 +2095,11 @@ end:
 			if (mods.IgnoreCase) flags |= regex_constants::icase;
 			regex pattern(args[1], flags);
 			bool match = regex_search(args[0], pattern);
-			putback(match ? "1" : "0", "Match result");
+			putbackVerbatim(match ? "1" : "0", "Match result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Match error");
+			putbackVerbatim("0", "Match error");
 			return false;
 		}
 	}
@@ -788,11 +2108,11 @@ end:
 	bool Expander::do_and (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() > 1) {
-			putback(textToBool(args[0]) && textToBool(args[1]) ? "1" : "0", "And result");
+			putbackVerbatim(textToBool(args[0]) && textToBool(args[1]) ? "1" : "0", "And result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "And error");
+			putbackVerbatim("0", "And error");
 			return false;
 		}
 	}
@@ -801,11 +2121,11 @@ end:
 	bool Expander::do_or (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() > 1) {
-			putback(textToBool(args[0]) || textToBool(args[1]) ? "1" : "0", "Or result");
+			putbackVerbatim(textToBool(args[0]) || textToBool(args[1]) ? "1" : "0", "Or result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Or error");
+			putbackVerbatim("0", "Or error");
 			return false;
 		}
 	}
@@ -814,11 +2134,11 @@ end:
 	bool Expander::do_not (const ArgList &args, const Mods &mods)
 	{
 		if (args.size() == 1) {
-			putback(!textToBool(args[0]) ? "1" : "0", "Not result");
+			putbackVerbatim(!textToBool(args[0]) ? "1" : "0", "Not result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Not error");
+			putbackVerbatim("0", "Not error");
 			return false;
 		}
 	}
@@ -838,15 +2158,82 @@ end:
 				}
 			} else {
 				// Lookup macro
-				auto macroEntry = macros.find(args[0]);
-				defined = macroEntry != end(macros);
+				noteRead(args[0]);
+				MacroTable::Id id;
+				defined = findMacro(args[0], id) != nullptr;
+			}
+			putbackVerbatim(defined ? "1" : "0", "Defined result");
+			return true;
+		} else {
+			// TODO: Report error
+			putbackVerbatim("0", "Defined error");
+			return false;
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// $(foreach NAME, <text>[, <text>]*)<body>$(end)
+	// Expands the body once for each text argument, with macro NAME set to it.
+	// The body is collected once and then re-read in place for each item, so
+	// the loop runs at constant stack depth however many items there are.
+	// NAME is only bound for the loop: after it, it's as it was before, or
+	// undefined again. A loop with no $(end) is an error, rather than
+	// repeating the rest of the input.
+
+	bool Expander::do_foreach (const ArgList &args, const Mods &mods)
+	{
+		if (args.size() && args[0].size()) {
+			bool graphSeen = inStreams.size() && currentStream().GraphSeen;
+			string body;
+			if (!collectBody(body)) {
+				return false;
+			}
+			if (args.size() > 1 && body.size()) {
+				const string name = args[0];
+				MacroTable::Id id = macros.Find(name);
+				bool wasDefined = id != MacroTable::None;
+				string previous = wasDefined ? macros.GetString(id) : string();
+				auto loop = make_shared<LoopStream>(body, string("Loop over ") + name,
+													vector<string>(args.begin() + 1, args.end()),
+													[this, name](const string &item) {
+														SetMacro(name, item);
+													},
+													[this, name, wasDefined, previous]() {
+														if (wasDefined) {
+															SetMacro(name, previous);
+														} else {
+															unsetMacro(name);
+														}
+													});
+				loop->GraphSeen = graphSeen;
+				loop->DirectiveSeen = true;
+				pushStream(loop);
 			}
-			putback(defined ? "1" : "0", "Defined result");
 			return true;
 		} else {
 			// TODO: Report error
-			putback("0", "Defined error");
 			return false;
 		}
 	}
+
+	//--------------------------------------------------------------------------
+	// $(output [<file>])
+	// Sends the output that follows to the file, relative to the output root,
+	// instead of to the output given to Expand(), until the next $(output).
+	// With no file, goes back to that output. Several files can be written in
+	// one pass this way, all sharing the same macros.
+
+	bool Expander::do_output (const ArgList &args, const Mods &mods)
+	{
+		if (footprint) {
+			// Whatever follows may be going somewhere else now
+			footprint->Halted = true;
+		}
+		if (args.size() > 1 || (args.size() && args[0].empty()) || !expanding) {
+			// TODO: Report error
+			return false;
+		}
+		outputSwitches.push_back({ expanding->size(), args.size() ? getOutputPath(args[0]) : string() });
+		return true;
+	}
 }
@@ -7,36 +7,106 @@
 #ifndef __stemple__Expander__
 #define __stemple__Expander__
 
+#include <deque>
 #include <fstream>
 #include <functional>
-#include <list>
 #include <map>
 #include <memory>
 #include <stack>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "ArgList.h"
+#include "BlockIndex.h"
+#include "Builtin.h"
+#include "CompiledTemplate.h"
+#include "Expansion.h"
+#include "Expression.h"
 #include "InStream.h"
-#include "Macro.h"
+#include "MacroTable.h"
+#include "OutputFiles.h"
 #include "Position.h"
+#include "TemplateCache.h"
 
 namespace stemple
 {
 	class Expander
 	{
+		friend class Expansion;
+
 	public:
 		Expander ();
 
+		Expander (const Expander &other);
+
+		Expander (const std::shared_ptr<const Expander> &base);
+
 		virtual ~Expander ();
 
+		void Reset (bool restoreBaseline = false);
+
+		void SetBaseline ();
+
 		std::string Expand (const std::string &input);
 
 		bool Expand (std::istream &input, const std::string &inputName, std::ostream &output);
 
+		bool Expand (const std::shared_ptr<CompiledTemplate> &input, const std::string &inputName,
+					 std::ostream &output);
+
+		bool Compile (const std::string &sourcePath);
+
 		void SetMacro (const std::string &name, const std::string &body, bool simple = false);
 
+		void SetMacro (StringView name, StringView body, bool simple = false);
+
+		void SetMacros (const MacroDefinitions &definitions, bool simple = false);
+
+		bool SetMacrosFromFile (const std::string &pathname, bool simple = false);
+
 		void SetSpecialChars (char escape, char intro, char open, char argSep, char close);
 
+		// Far deeper than any template needs, but small enough that runaway
+		// recursion stops within a few tens of megabytes.
+		static const size_t DefaultMaxDepth = 250000;
+
+		void SetMaxDepth (size_t depth);
+
+		// Whether the last expansion was cut short by exceeding the limit.
+		bool ExceededMaxDepth () const
+		{
+			return exceededMaxDepth;
+		}
+
+		// Whether an expression in the last expansion couldn't be parsed or
+		// evaluated. It expands to nothing.
+		bool ArithmeticFailed () const
+		{
+			return arithmeticFailed;
+		}
+
+		void RegisterBuiltin (const std::string &name, const NativeBuiltin &builtin);
+
+		void SetParallelism (unsigned threads, size_t minSegment = 64 * 1024);
+
+		void SetTemplateCache (const std::shared_ptr<TemplateCache> &cache);
+
+		const std::shared_ptr<TemplateCache> &GetTemplateCache () const
+		{
+			return templateCache;
+		}
+
+		void SetDirectory (const std::string &directory);
+
+		void SetOutputRoot (const std::string &root, size_t maxOpenFiles = 16);
+
+		const Syntax &GetSyntax () const
+		{
+			return syntax;
+		}
+
 	protected:
 		struct Mods
 		{
@@ -51,47 +121,212 @@ namespace stemple
 
 		std::string expand (const std::string &input, const std::string &source);
 
+		void copySettings (const Expander &other);
+
+		void registerStandardBuiltins ();
+
+		void unsetMacro (const std::string &name);
+
 		void expand (std::ostream &output);
 
-		bool processDirective (const Position &introPos);
+		void write (std::ostream &output, const std::string &chunk);
+
+		void beginOutput (std::ostream &output);
+
+		bool endOutput ();
+
+		std::string getOutputPath (const std::string &pathname) const;
+
+		bool expand (std::string &chunk, size_t size, HeldOutput &held);
+
+		// The parts that look at every character are templated on the special
+		// characters, so that the defaults can be compiled in. Each is called
+		// through the non-template version, which picks the instantiation.
+		template<class Chars>
+		bool expand (const Chars &chars, std::string &chunk, size_t size, HeldOutput &held);
 
-		std::string collectString (const std::string &delims, bool expand = true);
+		static void put (std::string &chunk, size_t size, const char *text, size_t length, HeldOutput &held);
 
-		ArgList collectArgs (bool trim, bool expand = true);
+		// The macros that an expansion looked up and defined
+		struct Footprint
+		{
+			std::unordered_set<std::string> Reads;
+			std::unordered_set<std::string> Writes;
+			bool Halted = false;		// Abandoned, or redirected the output
+			bool Speculative = false;	// Expanded ahead of its turn, on a worker
+			bool Deferred = false;		// Stopped at something that mustn't run early
+		};
+
+		// A run of whole lines of input that can be expanded on its own
+		struct Segment
+		{
+			size_t Start;
+			size_t Length;
+			int Line;								// Of its first character
+			Footprint Access;
+			std::string Output;
+			std::map<std::string, std::string> Written;	// Final bodies of Access.Writes
+			bool Failed = false;					// Threw an exception
+			bool ArithmeticFailed = false;
+		};
+
+		bool expandParallel (const char *data, size_t length, const std::string &inputName, std::ostream &output);
 
-		std::string trimWhitespace (const std::string &s);
+		std::vector<Segment> findSegments (const char *data, size_t length) const;
 
-		std::string escapeString (const std::string &s);
+		void noteRead (const std::string &name)
+		{
+			if (footprint) footprint->Reads.insert(name);
+		}
+
+		void noteWrite (const std::string &name)
+		{
+			if (footprint) footprint->Writes.insert(name);
+		}
 
 		enum Token { ARGS, ASSIGN, APPEND, MOD, SIMPLE_ASSIGN, SIMPLE_APPEND, CLOSE, END, ERR };
 
-		Token collectMods (Mods &mods);
+		// A directive whose name, modifiers or arguments are being collected.
+		// Directives nested within them are stacked up on the heap, so there's
+		// no limit to how deeply they can nest besides maxDepth.
+		struct Directive
+		{
+			enum State { NAME, MOD, ARG, TEXT };
+			Position introPos;
+			State state = NAME;						// Also says what ends the string
+			std::string text;						// The string being collected
+			std::string name;
+			Mods mods;
+			ArgList args;
+			Token tok = ERR;						// Kind of assignment
+			int savedSkipping = 0;					// Restored once collected
+			bool abandoned = false;
+			Directive (const Position &introPos, bool trimArgs) : introPos(introPos), mods(trimArgs)
+			{
+			}
+			void Reset (const Position &introPos, bool trimArgs);
+		};
+
+		// The directives being collected, innermost last. A directive that's
+		// popped is kept to be reset by the next one at the same depth, so the
+		// strings and arguments it collects reuse their buffers.
+		class DirectiveStack
+		{
+		public:
+			typedef std::vector<Directive>::iterator iterator;
+			void emplace_back (const Position &introPos, bool trimArgs);
+			void pop_back ()
+			{
+				-- count;
+			}
+			Directive &back ()
+			{
+				return entries[count - 1];
+			}
+			size_t size () const
+			{
+				return count;
+			}
+			void clear ()
+			{
+				count = 0;
+			}
+			iterator begin ()
+			{
+				return entries.begin();
+			}
+			iterator end ()
+			{
+				return entries.begin() + count;
+			}
+		private:
+			std::vector<Directive> entries;
+			size_t count = 0;
+		};
+
+		void beginDirective (const Position &introPos);
+
+		bool isEnd (Directive::State state, char c) const;
+
+		void beginString (Directive::State state);
+
+		template<class Chars>
+		void collect (const Chars &chars, char c);
+
+		void endString (bool eof);
+
+		void endToken (Token tok);
+
+		void endAssignment ();
+
+		void endDirective ();
+
+		void abandon ();
+
+		bool processDirective (const std::string &name, ArgList &args, const Mods &mods);
+
+		bool callNative (const std::string &name, const NativeBuiltin &builtin, const ArgList &args, const Mods &mods);
+
+		void collectString (std::string &output, Directive::State state, bool expand = true);
+
+		template<class Chars>
+		void collectString (const Chars &chars, std::string &output, Directive::State state, bool expand);
+
+		void collectArgs (ArgList &args, bool trim, bool expand = true);
+
+		void trimWhitespace (std::string &s);
 
 		Token getToken ();
 
+		template<class Chars>
+		Token getToken (const Chars &chars);
+
 		inline InStream &currentStream ()
 		{
-			return *inStreams.front();	// TODO: What if inStreams is empty?
+			return *inStreams.front();	// Callers check there is one where input may have ended
 		}
 
-		InStream *findStream (std::function<bool(const std::shared_ptr<InStream> &ptr)> pred);
-		InStream *findStreamWithNamePrefix (const std::string &prefix);
+		const MacroTable *findMacro (const std::string &name, MacroTable::Id &id) const;
+
 		InStream *findStreamWithArgs ();
 		InStream *findStreamWithPath ();
 
+		void pushStream (const std::shared_ptr<InStream> &stream);
+
 		const std::path getCurrentPath ();
 
 		bool get (char &c, bool expand = true);
 
+		template<class Chars>
+		bool get (const Chars &chars, char &c, bool expand);
+
+		bool read (char &c);
+
+		template<class Chars>
+		bool read (const Chars &chars, char &c);
+
 		int peek ();
 
+		void popEndedStreams ();
+
 		bool good ();
 
 		bool eof ();
 
 		bool putback (const char &c);
 
-		bool putback (const std::string &s, const std::string &streamName, const ArgList &args = {});
+		bool putback (const std::string &s, const std::string &streamName, const SharedArgList &args = nullptr,
+					  const std::shared_ptr<BlockIndex> &index = nullptr);
+
+		bool putbackVerbatim (const std::string &s, const Position &streamName);
+
+		void skipBranch ();
+
+		bool processArithmetic ();
+
+		bool lookupOperand (const std::string &name, int64_t &value);
+
+		bool collectBody (std::string &body);
 
 		bool do_if (const ArgList &args, const Mods &mods);
 		bool do_else (const ArgList &args, const Mods &mods);
@@ -106,10 +341,35 @@ namespace stemple
 		bool do_or (const ArgList &args, const Mods &mods);
 		bool do_not (const ArgList &args, const Mods &mods);
 		bool do_defined (const ArgList &args, const Mods &mods);
-
-		std::list<std::shared_ptr<InStream>> inStreams;
-		std::map<std::string, Macro> macros;
+		bool do_foreach (const ArgList &args, const Mods &mods);
+		bool do_output (const ArgList &args, const Mods &mods);
+
+		StreamPool streamPool;		// Outlives the streams made from it
+		ArgFrames frames;			// Outlives the streams that return frames to it
+		std::deque<std::shared_ptr<InStream>> inStreams;
+		DirectiveStack directives;
+		MacroTable macros;
+		std::shared_ptr<const Expander> base;	// Holds any macros not defined here
+		std::shared_ptr<const Expander> baseline;	// Macros and settings for Reset() to restore
 		std::map<std::string, std::function<bool(const ArgList &, const Mods &)>> builtins;
+		std::map<std::string, NativeBuiltin> natives;	// Registered by the user, also in builtins
+		std::unordered_map<std::string, std::shared_ptr<Expression>> expressions;	// Compiled $((<expr>)), by text
+		std::shared_ptr<TemplateCache> templateCache;	// For included files, if any
+		std::string directory;		// Includes from input without a path are relative to this, if set
+		std::string outputRoot;		// Files named by $(output) are relative to this, if set
+		size_t maxOpenFiles;		// Limit on the files $(output) keeps open at once
+
+		// Where $(output) sends what follows it in the chunk being expanded
+		struct OutputSwitch
+		{
+			size_t Offset;
+			std::string Pathname;	// Empty for the output given to Expand()
+		};
+		std::vector<OutputSwitch> outputSwitches;
+		const std::string *expanding;			// Chunk for Expand()'s output, if any
+		std::ostream *mainOutput;				// The output given to Expand(), during it
+		std::ostream *redirect;					// Where its output is going instead, if anywhere
+		std::unique_ptr<OutputFiles> outputFiles;
 
 		char introChar;				// The start of a directive. Default: '$'
 		char openChar;				// The start of a directive body. Default: '('
@@ -117,14 +377,19 @@ namespace stemple
 		char argSepChar;			// Separator between arguments. Default: ','
 		char escapeChar;			// Escapes other special chars. Default '$'
 		char modsChar;				// The start of modifiers to expansion. Default ':'
-		std::string nameEndChars;	// Set of terminating chars
-		std::string argEndChars;	// Set of terminating chars
-		std::string textEndChars;	// Set of terminating chars
-		std::string modEndChars;	// Set of terminating chars
+		Syntax syntax;				// All of the above, for scanning raw text
+		bool defaultChars;			// The special characters are the defaults
 		bool trimArgs;				// Trim whitespace from argument strings by default
 		int skipping;				// Skipping output and most expansion because we are in a false branch of a block if/elseif/else
-		int invoking;				// In the middle of gathering a macro invocation
+		size_t maxDepth;			// Limit on nesting of directives and streams, or 0
+		unsigned parallelism;		// Threads to expand large inputs on
+		size_t minSegment;			// Smallest piece of input worth a thread
+		Footprint *footprint;		// Where to note macros used, if anywhere
+		bool abandoned;				// Exceeded maxDepth, so discard the input
+		bool exceededMaxDepth;		// Since the last expansion began
+		bool arithmeticFailed;		// Likewise, an expression couldn't be evaluated
 		bool wasEscaped;			// Last character returned by get() was escaped
+		bool wasVerbatim;			// Last character returned by get() was from a VerbatimStream
 
 		// A stack of descriptors for processing nested block ifs/elseifs/elses
 		struct IfContext
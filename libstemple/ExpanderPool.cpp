@@ -0,0 +1,56 @@
+// ExpanderPool
+// Expanders kept ready for reuse.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	void ExpanderPool::Releaser::operator() (Expander *expander) const
+	{
+		Pool->release(expander);
+	}
+
+	//--------------------------------------------------------------------------
+	ExpanderPool::ExpanderPool (const shared_ptr<const Expander> &base, size_t maxIdle) :
+		base(base),
+		maxIdle(maxIdle)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	// A new expander takes its baseline straight away, so that whatever a
+	// user does to its macros and settings is undone when it comes back.
+
+	ExpanderPool::Handle ExpanderPool::Acquire ()
+	{
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if (!idle.empty()) {
+				Expander *expander = idle.back().release();
+				idle.pop_back();
+				return Handle(expander, Releaser { this });
+			}
+		}
+		unique_ptr<Expander> expander(new Expander(base));
+		expander->SetBaseline();
+		return Handle(expander.release(), Releaser { this });
+	}
+
+	//--------------------------------------------------------------------------
+	// Resetting is done before taking the lock, since it may take a while.
+
+	void ExpanderPool::release (Expander *expander)
+	{
+		unique_ptr<Expander> owned(expander);
+		owned->Reset(true);
+		lock_guard<std::mutex> lock(mutex);
+		if (idle.size() < maxIdle) {
+			idle.push_back(move(owned));
+		}
+	}
+}
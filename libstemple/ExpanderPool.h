@@ -0,0 +1,56 @@
+// ExpanderPool
+// Expanders kept ready for reuse by a process that handles many requests,
+// such as a server. Each is layered over the same base expander, sharing its
+// macros and settings, and is reset when it's handed back, so it comes out
+// of the pool fresh but with its buffers and compiled expressions still warm.
+// A pool may be shared by any number of threads.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__ExpanderPool__
+#define __stemple__ExpanderPool__
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Expander.h"
+
+namespace stemple
+{
+	class ExpanderPool
+	{
+	public:
+		// Hands an expander back to its pool when it goes.
+		struct Releaser
+		{
+			ExpanderPool *Pool;
+			void operator() (Expander *expander) const;
+		};
+		typedef std::unique_ptr<Expander, Releaser> Handle;
+
+		// Up to maxIdle expanders are kept for reuse.
+		ExpanderPool (const std::shared_ptr<const Expander> &base, size_t maxIdle = 64);
+
+		// Returns an idle expander, or a new one if there are none. The pool
+		// must outlive the handle.
+		Handle Acquire ();
+
+		const std::shared_ptr<const Expander> &GetBase () const
+		{
+			return base;
+		}
+
+	protected:
+		void release (Expander *expander);
+
+	private:
+		std::shared_ptr<const Expander> base;
+		size_t maxIdle;
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Expander>> idle;
+	};
+}
+
+#endif	// __stemple__ExpanderPool__
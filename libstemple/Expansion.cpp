@@ -0,0 +1,94 @@
+// Expansion
+// Pull-based expansion of a single input.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	Expansion::Expansion (Expander &expander, const string &input, size_t chunkSize) :
+		Expansion(expander, make_shared<StringStream>(input, "Input string"), chunkSize)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	// Reads the input in place. It must stay valid until the expansion ends.
+
+	Expansion::Expansion (Expander &expander, const char *input, size_t length, size_t chunkSize) :
+		Expansion(expander, make_shared<ViewStream>(input, length, "Input string"), chunkSize)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	Expansion::Expansion (Expander &expander, istream &input, const string &inputName, size_t chunkSize) :
+		Expansion(expander, make_shared<CopiedStream>(input, inputName), chunkSize)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	// The expander's state is saved before the input is pushed, and put back
+	// by the destructor.
+
+	Expansion::Expansion (Expander &expander, const shared_ptr<InStream> &input, size_t chunkSize) :
+		expander(expander),
+		chunkSize(chunkSize ? chunkSize : DefaultChunkSize),
+		baseDepth(expander.inStreams.size()),
+		baseDirectives(expander.directives.size()),
+		baseIfDepth(expander.ifContext.size()),
+		baseSkipping(expander.skipping),
+		baseAbandoned(expander.abandoned),
+		baseExceededMaxDepth(expander.exceededMaxDepth),
+		baseArithmeticFailed(expander.arithmeticFailed),
+		done(false),
+		failed(false)
+	{
+		expander.exceededMaxDepth = false;
+		expander.arithmeticFailed = false;
+		chunk.reserve(this->chunkSize);
+		expander.pushStream(input);
+	}
+
+	//--------------------------------------------------------------------------
+	// If the caller stops pulling before the end, discard whatever is left of
+	// our input, and any blocks or directives left open in it, so the expander
+	// can be used again. An enclosing expansion is left knowing if this one
+	// went too deep, or failed to evaluate an expression.
+
+	Expansion::~Expansion ()
+	{
+		while (expander.inStreams.size() > baseDepth) {
+			expander.inStreams.pop_front();
+		}
+		while (expander.directives.size() > baseDirectives) {
+			expander.directives.pop_back();
+		}
+		while (expander.ifContext.size() > baseIfDepth) {
+			expander.ifContext.pop();
+		}
+		expander.skipping = baseSkipping;
+		expander.abandoned = baseAbandoned;
+		expander.exceededMaxDepth = baseExceededMaxDepth || expander.exceededMaxDepth;
+		expander.arithmeticFailed = baseArithmeticFailed || expander.arithmeticFailed;
+	}
+
+	//--------------------------------------------------------------------------
+	// Produces the next chunk of output, of chunkSize characters (the last
+	// one may be shorter). Returns false, with an empty chunk, once there
+	// is no more output.
+
+	bool Expansion::Next ()
+	{
+		if (!done && !expander.expand(chunk, chunkSize, held)) {
+			done = true;
+		}
+		failed = failed || expander.exceededMaxDepth || expander.arithmeticFailed;
+		if (done) {
+			chunk.clear();
+		}
+		return !done;
+	}
+}
@@ -0,0 +1,170 @@
+// Expansion
+// Pull-based expansion of a single input. Rather than writing the whole result
+// to a stream, output is produced one bounded chunk at a time as the caller
+// asks for it, so arbitrarily large expansions can be consumed in constant
+// memory, eg, by a writer that applies backpressure. Every chunk is exactly
+// the chunk size, except the last, which may be shorter.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Expansion__
+#define __stemple__Expansion__
+
+#include <cstddef>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+namespace stemple
+{
+	class Expander;
+	class InStream;
+
+	//==========================================================================
+	// Output held back between one chunk and the next.
+	//==========================================================================
+	struct HeldOutput
+	{
+		std::string LeadingWhitespace;	// On the current line; dropped if it turns out to hold only directives
+		std::string Overflow;			// Didn't fit in the last chunk
+		size_t OverflowStart = 0;		// Where the part that's still to go starts
+	};
+
+	class Expansion
+	{
+	public:
+		//======================================================================
+		// Single-pass iterator over the chunks of an expansion, so that it can
+		// be used in a range-based for loop.
+		//======================================================================
+		class iterator
+		{
+		public:
+			typedef std::input_iterator_tag	iterator_category;
+			typedef std::string				value_type;
+			typedef std::ptrdiff_t			difference_type;
+			typedef const std::string		*pointer;
+			typedef const std::string		&reference;
+
+			//------------------------------------------------------------------
+			iterator (Expansion *expansion = nullptr) :
+				expansion(expansion)
+			{
+			}
+
+			//------------------------------------------------------------------
+			reference operator* () const
+			{
+				return expansion->GetChunk();
+			}
+
+			//------------------------------------------------------------------
+			pointer operator-> () const
+			{
+				return &expansion->GetChunk();
+			}
+
+			//------------------------------------------------------------------
+			iterator &operator++ ()
+			{
+				if (!expansion->Next()) {
+					expansion = nullptr;
+				}
+				return *this;
+			}
+
+			//------------------------------------------------------------------
+			bool operator== (const iterator &other) const
+			{
+				return expansion == other.expansion;
+			}
+
+			//------------------------------------------------------------------
+			bool operator!= (const iterator &other) const
+			{
+				return expansion != other.expansion;
+			}
+
+		private:
+			Expansion *expansion;
+		};
+
+		// A chunkSize of 0 selects DefaultChunkSize.
+		Expansion (Expander &expander, const std::string &input,
+				   size_t chunkSize = DefaultChunkSize);
+
+		// NOTE: No default chunk size here, so that a three-argument call with
+		// a C string always means (input, chunkSize).
+		Expansion (Expander &expander, const char *input, size_t length,
+				   size_t chunkSize);
+
+		Expansion (Expander &expander, std::istream &input, const std::string &inputName,
+				   size_t chunkSize = DefaultChunkSize);
+
+		Expansion (const Expansion &) = delete;
+
+		Expansion &operator= (const Expansion &) = delete;
+
+		virtual ~Expansion ();
+
+		bool Next ();
+
+		//----------------------------------------------------------------------
+		const std::string &GetChunk () const
+		{
+			return chunk;
+		}
+
+		//----------------------------------------------------------------------
+		bool IsDone () const
+		{
+			return done;
+		}
+
+		//----------------------------------------------------------------------
+		// True if the expansion went deeper than the expander's maximum depth,
+		// so the output was cut short, or had an expression that couldn't be
+		// evaluated. Check it after the last chunk, since Next() returns false
+		// at the end either way.
+		bool Failed () const
+		{
+			return failed;
+		}
+
+		//----------------------------------------------------------------------
+		iterator begin ()
+		{
+			return Next() ? iterator(this) : iterator();
+		}
+
+		//----------------------------------------------------------------------
+		iterator end ()
+		{
+			return iterator();
+		}
+
+		static const size_t DefaultChunkSize = 64 * 1024;
+
+	private:
+		Expansion (Expander &expander, const std::shared_ptr<InStream> &input, size_t chunkSize);
+
+	protected:
+		Expander	&expander;
+		size_t		chunkSize;
+		size_t		baseDepth;			// Expander's stream depth before our input was pushed
+		size_t		baseDirectives;		// And the rest of its state, restored if we're abandoned
+		size_t		baseIfDepth;
+		int			baseSkipping;
+		bool		baseAbandoned;
+		bool		baseExceededMaxDepth;
+		bool		baseArithmeticFailed;
+		std::string	chunk;
+		HeldOutput	held;
+		bool		done;
+		bool		failed;
+	};
+}
+
+#endif	// __stemple__Expansion__
@@ -0,0 +1,378 @@
+// Expression
+// Integer arithmetic expression, as used in $((<expr>)).
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+using namespace std;
+
+namespace stemple
+{
+	//==========================================================================
+	// Recursive descent parser, with C precedence and associativity:
+	//   ?:  ||  &&  |  ^  &  == !=  < <= > >=  << >>  + -  * / %  unary - + ! ~
+	// Nesting of parentheses, conditionals and unary operators is limited, so
+	// that no expression can run the native stack out.
+	//==========================================================================
+	class Expression::Parser
+	{
+	public:
+		//----------------------------------------------------------------------
+		Parser (const string &text, const Syntax &syntax, Expression &expression) :
+			text(text),
+			syntax(syntax),
+			expression(expression),
+			pos(0),
+			depth(0),
+			nesting(0)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		bool Parse ()
+		{
+			if (!conditional()) return false;
+			skipSpace();
+			return pos == text.size();
+		}
+
+	private:
+		// Each level of parentheses takes about a dozen native frames
+		static const size_t MaxNesting = 256;
+
+		//----------------------------------------------------------------------
+		// Counts a level of nesting for as long as it's in scope.
+		struct Nest
+		{
+			Nest (size_t &n) : nesting(n) { ++ nesting; }
+			~Nest () { -- nesting; }
+			size_t &nesting;
+		};
+
+		//----------------------------------------------------------------------
+		bool conditional ()
+		{
+			Nest nest(nesting);
+			if (nesting > MaxNesting) return false;
+			if (!binary(0)) return false;
+			if (!accept("?")) return true;
+			size_t toElse = emit(JUMP_IF_ZERO);
+			-- depth;
+			if (!conditional() || !accept(":")) return false;
+			size_t toEnd = emit(JUMP);
+			-- depth;
+			patch(toElse);
+			return conditional() && (patch(toEnd), true);
+		}
+
+		//----------------------------------------------------------------------
+		// Precedence levels, lowest first. Longer operators come before their
+		// prefixes.
+		struct Operator
+		{
+			const char *text;
+			Code code;
+		};
+
+		bool binary (int level)
+		{
+			static const vector<vector<Operator>> levels = {
+				{ { "||", JUMP_IF_NONZERO } },
+				{ { "&&", JUMP_IF_ZERO } },
+				{ { "|", OR } },
+				{ { "^", XOR } },
+				{ { "&", AND } },
+				{ { "==", EQ }, { "!=", NE } },
+				{ { "<=", LE }, { ">=", GE }, { "<", LT }, { ">", GT } },
+				{ { "<<", SHL }, { ">>", SHR } },
+				{ { "+", ADD }, { "-", SUB } },
+				{ { "*", MUL }, { "/", DIV }, { "%", MOD } },
+			};
+			if (level == (int)levels.size()) {
+				return unary();
+			}
+			if (!binary(level + 1)) return false;
+			for (;;) {
+				const Operator *op = nullptr;
+				for (auto &candidate : levels[level]) {
+					if (peekOperator(candidate.text)) {
+						op = &candidate;
+						break;
+					}
+				}
+				if (!op) return true;
+				pos += strlen(op->text);
+				if (op->code == JUMP_IF_ZERO || op->code == JUMP_IF_NONZERO) {
+					// Short circuit: a || b is a ? 1 : !!b, a && b is a ? !!b : 0
+					size_t toShort = emit(op->code);
+					-- depth;
+					if (!binary(level + 1)) return false;
+					emit(BOOL);
+					size_t toEnd = emit(JUMP);
+					patch(toShort);
+					-- depth;
+					push(op->code == JUMP_IF_NONZERO ? 1 : 0);
+					patch(toEnd);
+				} else {
+					if (!binary(level + 1)) return false;
+					emit(op->code);
+					-- depth;
+				}
+			}
+		}
+
+		//----------------------------------------------------------------------
+		// Single-character operators mustn't match the start of a longer one,
+		// eg, < in << or <=, or & in &&.
+		bool peekOperator (const char *op)
+		{
+			skipSpace();
+			size_t n = strlen(op);
+			if (text.compare(pos, n, op) != 0) return false;
+			if (n == 1 && pos + 1 < text.size()) {
+				char c = op[0], next = text[pos + 1];
+				if ((c == '|' || c == '&') && next == c) return false;
+				if ((c == '<' || c == '>') && (next == c || next == '=')) return false;
+			}
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		bool unary ()
+		{
+			Nest nest(nesting);
+			if (nesting > MaxNesting) return false;
+			skipSpace();
+			if (pos < text.size()) {
+				Code code;
+				switch (text[pos]) {
+				case '-': code = NEG; break;
+				case '!': code = NOT; break;
+				case '~': code = COMPL; break;
+				case '+': ++ pos; return unary();
+				default: return primary();
+				}
+				++ pos;
+				if (!unary()) return false;
+				emit(code);
+				return true;
+			}
+			return false;
+		}
+
+		//----------------------------------------------------------------------
+		bool primary ()
+		{
+			skipSpace();
+			if (pos >= text.size()) return false;
+			char c = text[pos];
+			if (c == '(') {
+				++ pos;
+				return conditional() && accept(")");
+			} else if (isDigit(c)) {
+				return number();
+			} else if (c == syntax.Intro && pos + 1 < text.size() && text[pos + 1] == syntax.Open) {
+				// $(name)
+				size_t start = pos + 2;
+				size_t end = text.find(syntax.Close, start);
+				if (end == string::npos) return false;
+				string name = text.substr(start, end - start);
+				if (name.empty() || name.find(syntax.Intro) != string::npos ||
+					any_of(name.begin(), name.end(), [this](char n) { return syntax.Classes.IsSpace(n); })) return false;
+				pos = end + 1;
+				load(name);
+				return true;
+			} else if (isNameStart(c)) {
+				size_t start = pos;
+				while (pos < text.size() && (isNameStart(text[pos]) || isDigit(text[pos]) || text[pos] == '.')) {
+					++ pos;
+				}
+				load(text.substr(start, pos - start));
+				return true;
+			}
+			return false;
+		}
+
+		//----------------------------------------------------------------------
+		// A literal that's out of range is an error. Hex literals may use all
+		// 64 bits, as a two's complement pattern; decimal ones may go up to
+		// 2^63, so that the most negative value can be written.
+		bool number ()
+		{
+			uint64_t value = 0;
+			int base = 10;
+			if (text[pos] == '0' && pos + 1 < text.size() && (text[pos + 1] == 'x' || text[pos + 1] == 'X')) {
+				base = 16;
+				pos += 2;
+			}
+			uint64_t limit = base == 16 ? UINT64_MAX : (uint64_t)INT64_MAX + 1;
+			size_t start = pos;
+			for (; pos < text.size() && isHexDigit(text[pos]); ++ pos) {
+				char c = text[pos];
+				int digit = isDigit(c) ? c - '0' : base == 16 ? (c | 0x20) - 'a' + 10 : base;
+				if (digit >= base || value > (limit - digit) / base) return false;
+				value = value * base + digit;
+			}
+			if (pos == start || (pos < text.size() && isNameStart(text[pos]))) {
+				return false;
+			}
+			push((int64_t)value);
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		bool accept (const char *op)
+		{
+			if (!peekOperator(op)) return false;
+			pos += strlen(op);
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		void skipSpace ()
+		{
+			while (pos < text.size() && syntax.Classes.IsSpace(text[pos])) ++ pos;
+		}
+
+		//----------------------------------------------------------------------
+		// ASCII only, whatever the locale, as the expander's own lexer is.
+		static bool isDigit (char c)
+		{
+			return c >= '0' && c <= '9';
+		}
+
+		static bool isHexDigit (char c)
+		{
+			return isDigit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+		}
+
+		static bool isNameStart (char c)
+		{
+			return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_';
+		}
+
+		//----------------------------------------------------------------------
+		void push (int64_t value)
+		{
+			auto constant = find(begin(expression.constants), end(expression.constants), value);
+			uint32_t index = (uint32_t)(constant - begin(expression.constants));
+			if (constant == end(expression.constants)) {
+				expression.constants.push_back(value);
+			}
+			++ depth;
+			emit(PUSH, index);
+		}
+
+		//----------------------------------------------------------------------
+		void load (const string &name)
+		{
+			auto entry = find(begin(expression.names), end(expression.names), name);
+			uint32_t index = (uint32_t)(entry - begin(expression.names));
+			if (entry == end(expression.names)) {
+				expression.names.push_back(name);
+			}
+			++ depth;
+			emit(LOAD, index);
+		}
+
+		//----------------------------------------------------------------------
+		// Binary operators and conditional jumps pop one more than they push,
+		// which the caller accounts for after emitting them.
+		size_t emit (Code code, uint32_t arg = 0)
+		{
+			expression.program.push_back({ code, arg });
+			expression.stackSize = max(expression.stackSize, depth);
+			return expression.program.size() - 1;
+		}
+
+		//----------------------------------------------------------------------
+		void patch (size_t jump)
+		{
+			expression.program[jump].arg = (uint32_t)expression.program.size();
+		}
+
+		const string &text;
+		const Syntax &syntax;
+		Expression &expression;
+		size_t pos;
+		size_t depth;		// Stack depth at the current point in the program
+		size_t nesting;		// Of conditional() and unary() calls
+	};
+
+	//--------------------------------------------------------------------------
+	shared_ptr<Expression> Expression::Compile (const string &text, const Syntax &syntax)
+	{
+		auto expression = make_shared<Expression>();
+		Parser parser(text, syntax, *expression);
+		if (!parser.Parse()) {
+			return nullptr;
+		}
+		return expression;
+	}
+
+	//--------------------------------------------------------------------------
+	// Arithmetic wraps around on overflow, as in two's complement.
+
+	bool Expression::Evaluate (const Lookup &lookup, int64_t &result) const
+	{
+		vector<int64_t> stack(stackSize);
+		size_t top = 0;		// Number of values on the stack
+		for (size_t pc = 0; pc < program.size(); ++ pc) {
+			const Op &op = program[pc];
+			int64_t &a = top >= 2 ? stack[top - 2] : stack[0];
+			int64_t b = top ? stack[top - 1] : 0;
+			switch (op.code) {
+			case PUSH:
+				stack[top ++] = constants[op.arg];
+				continue;
+			case LOAD:
+				if (!lookup(names[op.arg], stack[top])) return false;
+				++ top;
+				continue;
+			case NEG:	stack[top - 1] = (int64_t)(0 - (uint64_t)b); continue;
+			case NOT:	stack[top - 1] = !b; continue;
+			case COMPL:	stack[top - 1] = ~b; continue;
+			case BOOL:	stack[top - 1] = b != 0; continue;
+			case JUMP:
+				pc = op.arg - 1;
+				continue;
+			case JUMP_IF_ZERO:
+				-- top;
+				if (!b) pc = op.arg - 1;
+				continue;
+			case JUMP_IF_NONZERO:
+				-- top;
+				if (b) pc = op.arg - 1;
+				continue;
+			case MUL:	a = (int64_t)((uint64_t)a * (uint64_t)b); break;
+			case ADD:	a = (int64_t)((uint64_t)a + (uint64_t)b); break;
+			case SUB:	a = (int64_t)((uint64_t)a - (uint64_t)b); break;
+			case DIV:
+			case MOD:
+				if (b == 0 || (a == INT64_MIN && b == -1)) return false;
+				a = op.code == DIV ? a / b : a % b;
+				break;
+			case SHL:
+			case SHR:
+				if (b < 0 || b > 63) return false;
+				a = op.code == SHL ? (int64_t)((uint64_t)a << b) : a >> b;
+				break;
+			case LT:	a = a < b; break;
+			case LE:	a = a <= b; break;
+			case GT:	a = a > b; break;
+			case GE:	a = a >= b; break;
+			case EQ:	a = a == b; break;
+			case NE:	a = a != b; break;
+			case AND:	a &= b; break;
+			case XOR:	a ^= b; break;
+			case OR:	a |= b; break;
+			}
+			-- top;	// Binary operators
+		}
+		result = top ? stack[top - 1] : 0;
+		return top == 1;
+	}
+}
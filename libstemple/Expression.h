@@ -0,0 +1,67 @@
+// Expression
+// Integer arithmetic expression, as used in $((<expr>)). The text is compiled
+// once into a compact stack-machine program that can then be evaluated any
+// number of times, with operands looked up afresh each time.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Expression__
+#define __stemple__Expression__
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BlockIndex.h"
+
+namespace stemple
+{
+	class Expression
+	{
+	public:
+		// Gets the value of a named operand: a macro, or an argument to the
+		// enclosing macro if the name is a number. Returns false if the value
+		// isn't an integer, or is out of range.
+		typedef std::function<bool(const std::string &name, int64_t &value)> Lookup;
+
+		// Returns nullptr if text isn't a valid expression. Operands may be
+		// written as bare names or as simple references, eg, i or $(i), $(1).
+		static std::shared_ptr<Expression> Compile (const std::string &text, const Syntax &syntax);
+
+		// Returns false on an error, such as division by zero.
+		bool Evaluate (const Lookup &lookup, int64_t &result) const;
+
+	protected:
+		enum Code : uint8_t
+		{
+			PUSH,			// Push constants[arg]
+			LOAD,			// Push the value of names[arg]
+			NEG, NOT, COMPL,
+			MUL, DIV, MOD, ADD, SUB, SHL, SHR,
+			LT, LE, GT, GE, EQ, NE,
+			AND, XOR, OR,
+			BOOL,			// Replace top with 0 or 1
+			JUMP,			// Continue at arg
+			JUMP_IF_ZERO,	// Pop, and continue at arg if it was zero
+			JUMP_IF_NONZERO,
+		};
+
+		struct Op
+		{
+			Code code;
+			uint32_t arg;
+		};
+
+		class Parser;
+
+		std::vector<Op> program;
+		std::vector<int64_t> constants;
+		std::vector<std::string> names;
+		size_t stackSize = 0;		// Deepest the stack gets
+	};
+}
+
+#endif	// __stemple__Expression__
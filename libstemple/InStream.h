@@ -3,17 +3,28 @@
 // column, etc. An InStream is created for each expansion of a macro body and
 // holds the list of arguments given to the macro directive.
 //
+// Characters are read from a window onto the stream's text, by get() and
+// peek(), which aren't virtual, so that reading is inlined. Text that's in
+// memory is all in one window; other streams refill theirs as they go.
+//
 // Copyright  2016 by Paul Ashdown. All Rights Reserved.
 
 #pragma once
 #ifndef __stemple__InStream__
 #define __stemple__InStream__
 
+#include <algorithm>
 #include <fstream>
-#include <sstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "ArgList.h"
+#include "BlockIndex.h"
+#include "CompiledTemplate.h"
 #include "Filesystem.h"
+#include "MacroTable.h"
 #include "Position.h"
 
 namespace stemple
@@ -28,15 +39,6 @@ namespace stemple
 		// NOTE: 'directive' implies non-printing commands, such as $(if), etc.,
 		// and does not include macro or argument expansions.
 
-		//----------------------------------------------------------------------
-		InStream (const Position &position, const ArgList &args) :
-			position(position),
-			args(args),
-			GraphSeen(false),
-			DirectiveSeen(false)
-		{
-		}
-
 		//----------------------------------------------------------------------
 		virtual ~InStream ()
 		{
@@ -56,21 +58,23 @@ namespace stemple
 		}
 
 		//----------------------------------------------------------------------
-		const std::string &GetSource ()
+		std::string GetSource ()
 		{
-			return position.Source;
+			return position.GetSource();
 		}
 
 		//----------------------------------------------------------------------
 		const int GetArgCount ()
 		{
-			return (int)args.size();
+			return args ? (int)args->size() : 0;
 		}
 
 		//----------------------------------------------------------------------
-		const std::string GetArg (int index)
+		// The argument stays where it is for as long as the stream does.
+		const std::string &GetArg (int index)
 		{
-			return index >= 0 && (size_t)index < args.size() ? args[index] : "";
+			static const std::string none;
+			return index >= 0 && index < GetArgCount() ? (*args)[index] : none;
 		}
 
 		//----------------------------------------------------------------------
@@ -80,83 +84,278 @@ namespace stemple
 		}
 
 		//----------------------------------------------------------------------
-		virtual bool get (char &c) = 0;
+		// Called as the stream is pushed on top of below (or onto an empty
+		// stack) to find, once and for all, the closest streams with
+		// arguments and with a path. Streams are popped in the reverse order,
+		// so both remain valid for as long as this one.
+		void Link (InStream *below)
+		{
+			argFrame = GetArgCount() ? this : below ? below->argFrame : nullptr;
+			pathFrame = GetPath() ? this : below ? below->pathFrame : nullptr;
+		}
+
+		//----------------------------------------------------------------------
+		InStream *GetArgFrame () const
+		{
+			return argFrame;
+		}
+
+		//----------------------------------------------------------------------
+		InStream *GetPathFrame () const
+		{
+			return pathFrame;
+		}
+
+		//----------------------------------------------------------------------
+		bool get (char &c)
+		{
+			if (next == end && !refill()) {
+				c = std::char_traits<char>::eof();
+				failed = true;
+				return false;
+			}
+			c = *next ++;
+			position.Update(c);
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		int peek ()
+		{
+			if (next == end && !refill()) {
+				return std::char_traits<char>::eof();
+			}
+			return std::char_traits<char>::to_int_type(*next);
+		}
+
+		//----------------------------------------------------------------------
+		// Steps back over c if it's the character just read, as long as it's
+		// still in the window and kind (verbatim or not) is the same. Only one
+		// character can be stepped back over between reads.
+		bool Unget (char c, bool verbatim)
+		{
+			if (next == back || next[-1] != c || IsVerbatim() != verbatim) {
+				return false;
+			}
+			back = -- next;
+			failed = false;
+			position.Putback();
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		// A point in the window to come back to with Rewind().
+		struct Mark
+		{
+			const char	*Next;
+			unsigned	Window;
+			Position	Where;
+		};
+
+		Mark GetMark () const
+		{
+			return { next, window, position };
+		}
+
+		//----------------------------------------------------------------------
+		// Steps back to the mark, to read what followed it again, as long as
+		// the window hasn't moved on since, and nothing before it has been
+		// stepped back over.
+		bool Rewind (const Mark &mark)
+		{
+			if (mark.Window != window || mark.Next < back || mark.Next > next) {
+				return false;
+			}
+			back = next = mark.Next;
+			position = mark.Where;
+			failed = false;
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		// False once a read has failed, or if the stream couldn't be opened.
+		bool good () const
+		{
+			return !failed;
+		}
+
+		//----------------------------------------------------------------------
+		bool eof ()
+		{
+			return peek() == std::char_traits<char>::eof();
+		}
 
 		//----------------------------------------------------------------------
-		virtual int peek () = 0;
+		bool IsCharStream () const
+		{
+			return kind == CHAR;
+		}
 
 		//----------------------------------------------------------------------
-		virtual bool good () = 0;
+		bool IsVerbatim () const
+		{
+			return kind == VERBATIM;
+		}
 
 		//----------------------------------------------------------------------
-		virtual bool eof () = 0;
+		// Returns the block structure of the stream's text, if the stream
+		// supports jumping over blocks, or nullptr if not.
+		virtual const BlockIndex *GetBlockIndex (const Syntax &)
+		{
+			return nullptr;
+		}
 
 		//----------------------------------------------------------------------
-		virtual bool putback (const char &ch) = 0;
+		virtual bool Seek (const BlockIndex::Target &)
+		{
+			return false;
+		}
 
 		//----------------------------------------------------------------------
-		virtual bool IsCharStream ()
+		// Called when the stream is exhausted. Returns true if it has started
+		// over, so that it should not be discarded.
+		virtual bool Repeat ()
 		{
 			return false;
 		}
 
+		//----------------------------------------------------------------------
+		// Called as the exhausted stream is discarded, with the stream it was
+		// pushed on top of, which carries on with the current line.
+		virtual void Unlink (InStream &)
+		{
+		}
+
 	protected:
-		Position		position;
-		const ArgList	args;
+		// The few kinds of stream that the expander treats differently
+		enum Kind { TEXT, CHAR, VERBATIM };
+
+		//----------------------------------------------------------------------
+		InStream (const Position &position, const SharedArgList &args, Kind kind = TEXT) :
+			GraphSeen(false),
+			DirectiveSeen(false),
+			position(position),
+			args(args),
+			argFrame(nullptr),
+			pathFrame(nullptr),
+			start(nullptr),
+			next(nullptr),
+			end(nullptr),
+			back(nullptr),
+			window(0),
+			kind(kind),
+			failed(false)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// Sets the window that get() and peek() read from.
+		void setWindow (const char *begin, const char *next, const char *end)
+		{
+			this->start = begin;
+			this->next = next;
+			this->end = end;
+			back = next;
+			++ window;
+		}
+
+		//----------------------------------------------------------------------
+		// Called when the window has been read to its end, to move it on.
+		// Returns false at the end of the stream.
+		virtual bool refill ()
+		{
+			return false;
+		}
+
+		Position			position;
+		const SharedArgList	args;
+		InStream			*argFrame;	// Closest stream with arguments
+		InStream			*pathFrame;	// Closest stream with a path
+		const char			*start;		// Of the window
+		const char			*next;		// Next character to be read
+		const char			*end;		// Of the window
+		const char			*back;		// How far Unget() may go
+		unsigned			window;		// Counts the windows set, for Rewind()
+		const Kind			kind;
+		bool				failed;
 	};
 
 	//==========================================================================
+	// Text that's all in memory, read in a single window.
 	//==========================================================================
-	class StreamStream : public InStream
+	class MemoryStream : public InStream
 	{
 	public:
 		//----------------------------------------------------------------------
-		StreamStream (std::istream	&base, const Position &position, const ArgList &args) :
-			InStream(position, args),
-			base(base)
+		virtual ~MemoryStream ()
 		{
 		}
 
 		//----------------------------------------------------------------------
-		virtual ~StreamStream ()
+		bool Seek (const BlockIndex::Target &target)
 		{
+			if (target.Offset > (size_t)(end - start)) {
+				return false;
+			}
+			back = next = start + target.Offset;
+			failed = false;
+			position.Skip((int)target.Offset, target.Line, target.Column);
+			return true;
 		}
 
+	protected:
 		//----------------------------------------------------------------------
-		bool get (char &c)
+		MemoryStream (const Position &position, const SharedArgList &args, Kind kind = TEXT) :
+			InStream(position, args, kind)
 		{
-			base.get(c);
-			position.Update(c);
-			return base.good();
 		}
 
 		//----------------------------------------------------------------------
-		int peek ()
+		void setText (const char *data, size_t length)
 		{
-			return base.peek();
+			setWindow(data, data, data + length);
 		}
+	};
 
+	//==========================================================================
+	// Reads a std::istream a buffer at a time, taking whatever its streambuf
+	// already has rather than waiting for a whole buffer, so that input from
+	// a terminal or a pipe is expanded as it arrives.
+	//==========================================================================
+	class StreamStream : public InStream
+	{
+	public:
 		//----------------------------------------------------------------------
-		bool good ()
+		StreamStream (std::istream	&base, const Position &position, const SharedArgList &args) :
+			InStream(position, args),
+			base(base)
 		{
-			return base.good();
 		}
 
 		//----------------------------------------------------------------------
-		bool eof ()
+		virtual ~StreamStream ()
 		{
-			return base.eof();
 		}
 
+	protected:
 		//----------------------------------------------------------------------
-		bool putback (const char &ch)
+		bool refill ()
 		{
-			base.putback(ch);
-			return base.good();
+			std::streambuf *buf = base.rdbuf();
+			if (!buf || buf->sgetc() == std::char_traits<char>::eof()) {
+				return false;
+			}
+			std::streamsize n = std::min<std::streamsize>(std::max<std::streamsize>(buf->in_avail(), 1), sizeof buffer);
+			n = buf->sgetn(buffer, n);
+			if (n <= 0) {
+				return false;
+			}
+			setWindow(buffer, buffer, buffer + n);
+			return true;
 		}
 
-	protected:
 		std::istream	&base;
+		char			buffer[4096];
 	};
 
 	//==========================================================================
@@ -165,12 +364,13 @@ namespace stemple
 	{
 	public:
 		//----------------------------------------------------------------------
-		FileStream (const std::string &pathname, const ArgList &args = {},
+		FileStream (const std::string &pathname, const SharedArgList &args = nullptr,
 					std::ios_base::openmode mode = std::ios_base::in) :
-			stream(pathname, mode),
 			StreamStream(stream, pathname, args),
+			stream(pathname, mode),
 			absolutePath(std::canonical(pathname))
 		{
+			failed = !stream.good();
 		}
 
 		//----------------------------------------------------------------------
@@ -191,15 +391,18 @@ namespace stemple
 
 	//==========================================================================
 	//==========================================================================
-	class StringStream : public StreamStream
+	class StringStream : public MemoryStream
 	{
 	public:
 		//----------------------------------------------------------------------
 		StringStream (const std::string &input, const Position &position,
-					  const ArgList &args = {}) :
-			stream(input),
-			StreamStream(stream, position, args)
+					  const SharedArgList &args = nullptr,
+					  const std::shared_ptr<BlockIndex> &index = nullptr) :
+			MemoryStream(position, args),
+			text(input),
+			index(index)
 		{
+			setText(text.data(), text.length());
 		}
 
 		//----------------------------------------------------------------------
@@ -207,8 +410,284 @@ namespace stemple
 		{
 		}
 
+		//----------------------------------------------------------------------
+		// The index is built the first time it's needed. It may be shared,
+		// eg, by all expansions of the same macro body.
+		const BlockIndex *GetBlockIndex (const Syntax &syntax)
+		{
+			if (!index) {
+				index = std::make_shared<BlockIndex>();
+			}
+			if (!index->IsBuiltFor(syntax)) {
+				index->Build(text, syntax);
+			}
+			return index.get();
+		}
+
+	protected:
+		const std::string			text;
+		std::shared_ptr<BlockIndex>	index;
+	};
+
+	//==========================================================================
+	// The body of a $(foreach) loop. It is read once for each item, calling
+	// bind to set the loop variable before each pass, so that a loop takes a
+	// single stream however many times it goes round.
+	//==========================================================================
+	class LoopStream : public StringStream
+	{
+	public:
+		typedef std::function<void(const std::string &)> Binder;
+
+		//----------------------------------------------------------------------
+		// Each item is bound in turn, and once the loop is over, unbind puts
+		// back whatever was there before.
+		LoopStream (const std::string &body, const Position &position,
+					const std::vector<std::string> &items, const Binder &bind,
+					const std::function<void()> &unbind) :
+			StringStream(body, position),
+			items(items),
+			bind(bind),
+			unbind(unbind),
+			item(0)
+		{
+			if (item < items.size()) {
+				bind(items[item ++]);
+			}
+		}
+
+		//----------------------------------------------------------------------
+		virtual ~LoopStream ()
+		{
+		}
+
+		//----------------------------------------------------------------------
+		bool Repeat ()
+		{
+			if (item >= items.size()) {
+				return false;
+			}
+			bind(items[item ++]);
+			Seek({ 0, 1, 1 });
+			DirectiveSeen = true;	// Like the line of the $(foreach) itself
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		// The line of the $(end) goes on from the last line of the body.
+		void Unlink (InStream &below)
+		{
+			below.GraphSeen = GraphSeen;
+			below.DirectiveSeen = true;	// The $(end) itself
+			unbind();
+		}
+
+	protected:
+		std::vector<std::string>	items;
+		Binder						bind;
+		std::function<void()>		unbind;
+		size_t						item;
+	};
+
+	//==========================================================================
+	// Reads directly from a caller's buffer, without copying it, eg, a macro
+	// body in its table. The buffer must outlive the stream.
+	//==========================================================================
+	class ViewStream : public MemoryStream
+	{
+	public:
+		//----------------------------------------------------------------------
+		ViewStream (const char *data, size_t length, const Position &position,
+					const SharedArgList &args = nullptr,
+					const std::shared_ptr<BlockIndex> &index = nullptr) :
+			MemoryStream(position, args),
+			data(data),
+			length(length),
+			index(index)
+		{
+			setText(data, length);
+		}
+
+		//----------------------------------------------------------------------
+		virtual ~ViewStream ()
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// Like StringStream, the index is built the first time it's needed and
+		// may be shared.
+		const BlockIndex *GetBlockIndex (const Syntax &syntax)
+		{
+			if (!index) {
+				index = std::make_shared<BlockIndex>();
+			}
+			if (!index->IsBuiltFor(syntax)) {
+				index->Build(data, length, syntax);
+			}
+			return index.get();
+		}
+
+	protected:
+		const char					*data;
+		size_t						length;
+		std::shared_ptr<BlockIndex>	index;
+	};
+
+	//==========================================================================
+	// Reads a macro body in place in a table. Most bodies are read in a single
+	// window; one that has grown large by appending is read an extent at a
+	// time. The table must outlive the stream. The stream is named after the
+	// macro in its frame of arguments, which goes back to frames when the
+	// stream ends.
+	//==========================================================================
+	class BodyStream : public InStream
+	{
+	public:
+		//----------------------------------------------------------------------
+		BodyStream (MacroTable::Text &&text, ArgFrames &frames, std::shared_ptr<ArgFrames::Frame> &&frame,
+					const std::shared_ptr<BlockIndex> &index = nullptr) :
+			InStream(Position("Expansion of", frame->Name), SharedArgList(frame, &frame->Args)),
+			text(std::move(text)),
+			extent(0),
+			index(index),
+			frames(frames),
+			frame(std::move(frame))
+		{
+			const StringView &first = this->text.First;
+			setWindow(first.Data, first.Data, first.Data + first.Length);
+		}
+
+		//----------------------------------------------------------------------
+		virtual ~BodyStream ()
+		{
+			frames.Return(std::move(frame));
+		}
+
+		//----------------------------------------------------------------------
+		bool Seek (const BlockIndex::Target &target)
+		{
+			const StringView *view = &text.First;
+			size_t start = 0;
+			extent = 0;
+			while (target.Offset >= start + view->Length && extent < text.Rest.size()) {
+				start += view->Length;
+				view = &text.Rest[extent ++];
+			}
+			if (target.Offset > start + view->Length) {
+				return false;
+			}
+			setWindow(view->Data, view->Data + (target.Offset - start), view->Data + view->Length);
+			failed = false;
+			position.Skip((int)target.Offset, target.Line, target.Column);
+			return true;
+		}
+
+		//----------------------------------------------------------------------
+		// Like StringStream, the index is built the first time it's needed and
+		// may be shared.
+		const BlockIndex *GetBlockIndex (const Syntax &syntax)
+		{
+			if (!index) {
+				index = std::make_shared<BlockIndex>();
+			}
+			if (!index->IsBuiltFor(syntax)) {
+				index->Build(text.First, text.Rest, syntax);
+			}
+			return index.get();
+		}
+
 	protected:
-		std::istringstream	stream;
+		//----------------------------------------------------------------------
+		bool refill ()
+		{
+			if (extent >= text.Rest.size()) {
+				return false;
+			}
+			const StringView &view = text.Rest[extent ++];
+			setWindow(view.Data, view.Data, view.Data + view.Length);
+			return true;
+		}
+
+		MacroTable::Text					text;
+		size_t								extent;		// How many of the rest have been read into the window
+		std::shared_ptr<BlockIndex>			index;
+		ArgFrames							&frames;
+		std::shared_ptr<ArgFrames::Frame>	frame;
+	};
+
+	//==========================================================================
+	// Reads a macro body in place in its table, from GetText(). The read ends
+	// when the stream does, so that the body can be written over once
+	// nothing else is reading it.
+	//==========================================================================
+	class MacroStream : public BodyStream
+	{
+	public:
+		//----------------------------------------------------------------------
+		MacroStream (MacroTable &table, MacroTable::Id id, ArgFrames &frames,
+					 std::shared_ptr<ArgFrames::Frame> &&frame) :
+			BodyStream(table.GetText(id), frames, std::move(frame), table.GetBlockIndex(id)),
+			table(table),
+			id(id)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		virtual ~MacroStream ()
+		{
+			table.Release(id, text.First.Data);
+		}
+
+	protected:
+		MacroTable		&table;
+		MacroTable::Id	id;
+	};
+
+	//==========================================================================
+	// Reads a compiled template in place from its mapped file, using the block
+	// index stored with it. If hasPath is set, the stream has the source's path
+	// for resolving relative includes, just like a FileStream.
+	//==========================================================================
+	class MappedStream : public ViewStream
+	{
+	public:
+		//----------------------------------------------------------------------
+		MappedStream (const std::shared_ptr<CompiledTemplate> &compiled,
+					  const Position &position, const SharedArgList &args = nullptr,
+					  bool hasPath = false) :
+			ViewStream(compiled->GetText(), compiled->GetLength(), position, args),
+			compiled(compiled),
+			hasPath(hasPath)
+		{
+			if (hasPath) {
+				absolutePath = std::canonical(compiled->GetSourcePath());
+			}
+		}
+
+		//----------------------------------------------------------------------
+		virtual ~MappedStream ()
+		{
+		}
+
+		//----------------------------------------------------------------------
+		const std::path *GetPath ()
+		{
+			return hasPath ? &absolutePath : nullptr;
+		}
+
+		//----------------------------------------------------------------------
+		// Falls back to indexing the text if it was compiled for other special
+		// characters.
+		const BlockIndex *GetBlockIndex (const Syntax &syntax)
+		{
+			const BlockIndex *stored = compiled->GetBlockIndex().get();
+			return stored->IsBuiltFor(syntax) ? stored : ViewStream::GetBlockIndex(syntax);
+		}
+
+	protected:
+		std::shared_ptr<CompiledTemplate>	compiled;
+		bool								hasPath;
+		std::path							absolutePath;
 	};
 
 	//==========================================================================
@@ -218,10 +697,11 @@ namespace stemple
 	public:
 		//----------------------------------------------------------------------
 		CopiedStream (std::istream &input, const Position &position,
-					  const ArgList &args = {}) :
-			stream(input.rdbuf()),
-			StreamStream(stream, position, args)
+					  const SharedArgList &args = nullptr) :
+			StreamStream(stream, position, args),
+			stream(input.rdbuf())
 		{
+			failed = !input.good();
 		}
 
 		//----------------------------------------------------------------------
@@ -234,16 +714,17 @@ namespace stemple
 	};
 
 	//==========================================================================
+	// A character that was put back.
 	//==========================================================================
-	class CharStream : public InStream
+	class CharStream : public MemoryStream
 	{
 	public:
 		//----------------------------------------------------------------------
 		CharStream (char c, const Position &position) :
-			InStream(position, {}),
-			pbc(c),
-			done(false)
+			MemoryStream(position, {}, CHAR),
+			pbc(c)
 		{
+			setText(&pbc, 1);
 		}
 
 		//----------------------------------------------------------------------
@@ -251,58 +732,139 @@ namespace stemple
 		{
 		}
 
+	protected:
+		char pbc;
+	};
+
+	//==========================================================================
+	// Text that is only to be output, such as the result of a builtin or a
+	// quoted expansion. Its characters are all taken literally, as if each
+	// were escaped, so it's never scanned for directives.
+	//==========================================================================
+	class VerbatimStream : public MemoryStream
+	{
+	public:
 		//----------------------------------------------------------------------
-		bool get (char &c)
+		VerbatimStream (const std::string &text, const Position &position) :
+			MemoryStream(position, {}, VERBATIM),
+			text(text)
 		{
-			if (!done) {
-				c = pbc;
-				done = true;
-				position.Update(pbc);
-				return true;
-			} else {
-				c = std::char_traits<char>::eof();
-				return false;
-			}
+			setText(this->text.data(), this->text.length());
 		}
 
 		//----------------------------------------------------------------------
-		int peek ()
+		virtual ~VerbatimStream ()
 		{
-			return !done ? pbc : std::char_traits<char>::eof();
 		}
 
+	protected:
+		const std::string	text;
+	};
+
+	//==========================================================================
+	// Storage for the streams pushed for each macro call and argument, so
+	// that once an expansion has warmed up, pushing one doesn't go to the
+	// heap. A freed block goes on a list for its size and is taken again by
+	// the next stream of that type. The pool must outlive every stream made
+	// from it.
+	//==========================================================================
+	class StreamPool
+	{
+	public:
 		//----------------------------------------------------------------------
-		bool good ()
+		template <typename T>
+		struct Allocator
+		{
+			typedef T value_type;
+
+			Allocator (StreamPool &pool) : pool(&pool) {}
+
+			template <typename U>
+			Allocator (const Allocator<U> &other) : pool(other.pool) {}
+
+			T *allocate (size_t n) { return static_cast<T *>(pool->take(n * sizeof(T))); }
+
+			void deallocate (T *p, size_t n) { pool->give(p, n * sizeof(T)); }
+
+			template <typename U>
+			bool operator== (const Allocator<U> &other) const { return pool == other.pool; }
+
+			template <typename U>
+			bool operator!= (const Allocator<U> &other) const { return pool != other.pool; }
+
+			StreamPool *pool;
+		};
+
+		//----------------------------------------------------------------------
+		StreamPool ()
 		{
-			return !done;
 		}
 
+		StreamPool (const StreamPool &) = delete;
+
+		StreamPool &operator= (const StreamPool &) = delete;
+
 		//----------------------------------------------------------------------
-		bool eof ()
+		~StreamPool ()
 		{
-			return !done;
+			for (auto &blocks : sizes) {
+				for (void *block : blocks.Free) {
+					::operator delete(block);
+				}
+			}
 		}
 
 		//----------------------------------------------------------------------
-		bool putback (const char &ch)
+		template <typename Stream, typename... Args>
+		std::shared_ptr<Stream> Make (Args &&...args)
 		{
-			if (done) {
-				done = false;
-				return true;
-			} else {
-				return false;
+			return std::allocate_shared<Stream>(Allocator<Stream>(*this), std::forward<Args>(args)...);
+		}
+
+	private:
+		struct Blocks
+		{
+			size_t Size;
+			size_t Made;
+			std::vector<void *> Free;	// With room for all that were made
+		};
+
+		//----------------------------------------------------------------------
+		// There are only as many sizes as there are types of stream made.
+		Blocks &blocksOf (size_t size)
+		{
+			for (auto &blocks : sizes) {
+				if (blocks.Size == size) return blocks;
 			}
+			sizes.push_back({ size, 0, {} });
+			return sizes.back();
 		}
 
 		//----------------------------------------------------------------------
-		virtual bool IsCharStream ()
+		void *take (size_t size)
 		{
-			return true;
+			Blocks &blocks = blocksOf(size);
+			if (blocks.Free.empty()) {
+				// Make room first, so that give() can't throw
+				if (blocks.Free.capacity() == blocks.Made) {
+					blocks.Free.reserve(blocks.Made * 2 + 4);
+				}
+				void *block = ::operator new(size);
+				++ blocks.Made;
+				return block;
+			}
+			void *block = blocks.Free.back();
+			blocks.Free.pop_back();
+			return block;
 		}
 
-	protected:
-		char pbc;
-		bool done;
+		//----------------------------------------------------------------------
+		void give (void *block, size_t size)
+		{
+			blocksOf(size).Free.push_back(block);
+		}
+
+		std::vector<Blocks> sizes;
 	};
 }
 
@@ -0,0 +1,365 @@
+// MacroTable
+// The macros defined by an expander, by name.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace stemple
+{
+	const MacroTable::Id MacroTable::None;
+	const size_t MacroTable::MaxExtentSize;
+
+	//--------------------------------------------------------------------------
+	MacroTable::MacroTable () :
+		current(0),
+		used(0),
+		garbage(0)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	MacroTable::MacroTable (const MacroTable &other) :
+		slots(other.slots),
+		removed(other.removed),
+		current(0),
+		used(0),
+		garbage(0)
+	{
+		pack(other);
+	}
+
+	//--------------------------------------------------------------------------
+	MacroTable &MacroTable::operator= (const MacroTable &other)
+	{
+		return *this = MacroTable(other);
+	}
+
+	//--------------------------------------------------------------------------
+	MacroTable::Id MacroTable::Find (const char *name, size_t length) const
+	{
+		if (slots.empty()) {
+			return None;
+		}
+		return slots[findSlot(name, length, hash(name, length))];
+	}
+
+	//--------------------------------------------------------------------------
+	// The room after the name of a chained body is full, as are all of its
+	// extents but the last.
+
+	MacroTable::Text MacroTable::GetBody (Id id) const
+	{
+		const Record &record = records[id];
+		Text text{ { body(record), record.BodyLength }, {} };
+		if (!chains.empty()) {
+			auto chain = chains.find(id);
+			if (chain != chains.end()) {
+				text.First.Length = record.Capacity;
+				size_t start = record.Capacity;
+				text.Rest.reserve(chain->second.Extents.size());
+				for (const Extent &extent : chain->second.Extents) {
+					size_t length = min<size_t>(extent.Capacity, record.BodyLength - start);
+					text.Rest.push_back({ this->text(extent), length });
+					start += length;
+				}
+			}
+		}
+		return text;
+	}
+
+	//--------------------------------------------------------------------------
+	MacroTable::Text MacroTable::GetText (Id id)
+	{
+		++ records[id].Readers;
+		return GetBody(id);
+	}
+
+	//--------------------------------------------------------------------------
+	// Readers of a body that has since been replaced elsewhere, or moved to
+	// grow, aren't counted by the record any more, so are ignored.
+
+	void MacroTable::Release (Id id, const char *text)
+	{
+		if (id < records.size()) {
+			Record &record = records[id];
+			if (record.Readers && body(record) == text) {
+				-- record.Readers;
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	string MacroTable::GetString (Id id) const
+	{
+		Text text = GetBody(id);
+		string body;
+		body.reserve(records[id].BodyLength);
+		body.append(text.First.Data, text.First.Length);
+		for (const StringView &extent : text.Rest) {
+			body.append(extent.Data, extent.Length);
+		}
+		return body;
+	}
+
+	//--------------------------------------------------------------------------
+	// A new body is written over the old one if it fits and nothing is
+	// reading it any more. Either way, its chain is left behind.
+
+	MacroTable::Id MacroTable::Set (const char *name, size_t nameLength, const char *body, size_t length)
+	{
+		if ((records.size() + 1) * 4 > slots.size() * 3) {
+			grow();
+		}
+		uint32_t h = hash(name, nameLength);
+		size_t slot = findSlot(name, nameLength, h);
+		Id id = slots[slot];
+		if (id == None) {
+			if (records.size() >= None) {
+				throw length_error("Too many macros");
+			}
+			id = slots[slot] = (Id)records.size();
+			records.push_back({ h, 0, 0, 0, 0, 0, 0 });
+			place(records.back(), name, nameLength, body, length, length);
+		} else {
+			Record &record = records[id];
+			if (!record.Readers && length <= record.Capacity) {
+				memmove(this->body(record), body, length);
+				record.BodyLength = (uint32_t)length;
+			} else {
+				place(record, this->name(record), record.NameLength, body, length, length);
+			}
+			unchain(id);
+			indexes.erase(id);
+		}
+		return id;
+	}
+
+	//--------------------------------------------------------------------------
+	// The slot is emptied by moving back any later names in the same run that
+	// could have gone in it, so that probing still finds them.
+
+	void MacroTable::Remove (Id id)
+	{
+		Record &record = records[id];
+		size_t mask = slots.size() - 1;
+		size_t hole = findSlot(name(record), record.NameLength, record.Hash);
+		if (slots[hole] != id) {
+			return;
+		}
+		slots[hole] = None;
+		for (size_t slot = (hole + 1) & mask; slots[slot] != None; slot = (slot + 1) & mask) {
+			size_t home = records[slots[slot]].Hash & mask;
+			if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+				slots[hole] = slots[slot];
+				slots[slot] = None;
+				hole = slot;
+			}
+		}
+		garbage += record.NameLength + record.Capacity;
+		unchain(id);
+		indexes.erase(id);
+		removed.insert(id);
+	}
+
+	//--------------------------------------------------------------------------
+	// What's there already isn't disturbed, even if the body is being read:
+	// readers only go as far as its length when they started. The text fills
+	// whatever room is left in the body's last extent, and the rest goes in a
+	// new one, sized in proportion to the body.
+
+	void MacroTable::Append (Id id, const char *text, size_t length)
+	{
+		if (!length) return;
+		Record &record = records[id];
+		size_t total = record.BodyLength + length;
+		if (total > None) {
+			throw length_error("Macro too large");
+		}
+		auto chain = chains.find(id);
+		if (chain == chains.end() && total > record.Capacity && record.Capacity < LargeSize) {
+			place(record, name(record), record.NameLength, body(record), record.BodyLength,
+				  max<size_t>(total, 2 * (size_t)record.Capacity));
+		}
+
+		char *last = body(record);
+		size_t start = 0, capacity = record.Capacity;
+		if (chain != chains.end()) {
+			last = this->text(chain->second.Extents.back());
+			start = chain->second.Last;
+			capacity = chain->second.Extents.back().Capacity;
+		}
+		size_t n = min(length, start + capacity - record.BodyLength);
+		memcpy(last + (record.BodyLength - start), text, n);
+		if (n < length) {
+			Extent extent;
+			extent.Capacity = (uint32_t)max(length - n, min<size_t>(record.BodyLength, MaxExtentSize));
+			memcpy(allocate(extent.Capacity, extent.Block, extent.Offset), text + n, length - n);
+			Chain &chained = chains[id];
+			chained.Extents.push_back(extent);
+			chained.Last = start + capacity;
+		}
+		record.BodyLength = (uint32_t)total;
+		indexes.erase(id);
+	}
+
+	//--------------------------------------------------------------------------
+	const shared_ptr<BlockIndex> &MacroTable::GetBlockIndex (Id id)
+	{
+		auto &index = indexes[id];
+		if (!index) {
+			index = make_shared<BlockIndex>();
+		}
+		return index;
+	}
+
+	//--------------------------------------------------------------------------
+	void MacroTable::Compact ()
+	{
+		if (garbage > used / 2) {
+			MacroTable packed(*this);
+			packed.indexes = move(indexes);
+			*this = move(packed);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	void MacroTable::Clear ()
+	{
+		*this = MacroTable();
+	}
+
+	//--------------------------------------------------------------------------
+	// Linear probing. Returns the slot holding the name, or the empty slot
+	// where it would go.
+
+	size_t MacroTable::findSlot (const char *name, size_t length, uint32_t hash) const
+	{
+		size_t mask = slots.size() - 1;
+		for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+			Id id = slots[slot];
+			if (id == None) {
+				return slot;
+			}
+			const Record &record = records[id];
+			if (record.Hash == hash && record.NameLength == length && memcmp(this->name(record), name, length) == 0) {
+				return slot;
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	void MacroTable::grow ()
+	{
+		slots.assign(slots.empty() ? 16 : slots.size() * 2, None);
+		size_t mask = slots.size() - 1;
+		for (Id id = 0; id < records.size(); ++ id) {
+			if (!removed.empty() && removed.count(id)) {
+				continue;
+			}
+			size_t slot = records[id].Hash & mask;
+			while (slots[slot] != None) {
+				slot = (slot + 1) & mask;
+			}
+			slots[slot] = id;
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Takes size characters of space from the blocks, returning where it is.
+	// Small pieces share blocks; large ones get their own.
+
+	char *MacroTable::allocate (size_t size, uint32_t &block, uint32_t &offset)
+	{
+		size_t b = current;
+		if (size > LargeSize) {
+			b = blocks.size();
+			blocks.push_back({ unique_ptr<char[]>(new char[size]), size, 0 });
+		} else if (blocks.empty() || blocks[current].Size - blocks[current].Used < size) {
+			b = current = blocks.size();
+			blocks.push_back({ unique_ptr<char[]>(new char[BlockSize]), BlockSize, 0 });
+		}
+		block = (uint32_t)b;
+		offset = (uint32_t)blocks[b].Used;
+		blocks[b].Used += size;
+		used += size;
+		return blocks[b].Text.get() + offset;
+	}
+
+	//--------------------------------------------------------------------------
+	// Gives the record new space, with room for capacity characters of body,
+	// and copies the name and body into it. Whatever space it had is left
+	// behind.
+
+	void MacroTable::place (Record &record, const char *name, size_t nameLength, const char *body, size_t length,
+							 size_t capacity)
+	{
+		size_t size = nameLength + capacity;
+		if (size > None) {
+			throw length_error("Macro too large");
+		}
+		garbage += record.NameLength + record.Capacity;
+		char *text = allocate(size, record.Block, record.Offset);
+		memcpy(text, name, nameLength);
+		memcpy(text + nameLength, body, length);
+
+		record.NameLength = (uint32_t)nameLength;
+		record.BodyLength = (uint32_t)length;
+		record.Capacity = (uint32_t)capacity;
+		record.Readers = 0;		// Of the new space, none yet
+	}
+
+	//--------------------------------------------------------------------------
+	// Leaves the rest of a body behind once it has been replaced.
+
+	void MacroTable::unchain (Id id)
+	{
+		auto chain = chains.find(id);
+		if (chain != chains.end()) {
+			for (const Extent &extent : chain->second.Extents) {
+				garbage += extent.Capacity;
+			}
+			chains.erase(chain);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Takes the records of other, with their text packed into blocks here.
+	// Chained bodies are put back together in one piece. The slots and the
+	// removed ids have been copied already.
+
+	void MacroTable::pack (const MacroTable &other)
+	{
+		records.reserve(other.records.size());
+		for (Id id = 0; id < other.records.size(); ++ id) {
+			const Record &record = other.records[id];
+			records.push_back({ record.Hash, 0, 0, 0, 0, 0, 0 });
+			if (!removed.empty() && removed.count(id)) {
+				continue;	// Keeps its id, but none of its text
+			}
+			Text text = other.GetBody(id);
+			Record &packed = records.back();
+			place(packed, other.name(record), record.NameLength, text.First.Data, text.First.Length,
+				  record.BodyLength);
+			for (const StringView &extent : text.Rest) {
+				memcpy(body(packed) + packed.BodyLength, extent.Data, extent.Length);
+				packed.BodyLength += (uint32_t)extent.Length;
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// FNV-1a
+	uint32_t MacroTable::hash (const char *name, size_t length)
+	{
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < length; ++ i) {
+			h = (h ^ (unsigned char)name[i]) * 16777619u;
+		}
+		return h;
+	}
+}
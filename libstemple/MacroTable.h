@@ -0,0 +1,218 @@
+// MacroTable
+// The macros defined by an expander, by name. Names and bodies are kept in a
+// few large blocks of text, each name followed by its body, and each macro
+// has a small fixed-size record of where its text is, found through an
+// open-addressed hash index. So a table of a million macros takes little
+// more than the text itself, in a handful of allocations.
+//
+// Text is never moved while a table is in use, only added to: a body that is
+// being read in place is left as it was when it's redefined, and the new body
+// goes elsewhere. Readers are counted, so that once the last one is done a
+// body can be written over again. Space left behind is reclaimed by
+// Compact(), when nothing can be reading it.
+//
+// A body that grows large by appending isn't moved either. Once it has run
+// out of room, what's appended goes in a chain of further extents, so the
+// text already stored is never copied again.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__MacroTable__
+#define __stemple__MacroTable__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "BlockIndex.h"
+#include "Builtin.h"
+
+namespace stemple
+{
+	class MacroTable
+	{
+	public:
+		// Identifies a macro for as long as the table does, however often it's
+		// redefined.
+		typedef uint32_t Id;
+		static const Id None = UINT32_MAX;
+
+		// Where a body's text is: all in First, unless it has grown large by
+		// appending, when the rest follows, in order, in Rest.
+		struct Text
+		{
+			StringView First;
+			std::vector<StringView> Rest;
+		};
+
+		MacroTable ();
+
+		// Copies are compacted, and build their own indexes, so that they can
+		// be expanded on different threads.
+		MacroTable (const MacroTable &other);
+
+		MacroTable (MacroTable &&) = default;
+
+		MacroTable &operator= (const MacroTable &other);
+
+		MacroTable &operator= (MacroTable &&) = default;
+
+		// Returns None if there's no such macro.
+		Id Find (const char *name, size_t length) const;
+
+		//----------------------------------------------------------------------
+		Id Find (const std::string &name) const
+		{
+			return Find(name.data(), name.length());
+		}
+
+		// Good only until the macro is next defined or appended to.
+		Text GetBody (Id id) const;
+
+		// The body as it is now, to be read in place. It stays where it is,
+		// as it is up to its current length, until Release() is called with
+		// it, or the table is compacted.
+		Text GetText (Id id);
+
+		// Ends a read begun by GetText(), given the first part of the text it
+		// returned.
+		void Release (Id id, const char *text);
+
+		//----------------------------------------------------------------------
+		size_t GetLength (Id id) const
+		{
+			return records[id].BodyLength;
+		}
+
+		// A copy of the body, in one piece.
+		std::string GetString (Id id) const;
+
+		// Defines the macro, or replaces its body. Returns its id.
+		Id Set (const char *name, size_t nameLength, const char *body, size_t length);
+
+		//----------------------------------------------------------------------
+		Id Set (const std::string &name, const char *body, size_t length)
+		{
+			return Set(name.data(), name.length(), body, length);
+		}
+
+		// Undefines the macro. A body being read in place stays where it is,
+		// and the id isn't used again: defining the name again gives it a new
+		// one.
+		void Remove (Id id);
+
+		// Takes amortized constant time: a small body that has run out of room
+		// moves to twice as much, and a large one has another extent chained
+		// to it.
+		void Append (Id id, const char *text, size_t length);
+
+		// Block structure of the body, shared by all of its expansions.
+		const std::shared_ptr<BlockIndex> &GetBlockIndex (Id id);
+
+		// Reclaims the space left behind by bodies that have been replaced or
+		// moved, if there's enough of it to be worth copying the rest. Must
+		// only be called when no text returned by GetText() is being read.
+		void Compact ();
+
+		void Clear ();
+
+		//----------------------------------------------------------------------
+		size_t Size () const
+		{
+			return records.size();
+		}
+
+	protected:
+		// Where a macro's text is. The body follows the name, with room for
+		// Capacity characters, and goes on in its chain, if it has one.
+		struct Record
+		{
+			uint32_t Hash;			// Of the name
+			uint32_t Block;
+			uint32_t Offset;		// Of the name within the block
+			uint32_t NameLength;
+			uint32_t BodyLength;
+			uint32_t Capacity;
+			uint32_t Readers;		// Of the text returned by GetText(), which isn't to be overwritten
+		};
+
+		struct Block
+		{
+			std::unique_ptr<char[]> Text;
+			size_t Size;
+			size_t Used;
+		};
+
+		// More of a body, once it has filled the room after its name. Every
+		// extent is full but the last.
+		struct Extent
+		{
+			uint32_t Block;
+			uint32_t Offset;
+			uint32_t Capacity;
+		};
+
+		struct Chain
+		{
+			std::vector<Extent> Extents;
+			size_t Last;				// Where the last extent starts in the body
+		};
+
+		static const size_t BlockSize = 64 * 1024;
+		static const size_t LargeSize = BlockSize / 4;		// Given a block of its own
+		static const size_t MaxExtentSize = 1024 * 1024;
+
+		//----------------------------------------------------------------------
+		char *name (const Record &record) const
+		{
+			return blocks[record.Block].Text.get() + record.Offset;
+		}
+
+		//----------------------------------------------------------------------
+		char *body (const Record &record) const
+		{
+			return name(record) + record.NameLength;
+		}
+
+		//----------------------------------------------------------------------
+		char *text (const Extent &extent) const
+		{
+			return blocks[extent.Block].Text.get() + extent.Offset;
+		}
+
+		size_t findSlot (const char *name, size_t length, uint32_t hash) const;
+
+		void grow ();
+
+		char *allocate (size_t size, uint32_t &block, uint32_t &offset);
+
+		void place (Record &record, const char *name, size_t nameLength, const char *body, size_t length,
+					size_t capacity);
+
+		void unchain (Id id);
+
+		void pack (const MacroTable &other);
+
+		static uint32_t hash (const char *name, size_t length);
+
+		std::vector<Record> records;	// By id
+		std::vector<Id> slots;			// Ids by hash, None where empty
+		std::vector<Block> blocks;
+		std::unordered_map<Id, Chain> chains;	// Of the few bodies that have them
+		std::unordered_set<Id> removed;	// Of the few macros that have been undefined
+		size_t current;					// The block that small records are taken from
+		size_t used;					// Characters taken from blocks,
+		size_t garbage;					// and those since left behind
+		std::unordered_map<Id, std::shared_ptr<BlockIndex>> indexes;
+	};
+
+	// Name and body pairs, for defining many macros at once
+	typedef std::vector<std::pair<std::string, std::string>> MacroDefinitions;
+}
+
+#endif	// __stemple__MacroTable__
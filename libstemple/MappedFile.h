@@ -0,0 +1,100 @@
+// MappedFile
+// Read-only memory mapping of a whole file.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__MappedFile__
+#define __stemple__MappedFile__
+
+#include <string>
+
+#if defined _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace stemple
+{
+	class MappedFile
+	{
+	public:
+		//----------------------------------------------------------------------
+		MappedFile (const std::string &pathname) :
+			data(nullptr),
+			size(0)
+		{
+#if defined _WIN32
+			HANDLE file = CreateFileA(pathname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+									  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE) return;
+			LARGE_INTEGER fileSize;
+			if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+				HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping) {
+					data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+					if (data) size = (size_t)fileSize.QuadPart;
+					CloseHandle(mapping);
+				}
+			}
+			CloseHandle(file);
+#else
+			int fd = open(pathname.c_str(), O_RDONLY);
+			if (fd < 0) return;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p != MAP_FAILED) {
+					data = static_cast<const char *>(p);
+					size = (size_t)st.st_size;
+				}
+			}
+			close(fd);
+#endif
+		}
+
+		//----------------------------------------------------------------------
+		~MappedFile ()
+		{
+			if (data) {
+#if defined _WIN32
+				UnmapViewOfFile(data);
+#else
+				munmap(const_cast<char *>(data), size);
+#endif
+			}
+		}
+
+		MappedFile (const MappedFile &) = delete;
+
+		MappedFile &operator= (const MappedFile &) = delete;
+
+		//----------------------------------------------------------------------
+		bool IsOpen () const
+		{
+			return data != nullptr;
+		}
+
+		//----------------------------------------------------------------------
+		const char *GetData () const
+		{
+			return data;
+		}
+
+		//----------------------------------------------------------------------
+		size_t GetSize () const
+		{
+			return size;
+		}
+
+	private:
+		const char	*data;
+		size_t		size;
+	};
+}
+
+#endif	// __stemple__MappedFile__
@@ -0,0 +1,128 @@
+// OutputFiles
+// The files written by one pass over a template using $(output).
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	// Nothing is opened until there's something to write.
+
+	outputfilebuf::outputfilebuf (OutputFiles &files, const string &pathname, size_t size):
+		std::streambuf(),
+		files(files),
+		pathname(pathname),
+		buffer(size ? size : 1),
+		created(false)
+	{
+		setp(buffer.data(), buffer.data() + buffer.size());
+	}
+
+	//--------------------------------------------------------------------------
+	int outputfilebuf::overflow (int c)
+	{
+		if (sync() != 0) {
+			return EOF;
+		}
+		if (c != EOF) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	//--------------------------------------------------------------------------
+	int outputfilebuf::sync ()
+	{
+		size_t n = pptr() - pbase();
+		bool ok = true;
+		if (n) {
+			ok = files.open(*this) && file.write(pbase(), n).good();
+		}
+		setp(buffer.data(), buffer.data() + buffer.size());
+		return ok ? 0 : -1;
+	}
+
+	//==========================================================================
+	//==========================================================================
+	OutputFiles::OutputFiles (size_t maxOpen, size_t bufferSize):
+		maxOpen(maxOpen ? maxOpen : 1),
+		bufferSize(bufferSize),
+		failed(false)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	OutputFiles::~OutputFiles ()
+	{
+		Close();
+	}
+
+	//--------------------------------------------------------------------------
+	ostream &OutputFiles::Get (const string &pathname)
+	{
+		File &file = files[pathname];
+		if (!file.Buf) {
+			file.Buf.reset(new outputfilebuf(*this, pathname, bufferSize));
+			file.Stream.reset(new ostream(file.Buf.get()));
+		}
+		return *file.Stream;
+	}
+
+	//--------------------------------------------------------------------------
+	// Files that were never written to are still created, empty.
+
+	bool OutputFiles::Close ()
+	{
+		for (auto &file : files) {
+			outputfilebuf &buf = *file.second.Buf;
+			if (!file.second.Stream->flush().good() || (!buf.created && !open(buf))) {
+				failed = true;
+			}
+		}
+		for (auto buf : recent) {
+			buf->file.close();
+			if (buf->file.fail()) {
+				failed = true;
+			}
+		}
+		recent.clear();
+		files.clear();
+		bool ok = !failed;
+		failed = false;
+		return ok;
+	}
+
+	//--------------------------------------------------------------------------
+	// Makes sure the file is open, closing the least recently written one if
+	// too many are.
+
+	bool OutputFiles::open (outputfilebuf &buf)
+	{
+		if (buf.file.is_open()) {
+			recent.splice(begin(recent), recent, buf.recent);
+			return true;
+		}
+		while (recent.size() >= maxOpen) {
+			outputfilebuf *oldest = recent.back();
+			oldest->file.close();
+			if (oldest->file.fail()) {
+				failed = true;
+			}
+			recent.pop_back();
+		}
+		buf.file.clear();
+		buf.file.open(buf.pathname, ios::binary | (buf.created ? ios::app : ios::trunc));
+		if (!buf.file.is_open()) {
+			return false;
+		}
+		buf.created = true;
+		recent.push_front(&buf);
+		buf.recent = begin(recent);
+		return true;
+	}
+}
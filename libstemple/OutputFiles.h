@@ -0,0 +1,86 @@
+// OutputFiles
+// The files written by one pass over a template using $(output), each with
+// its own buffer. Only a limited number of them are kept open at once: when
+// another has to be opened, the one written least recently is closed, and
+// reopened for appending if it's written again. A file is emptied the first
+// time it's written, so a file that's named more than once in a pass picks
+// up where it left off.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__OutputFiles__
+#define __stemple__OutputFiles__
+
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace stemple
+{
+	class OutputFiles;
+
+	//==========================================================================
+	//==========================================================================
+	class outputfilebuf: public std::streambuf
+	{
+		friend class OutputFiles;
+
+	public:
+		outputfilebuf (OutputFiles &files, const std::string &pathname, size_t size);
+
+	protected:
+		virtual int overflow (int c = EOF);
+
+		virtual int sync ();
+
+	private:
+		OutputFiles &files;
+		std::string pathname;
+		std::vector<char> buffer;
+		std::ofstream file;
+		bool created;							// Emptied already
+		std::list<outputfilebuf *>::iterator recent;	// Its place in files.recent, if open
+	};
+
+	//==========================================================================
+	//==========================================================================
+	class OutputFiles
+	{
+		friend class outputfilebuf;
+
+	public:
+		OutputFiles (size_t maxOpen = 16, size_t bufferSize = 64 * 1024);
+
+		~OutputFiles ();
+
+		// Returns the stream for the file, creating it the first time.
+		std::ostream &Get (const std::string &pathname);
+
+		// Writes out what's buffered and closes all of the files. Returns
+		// false if any of them couldn't be written.
+		bool Close ();
+
+	protected:
+		bool open (outputfilebuf &buf);
+
+	private:
+		struct File
+		{
+			std::unique_ptr<outputfilebuf> Buf;
+			std::unique_ptr<std::ostream> Stream;
+		};
+
+		size_t maxOpen;
+		size_t bufferSize;
+		std::map<std::string, File> files;	// By pathname
+		std::list<outputfilebuf *> recent;	// Open files, most recently written first
+		bool failed;
+	};
+}
+
+#endif	// __stemple__OutputFiles__
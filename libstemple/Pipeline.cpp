@@ -0,0 +1,173 @@
+// Pipeline
+// Streams that do their I/O on a thread of their own.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	// Each queue can hold every block, so pushing never has to wait.
+
+	readaheadbuf::readaheadbuf (streambuf *source, size_t blockSize, size_t blockCount):
+		std::streambuf(),
+		source(source),
+		filled(max<size_t>(blockCount, 2)),
+		empty(max<size_t>(blockCount, 2)),
+		current(nullptr),
+		stopping(false),
+		stopped(false)
+	{
+		for (size_t i = 0; i < max<size_t>(blockCount, 2); ++ i) {
+			blocks.emplace_back(new PipelineBlock { vector<char>(blockSize ? blockSize : 1), 0 });
+			empty.TryPush(blocks.back().get());
+		}
+		reader = thread(&readaheadbuf::read, this);
+	}
+
+	//--------------------------------------------------------------------------
+	// The reader may be waiting for an empty block, so keep giving it back
+	// whatever it has filled until it notices it's to stop.
+
+	readaheadbuf::~readaheadbuf ()
+	{
+		stopping = true;
+		if (current) {
+			empty.TryPush(current);
+		}
+		while (!stopped) {
+			PipelineBlock *block;
+			if (filled.TryPop(block)) {
+				empty.TryPush(block);
+			} else {
+				this_thread::yield();
+			}
+		}
+		reader.join();
+	}
+
+	//--------------------------------------------------------------------------
+	// An empty block marks the end of the source.
+
+	int readaheadbuf::underflow ()
+	{
+		if (gptr() < egptr()) {
+			return traits_type::to_int_type(*gptr());
+		}
+		if (current) {
+			if (!current->Size) {
+				return EOF;
+			}
+			empty.TryPush(current);
+		}
+		WaitFor([&] { return filled.TryPop(current); });
+		setg(current->Data.data(), current->Data.data(), current->Data.data() + current->Size);
+		return current->Size ? traits_type::to_int_type(*gptr()) : EOF;
+	}
+
+	//--------------------------------------------------------------------------
+	// Reader thread.
+
+	void readaheadbuf::read ()
+	{
+		for (;;) {
+			PipelineBlock *block;
+			WaitFor([&] { return empty.TryPop(block); });
+			if (stopping) break;
+			streamsize n = source->sgetn(block->Data.data(), (streamsize)block->Data.size());
+			block->Size = n > 0 ? (size_t)n : 0;
+			filled.TryPush(block);
+			if (!block->Size) break;
+		}
+		stopped = true;
+	}
+
+	//==========================================================================
+	//==========================================================================
+	writebehindbuf::writebehindbuf (streambuf *sink, size_t blockSize, size_t blockCount):
+		std::streambuf(),
+		sink(sink),
+		filled(max<size_t>(blockCount, 2)),
+		empty(max<size_t>(blockCount, 2)),
+		pending(0),
+		failed(false),
+		stopping(false)
+	{
+		for (size_t i = 0; i < max<size_t>(blockCount, 2); ++ i) {
+			blocks.emplace_back(new PipelineBlock { vector<char>(blockSize ? blockSize : 1), 0 });
+		}
+		for (size_t i = 1; i < blocks.size(); ++ i) {
+			empty.TryPush(blocks[i].get());
+		}
+		current = blocks[0].get();
+		setp(current->Data.data(), current->Data.data() + current->Data.size());
+		writer = thread(&writebehindbuf::write, this);
+	}
+
+	//--------------------------------------------------------------------------
+	writebehindbuf::~writebehindbuf ()
+	{
+		sync();
+		stopping = true;
+		writer.join();
+	}
+
+	//--------------------------------------------------------------------------
+	int writebehindbuf::overflow (int c)
+	{
+		if (!send()) {
+			return EOF;
+		}
+		if (c != EOF) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	//--------------------------------------------------------------------------
+	int writebehindbuf::sync ()
+	{
+		if (pptr() > pbase() && !send()) {
+			return -1;
+		}
+		WaitFor([&] { return pending == 0; });
+		return !failed && sink->pubsync() == 0 ? 0 : -1;
+	}
+
+	//--------------------------------------------------------------------------
+	// Hands the current block to the writer, and starts on an empty one.
+
+	bool writebehindbuf::send ()
+	{
+		if (failed) {
+			return false;
+		}
+		current->Size = pptr() - pbase();
+		++ pending;
+		filled.TryPush(current);
+		WaitFor([&] { return empty.TryPop(current); });
+		setp(current->Data.data(), current->Data.data() + current->Data.size());
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Writer thread. Once a write has failed, the rest are dropped.
+
+	void writebehindbuf::write ()
+	{
+		for (;;) {
+			PipelineBlock *block = nullptr;
+			WaitFor([&] { return filled.TryPop(block) || stopping; });
+			if (!block) break;
+			if (!failed && sink->sputn(block->Data.data(), (streamsize)block->Size) != (streamsize)block->Size) {
+				failed = true;
+			}
+			empty.TryPush(block);
+			-- pending;
+		}
+	}
+}
@@ -0,0 +1,122 @@
+// Pipeline
+// Streams that do their I/O on a thread of their own, so that reading and
+// writing overlap with expansion. ReadAhead reads its source in large blocks
+// ahead of what's been asked for; WriteBehind hands full blocks to be written
+// while the next one fills. Blocks go back and forth between the two threads
+// on a pair of lock-free queues, one of filled blocks and one of empty ones,
+// so the blocks are allocated once and reused.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Pipeline__
+#define __stemple__Pipeline__
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "SpscQueue.h"
+
+namespace stemple
+{
+	//==========================================================================
+	// A buffer moved between threads, with how much of it is in use.
+	//==========================================================================
+	struct PipelineBlock
+	{
+		std::vector<char>	Data;
+		size_t				Size;
+	};
+
+	//==========================================================================
+	//==========================================================================
+	class readaheadbuf: public std::streambuf
+	{
+	public:
+		readaheadbuf (std::streambuf *source, size_t blockSize = 1024 * 1024, size_t blockCount = 4);
+
+		virtual ~readaheadbuf ();
+
+	protected:
+		virtual int underflow ();
+
+		void read ();
+
+	private:
+		std::streambuf *source;
+		std::vector<std::unique_ptr<PipelineBlock>> blocks;
+		SpscQueue<PipelineBlock *> filled;	// Reader to consumer
+		SpscQueue<PipelineBlock *> empty;	// Consumer to reader
+		PipelineBlock *current;				// Being consumed
+		std::atomic<bool> stopping;
+		std::atomic<bool> stopped;
+		std::thread reader;
+	};
+
+	//==========================================================================
+	//==========================================================================
+	class writebehindbuf: public std::streambuf
+	{
+	public:
+		writebehindbuf (std::streambuf *sink, size_t blockSize = 1024 * 1024, size_t blockCount = 4);
+
+		virtual ~writebehindbuf ();
+
+	protected:
+		virtual int overflow (int c = EOF);
+
+		// Waits for everything so far to be written.
+		virtual int sync ();
+
+		bool send ();
+
+		void write ();
+
+	private:
+		std::streambuf *sink;
+		std::vector<std::unique_ptr<PipelineBlock>> blocks;
+		SpscQueue<PipelineBlock *> filled;	// Producer to writer
+		SpscQueue<PipelineBlock *> empty;	// Writer to producer
+		PipelineBlock *current;				// Being filled
+		std::atomic<size_t> pending;		// Blocks sent but not yet written
+		std::atomic<bool> failed;
+		std::atomic<bool> stopping;
+		std::thread writer;
+	};
+
+	//--------------------------------------------------------------------------
+	// Reads source, which must outlive it, on another thread.
+	class ReadAhead: public std::istream
+	{
+	public:
+		ReadAhead (std::streambuf *source):
+			std::istream(&buf),
+			buf(source)
+		{
+		}
+
+	private:
+		readaheadbuf buf;
+	};
+
+	//--------------------------------------------------------------------------
+	// Writes to sink, which must outlive it, on another thread. Flushing waits
+	// for the writes, and fails if any of them did.
+	class WriteBehind: public std::ostream
+	{
+	public:
+		WriteBehind (std::streambuf *sink):
+			std::ostream(&buf),
+			buf(sink)
+		{
+		}
+
+	private:
+		writebehindbuf buf;
+	};
+}
+
+#endif	// __stemple__Pipeline__
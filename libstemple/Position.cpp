@@ -7,5 +7,5 @@
 
 namespace stemple
 {
-	int Position::TabSize = 8;
+	const int Position::TabSize;
 }
@@ -7,26 +7,78 @@
 #ifndef __stemple__Position__
 #define __stemple__Position__
 
+#include <memory>
 #include <string>
 
 #include "Utility.h"
 
 namespace stemple
 {
+	//==========================================================================
+	// The source is named by what kind of text it is, if anything, eg,
+	// "Expansion of", and a name, eg, of the macro. The two are only put
+	// together when the name is asked for, so that naming the stream of each
+	// macro call takes no formatting or allocation.
+	//==========================================================================
 	struct Position
 	{
-		const std::string Source;
+		const char *Kind;			// Of text, or nullptr if Name says it all
+		const std::string *Name;	// Or nullptr if Kind does
 		int Offset;
 		int Line;
 		int Column;			// Takes into account tabs, UTF-8, etc.
-		static int TabSize;
+		static const int TabSize = 8;
 
 		//----------------------------------------------------------------------
+		// The position has its own copy of the name, shared by its copies.
 		Position (const std::string &source):
-			Source(source),
+			Kind(nullptr),
 			Offset(-1),
 			Line(0),
 			Column(0),
+			owned(std::make_shared<const std::string>(source)),
+			nextLine(1),
+			nextColumn(1)
+		{
+			Name = owned.get();
+		}
+
+		//----------------------------------------------------------------------
+		// Named by static text alone, eg, "Input string".
+		Position (const char *source):
+			Kind(source),
+			Name(nullptr),
+			Offset(-1),
+			Line(0),
+			Column(0),
+			nextLine(1),
+			nextColumn(1)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// The name isn't copied, so it must stay valid as long as the position
+		// and its copies are used, as the name in an argument frame does.
+		Position (const char *kind, const std::string &name):
+			Kind(kind),
+			Name(&name),
+			Offset(-1),
+			Line(0),
+			Column(0),
+			nextLine(1),
+			nextColumn(1)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		// Text of another kind, named after the source of other.
+		Position (const char *kind, const Position &other):
+			Kind(kind),
+			Name(other.Name),
+			Offset(-1),
+			Line(0),
+			Column(0),
+			owned(other.owned),
 			nextLine(1),
 			nextColumn(1)
 		{
@@ -34,15 +86,58 @@ namespace stemple
 
 		//----------------------------------------------------------------------
 		Position (const Position &other):
-			Source(other.Source),
+			Kind(other.Kind),
+			Name(other.Name),
 			Offset(other.Offset),
 			Line(other.Line),
 			Column(other.Column),
+			owned(other.owned),
 			nextLine(other.nextLine),
 			nextColumn(other.nextColumn)
 		{
 		}
 
+		//----------------------------------------------------------------------
+		Position (Position &&other) noexcept:
+			Kind(other.Kind),
+			Name(other.Name),
+			Offset(other.Offset),
+			Line(other.Line),
+			Column(other.Column),
+			owned(std::move(other.owned)),
+			nextLine(other.nextLine),
+			nextColumn(other.nextColumn)
+		{
+		}
+
+		//----------------------------------------------------------------------
+		Position &operator= (const Position &other)
+		{
+			Kind = other.Kind;
+			Name = other.Name;
+			Offset = other.Offset;
+			Line = other.Line;
+			Column = other.Column;
+			owned = other.owned;
+			nextLine = other.nextLine;
+			nextColumn = other.nextColumn;
+			return *this;
+		}
+
+		//----------------------------------------------------------------------
+		Position &operator= (Position &&other) noexcept
+		{
+			Kind = other.Kind;
+			Name = other.Name;
+			Offset = other.Offset;
+			Line = other.Line;
+			Column = other.Column;
+			owned = std::move(other.owned);
+			nextLine = other.nextLine;
+			nextColumn = other.nextColumn;
+			return *this;
+		}
+
 		//----------------------------------------------------------------------
 		void Update (char c)
 		{
@@ -74,20 +169,42 @@ namespace stemple
 		}
 
 		//----------------------------------------------------------------------
-		std::string GetString () const
+		// Repositions to just before the character at offset, which is at the
+		// given line and column.
+		Position &Skip (int offset, int line, int column)
+		{
+			Offset = offset - 1;
+			nextLine = line;
+			nextColumn = column;
+			return *this;
+		}
+
+		//----------------------------------------------------------------------
+		int GetNextLine () const
 		{
-			return stringf("%s, line %d, column %d", Source.c_str(), Line, Column);
+			return nextLine;
 		}
 
 		//----------------------------------------------------------------------
-		const char *GetCString () const
+		int GetNextColumn () const
+		{
+			return nextColumn;
+		}
+
+		//----------------------------------------------------------------------
+		std::string GetSource () const
+		{
+			return !Name ? Kind : Kind ? std::string(Kind) + " " + *Name : *Name;
+		}
+
+		//----------------------------------------------------------------------
+		std::string GetString () const
 		{
-			static std::string s;
-			s = GetString();
-			return s.c_str();
+			return stringf("%s, line %d, column %d", GetSource().c_str(), Line, Column);
 		}
 
 	private:
+		std::shared_ptr<const std::string> owned;	// Name, if it's the position's own
 		int nextLine;
 		int nextColumn;
 	};
@@ -0,0 +1,94 @@
+// SpscQueue
+// Fixed-size, lock-free queue between exactly one producer thread and one
+// consumer thread. Each side owns one index and only reads the other's, so
+// neither ever waits on a lock; a full or empty queue is reported, and it's
+// up to the caller how to wait.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__SpscQueue__
+#define __stemple__SpscQueue__
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace stemple
+{
+	template <typename T>
+	class SpscQueue
+	{
+	public:
+		SpscQueue (size_t capacity) :
+			slots(capacity + 1),
+			head(0),
+			tail(0)
+		{
+		}
+
+		// Producer only. Returns false if the queue is full.
+		bool TryPush (const T &item)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			size_t next = t + 1 == slots.size() ? 0 : t + 1;
+			if (next == head.load(std::memory_order_acquire)) {
+				return false;
+			}
+			slots[t] = item;
+			tail.store(next, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer only. Returns false if the queue is empty.
+		bool TryPop (T &item)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			item = slots[h];
+			head.store(h + 1 == slots.size() ? 0 : h + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		// The indexes are padded onto cache lines of their own, so that each
+		// side's stores don't slow the other's loads. Padding rather than
+		// alignas keeps the queue, and whatever holds it, allocatable with a
+		// plain new before C++17.
+		static const size_t CacheLine = 64;
+
+		std::vector<T> slots;				// One more than the capacity
+		char padSlots[CacheLine];
+		std::atomic<size_t> head;			// Next to pop
+		char padHead[CacheLine - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> tail;			// Next to push
+		char padTail[CacheLine - sizeof(std::atomic<size_t>)];
+	};
+
+	//--------------------------------------------------------------------------
+	// Waits until ready() returns true: spinning at first, for a queue that's
+	// kept busy, then yielding, then sleeping for longer and longer, up to a
+	// millisecond, for one that's waiting on I/O.
+
+	template <typename Ready>
+	void WaitFor (Ready ready)
+	{
+		std::chrono::microseconds sleep(50);
+		for (unsigned spins = 0; !ready(); ++ spins) {
+			if (spins < 64) {
+				continue;
+			} else if (spins < 128) {
+				std::this_thread::yield();
+			} else {
+				std::this_thread::sleep_for(sleep);
+				sleep = std::min(sleep * 2, std::chrono::microseconds(1000));
+			}
+		}
+	}
+}
+
+#endif	// __stemple__SpscQueue__
@@ -0,0 +1,75 @@
+// TemplateCache
+// Templates kept in memory for expanding them many times over.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+namespace stemple
+{
+	//--------------------------------------------------------------------------
+	// The lock isn't held while a template is loaded, so a slow file doesn't
+	// hold up others. If two threads load the same one, the last one wins.
+
+	shared_ptr<CompiledTemplate> TemplateCache::Get (const string &sourcePath)
+	{
+		uint64_t size;
+		int64_t time;
+		if (!CompiledTemplate::GetSourceInfo(sourcePath, size, time)) {
+			return nullptr;
+		}
+		{
+			lock_guard<std::mutex> lock(mutex);
+			auto entry = entries.find(sourcePath);
+			if (entry != end(entries) && entry->second.Size == size && entry->second.Time == time) {
+				uses.splice(begin(uses), uses, entry->second.Use);
+				return entry->second.Template;
+			}
+		}
+		auto loaded = CompiledTemplate::Load(sourcePath);
+		if (!loaded) {
+			loaded = CompiledTemplate::Read(sourcePath, syntax);
+		}
+		if (!loaded || loaded->GetLength() != size) {
+			// Changed while it was being read; don't keep it
+			return loaded;
+		}
+		lock_guard<std::mutex> lock(mutex);
+		remove(sourcePath);
+		if (size > maxSize) {
+			return loaded;
+		}
+		while (total + size > maxSize) {
+			remove(uses.back());
+		}
+		uses.push_front(sourcePath);
+		entries[sourcePath] = { size, time, loaded, begin(uses) };
+		total += size;
+		return loaded;
+	}
+
+	//--------------------------------------------------------------------------
+	void TemplateCache::Clear ()
+	{
+		lock_guard<std::mutex> lock(mutex);
+		entries.clear();
+		uses.clear();
+		total = 0;
+	}
+
+	//--------------------------------------------------------------------------
+	// Expanders still using the template keep it until they're done with it.
+
+	void TemplateCache::remove (const string &sourcePath)
+	{
+		auto entry = entries.find(sourcePath);
+		if (entry != end(entries)) {
+			Uses::iterator use = entry->second.Use;	// May hold sourcePath
+			total -= entry->second.Size;
+			entries.erase(entry);
+			uses.erase(use);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+// TemplateCache
+// Templates kept in memory, indexed and ready to expand, by a process that
+// expands them many times over. A cached template is used for as long as its
+// source file keeps the same size and modification time; after that it's
+// loaded again. As for a single expansion, an up to date compiled file is
+// preferred to the text. A cache may be shared by expanders on several
+// threads. It holds templates up to a total size, dropping the least recently
+// used ones to make room.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__TemplateCache__
+#define __stemple__TemplateCache__
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "BlockIndex.h"
+#include "CompiledTemplate.h"
+
+namespace stemple
+{
+	class TemplateCache
+	{
+	public:
+		static const uint64_t DefaultMaxSize = 256 << 20;
+
+		// Templates that have to be read are indexed for syntax. One larger
+		// than maxSize on its own isn't kept at all.
+		TemplateCache (const Syntax &syntax, uint64_t maxSize = DefaultMaxSize) :
+			syntax(syntax),
+			maxSize(maxSize),
+			total(0)
+		{
+		}
+
+		// Returns nullptr if the file can't be read.
+		std::shared_ptr<CompiledTemplate> Get (const std::string &sourcePath);
+
+		void Clear ();
+
+	protected:
+		typedef std::list<std::string> Uses;
+
+		struct Entry
+		{
+			uint64_t							Size;
+			int64_t								Time;
+			std::shared_ptr<CompiledTemplate>	Template;
+			Uses::iterator						Use;
+		};
+
+		void remove (const std::string &sourcePath);
+
+		Syntax										syntax;
+		uint64_t									maxSize;
+		std::mutex									mutex;
+		std::unordered_map<std::string, Entry>		entries;	// By source path
+		Uses										uses;		// Source paths, most recently used first
+		uint64_t									total;		// Size of all the entries
+	};
+}
+
+#endif	// __stemple__TemplateCache__
@@ -58,7 +58,7 @@ namespace stemple
 
 	//--------------------------------------------------------------------------
 	template<typename... Args>
-	inline void DBG (const std::string &fmt, Args... args)
+	inline void debugf (const std::string &fmt, Args... args)
 	{
 		std::string s = stringf(fmt, args...);
 
@@ -69,10 +69,18 @@ namespace stemple
 #endif
 	}
 
+	// Tracing formats its arguments, which costs far more than the work being
+	// traced on the per-character path, so it's only compiled into debug builds.
+#if defined _DEBUG || defined DEBUG
+#define DBG(...) debugf(__VA_ARGS__)
+#else
+#define DBG(...) ((void)0)
+#endif
+
 	//--------------------------------------------------------------------------
-	inline char *printchar (const char &c)
+	inline std::string printchar (const char &c)
 	{
-		static char buf[5];
+		char buf[5];
 		if (c == '\t') {
 			strcpy(buf, "\\t");
 		} else if (c == '\n') {
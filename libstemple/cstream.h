@@ -1,6 +1,8 @@
 // cstream
 // Derived C++ streambuf & iostream classes to provide a wrapper around C-style
 // FILE* handles, allowing FILE* to be used wherever a C++ iostream is required.
+// Also streambufs that read in blocks through a C callback function, from a
+// file descriptor, or from a FILE*.
 //
 // Based on Dr. Dobbs article "The Standard Librarian: IOStreams and Stdio" by
 // Matthew H. Austern, November 01, 2000
@@ -12,8 +14,18 @@
 #ifndef __stemple__cstream__
 #define __stemple__cstream__
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <iostream>
+#include <vector>
+
+#if defined _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace stemple
 {
@@ -32,6 +44,11 @@ namespace stemple
 			return c != EOF ? fputc(c, fptr) : EOF;
 		}
 
+		virtual std::streamsize xsputn (const char *s, std::streamsize n)
+		{
+			return (std::streamsize)fwrite(s, 1, (size_t)n, fptr);
+		}
+
 		virtual int underflow ()
 		{
 			int c = getc(fptr);
@@ -97,6 +114,98 @@ namespace stemple
 	private:
 		mutable cstreambuf buf;
 	};
+
+	//--------------------------------------------------------------------------
+	// Pulls input in blocks from a read(context, buffer, capacity) callback,
+	// which returns the number of bytes read, or 0 at the end of input.
+
+	class creadbuf: public std::streambuf
+	{
+	public:
+		typedef size_t (*ReadFunc) (void *context, char *buffer, size_t capacity);
+
+		creadbuf (ReadFunc read, void *context, size_t size = 64 * 1024):
+			std::streambuf(),
+			read(read),
+			context(context),
+			buffer(size ? size : 1)
+		{
+			setg(buffer.data(), buffer.data(), buffer.data());
+		}
+
+	protected:
+		virtual int underflow ()
+		{
+			if (gptr() < egptr()) {
+				return traits_type::to_int_type(*gptr());
+			}
+			size_t n = read ? read(context, buffer.data(), buffer.size()) : 0;
+			if (n == 0) {
+				return EOF;
+			}
+			setg(buffer.data(), buffer.data(), buffer.data() + std::min(n, buffer.size()));
+			return traits_type::to_int_type(*gptr());
+		}
+
+	private:
+		ReadFunc read;
+		void *context;
+		std::vector<char> buffer;
+	};
+
+	//--------------------------------------------------------------------------
+	// Pulls input in blocks from a file descriptor, eg, standard input, taking
+	// whatever each read() returns so that input from a terminal or a pipe is
+	// passed on as it arrives. The descriptor isn't closed.
+
+	class fdreadbuf: public creadbuf
+	{
+	public:
+		fdreadbuf (int fd, size_t size = 64 * 1024):
+			creadbuf(&readfd, &this->fd, size),
+			fd(fd)
+		{
+		}
+
+	private:
+		static size_t readfd (void *context, char *buffer, size_t capacity)
+		{
+			int fd = *static_cast<int *>(context);
+			for (;;) {
+#if defined _WIN32
+				int n = _read(fd, buffer, (unsigned)std::min<size_t>(capacity, INT_MAX));
+#else
+				ssize_t n = ::read(fd, buffer, capacity);
+#endif
+				if (n >= 0) {
+					return (size_t)n;
+				} else if (errno != EINTR) {
+					return 0;
+				}
+			}
+		}
+
+		int fd;
+	};
+
+	//--------------------------------------------------------------------------
+	// Pulls input in blocks from a FILE*, rather than a character at a time as
+	// cstreambuf does. The file isn't closed.
+
+	class filereadbuf: public creadbuf
+	{
+	public:
+		filereadbuf (FILE *f, size_t size = 64 * 1024):
+			creadbuf(&readfile, f, size)
+		{
+		}
+
+	private:
+		static size_t readfile (void *context, char *buffer, size_t capacity)
+		{
+			return fread(buffer, 1, capacity, static_cast<FILE *>(context));
+		}
+	};
 }
 
 #endif	// __stemple__cstream__
@@ -15,6 +15,7 @@
 #endif	// _WIN32
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <functional>
 #include <list>
@@ -25,17 +26,32 @@
 #include <stack>
 #include <stdio.h>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <cstring>
 #include <cstdlib>
 
 #include "ArgList.h"
+#include "BlockIndex.h"
+#include "Builtin.h"
+#include "ChangedFile.h"
+#include "CompiledTemplate.h"
 #include "cstream.h"
+#include "DefinesFile.h"
 #include "Expander.h"
+#include "ExpanderPool.h"
+#include "Expansion.h"
+#include "Expression.h"
 #include "Filesystem.h"
 #include "InStream.h"
-#include "Macro.h"
+#include "MacroTable.h"
+#include "OutputFiles.h"
+#include "Pipeline.h"
+#include "MappedFile.h"
 #include "Position.h"
+#include "SpscQueue.h"
+#include "TemplateCache.h"
 #include "stemple.h"
 #include "Utility.h"
@@ -27,23 +27,125 @@ void stemple_DestroyExpander (stemple_Expander *expander)
 }
 
 //------------------------------------------------------------------------------
+// The result is allocated with malloc() and must be released with free().
+
 char *stemple_ExpandString (stemple_Expander *expander, const char *input)
 {
 	if (expander) {
+		char *result = 0;
 		try {
-			return strdup(reinterpret_cast<stemple::Expander *>(expander)->Expand(input ? input : "").c_str());
+			if (!input) input = "";
+			stemple::Expansion expansion(*reinterpret_cast<stemple::Expander *>(expander), input, strlen(input), 0);
+			size_t length = 0;
+			size_t capacity = 0;
+			while (expansion.Next()) {
+				const std::string &chunk = expansion.GetChunk();
+				if (length + chunk.size() + 1 > capacity) {
+					capacity = std::max(capacity * 2, length + chunk.size() + 1);
+					char *grown = (char *)realloc(result, capacity);
+					if (!grown) throw std::bad_alloc();
+					result = grown;
+				}
+				memcpy(result + length, chunk.data(), chunk.size());
+				length += chunk.size();
+			}
+			if (!result) {
+				result = (char *)malloc(1);
+				if (!result) throw std::bad_alloc();
+			}
+			result[length] = '\0';
+			return result;
 		} catch (...) {
+			free(result);
 		}
 	}
 	return 0;
 }
 
+//------------------------------------------------------------------------------
+// Expands length bytes of input (which needn't be NUL-terminated) into the
+// caller's buffer, writing at most capacity bytes, plus a terminating NUL if
+// there is room for it. Returns the full length of the expansion, which may be
+// more than capacity, or (size_t)-1 on error, including an expansion that
+// went too deep to finish.
+
+size_t stemple_ExpandStringN (stemple_Expander *expander, const char *input, size_t length, char *output, size_t capacity)
+{
+	if (expander && (input || !length)) {
+		try {
+			stemple::Expansion expansion(*reinterpret_cast<stemple::Expander *>(expander), input ? input : "", length, 0);
+			size_t total = 0;
+			while (expansion.Next()) {
+				const std::string &chunk = expansion.GetChunk();
+				if (output && total < capacity) {
+					memcpy(output + total, chunk.data(), std::min(chunk.size(), capacity - total));
+				}
+				total += chunk.size();
+			}
+			if (output && total < capacity) {
+				output[total] = '\0';
+			}
+			return expansion.Failed() ? (size_t)-1 : total;
+		} catch (...) {
+		}
+	}
+	return (size_t)-1;
+}
+
+//------------------------------------------------------------------------------
+// Expands length bytes of input, passing the output to write() as it is
+// produced. Returns false if the expansion went too deep to finish, as
+// stemple_ExpandFile() does.
+
+bool stemple_ExpandStringToWriter (stemple_Expander *expander, const char *input, size_t length, stemple_WriteFunc write, void *writeContext)
+{
+	if (expander && write && (input || !length)) {
+		try {
+			stemple::Expansion expansion(*reinterpret_cast<stemple::Expander *>(expander), input ? input : "", length, 0);
+			while (expansion.Next()) {
+				const std::string &chunk = expansion.GetChunk();
+				if (write(writeContext, chunk.data(), chunk.size()) < chunk.size()) {
+					return false;
+				}
+			}
+			return !expansion.Failed();
+		} catch (...) {
+		}
+	}
+	return false;
+}
+
+//------------------------------------------------------------------------------
+// Pulls input from read() and passes the output to write() as it is produced.
+// Returns false if the expansion went too deep to finish.
+
+bool stemple_ExpandReader (stemple_Expander *expander, stemple_ReadFunc read, void *readContext, const char *inputName, stemple_WriteFunc write, void *writeContext)
+{
+	if (expander && read && write) {
+		try {
+			stemple::creadbuf buf(read, readContext);
+			std::istream in(&buf);
+			stemple::Expansion expansion(*reinterpret_cast<stemple::Expander *>(expander), in, inputName ? inputName : "");
+			while (expansion.Next()) {
+				const std::string &chunk = expansion.GetChunk();
+				if (write(writeContext, chunk.data(), chunk.size()) < chunk.size()) {
+					return false;
+				}
+			}
+			return !expansion.Failed();
+		} catch (...) {
+		}
+	}
+	return false;
+}
+
 //------------------------------------------------------------------------------
 bool stemple_ExpandFile (stemple_Expander *expander, FILE *input, const char *inputName, FILE *output)
 {
 	if (expander) {
 		try {
-			stemple::cstream in(input);
+			stemple::filereadbuf buf(input);
+			std::istream in(&buf);
 			stemple::cstream out(output);
 			return reinterpret_cast<stemple::Expander *>(expander)->Expand(in, inputName, out);
 		} catch (...) {
@@ -74,6 +176,21 @@ void stemple_SetMacroSimple (stemple_Expander *expander, const char *name, const
 	}
 }
 
+//------------------------------------------------------------------------------
+void stemple_SetMacros (stemple_Expander *expander, const char *const *names, const char *const *bodies, size_t count)
+{
+	if (expander && names && bodies) {
+		try {
+			stemple::Expander *target = reinterpret_cast<stemple::Expander *>(expander);
+			for (size_t i = 0; i < count; ++ i) {
+				const char *body = bodies[i] ? bodies[i] : "";
+				target->SetMacro(stemple::StringView{ names[i], strlen(names[i]) }, stemple::StringView{ body, strlen(body) });
+			}
+		} catch (...) {
+		}
+	}
+}
+
 //------------------------------------------------------------------------------
 void stemple_SetSpecialChars (stemple_Expander *expander, char escape, char intro, char open, char argSep, char close)
 {
@@ -84,3 +201,152 @@ void stemple_SetSpecialChars (stemple_Expander *expander, char escape, char intr
 		}
 	}
 }
+
+//------------------------------------------------------------------------------
+void stemple_SetMaxDepth (stemple_Expander *expander, size_t depth)
+{
+	if (expander) {
+		reinterpret_cast<stemple::Expander *>(expander)->SetMaxDepth(depth);
+	}
+}
+
+//------------------------------------------------------------------------------
+// The builtin is called on whichever thread is expanding, with context as is.
+
+void stemple_RegisterBuiltin (stemple_Expander *expander, const char *name, stemple_BuiltinFunc builtin, void *context)
+{
+	if (expander && name && builtin) {
+		try {
+			reinterpret_cast<stemple::Expander *>(expander)->RegisterBuiltin(name,
+				[builtin, context](const std::vector<stemple::StringView> &args, stemple::BuiltinOutput &output) {
+					std::vector<const char *> data;
+					std::vector<size_t> lengths;
+					data.reserve(args.size());
+					lengths.reserve(args.size());
+					for (auto &arg : args) {
+						data.push_back(arg.Data);
+						lengths.push_back(arg.Length);
+					}
+					return builtin(context, args.size(), data.data(), lengths.data(), reinterpret_cast<stemple_Output *>(&output));
+				});
+		} catch (...) {
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+void stemple_Write (stemple_Output *output, const char *data, size_t length)
+{
+	if (output && (data || !length)) {
+		reinterpret_cast<stemple::BuiltinOutput *>(output)->Write(data, length);
+	}
+}
+
+//------------------------------------------------------------------------------
+void stemple_SetRescan (stemple_Output *output, bool rescan)
+{
+	if (output) {
+		reinterpret_cast<stemple::BuiltinOutput *>(output)->SetRescan(rescan);
+	}
+}
+
+//------------------------------------------------------------------------------
+// A C expansion may own the stream wrapper around its FILE* input, which must
+// outlive the expansion itself.
+
+struct stemple_Expansion
+{
+	std::unique_ptr<stemple::filereadbuf> inputBuf;
+	std::unique_ptr<std::istream> input;
+	std::unique_ptr<stemple::Expansion> expansion;
+	bool failed = false;	// Threw
+};
+
+//------------------------------------------------------------------------------
+stemple_Expansion *stemple_CreateStringExpansion (stemple_Expander *expander, const char *input, size_t chunkSize)
+{
+	if (expander) {
+		try {
+			std::unique_ptr<stemple_Expansion> e(new stemple_Expansion);
+			e->expansion = std::unique_ptr<stemple::Expansion>(new stemple::Expansion(*reinterpret_cast<stemple::Expander *>(expander), input ? input : "", chunkSize));
+			return e.release();
+		} catch (...) {
+		}
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// Reads the input in place, so it must remain valid until the expansion is
+// destroyed.
+
+stemple_Expansion *stemple_CreateBufferExpansion (stemple_Expander *expander, const char *input, size_t length, size_t chunkSize)
+{
+	if (expander && (input || !length)) {
+		try {
+			std::unique_ptr<stemple_Expansion> e(new stemple_Expansion);
+			e->expansion = std::unique_ptr<stemple::Expansion>(new stemple::Expansion(*reinterpret_cast<stemple::Expander *>(expander), input ? input : "", length, chunkSize));
+			return e.release();
+		} catch (...) {
+		}
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+stemple_Expansion *stemple_CreateFileExpansion (stemple_Expander *expander, FILE *input, const char *inputName, size_t chunkSize)
+{
+	if (expander && input) {
+		try {
+			std::unique_ptr<stemple_Expansion> e(new stemple_Expansion);
+			e->inputBuf = std::unique_ptr<stemple::filereadbuf>(new stemple::filereadbuf(input));
+			e->input = std::unique_ptr<std::istream>(new std::istream(e->inputBuf.get()));
+			e->expansion = std::unique_ptr<stemple::Expansion>(new stemple::Expansion(*reinterpret_cast<stemple::Expander *>(expander), *e->input, inputName ? inputName : "", chunkSize));
+			return e.release();
+		} catch (...) {
+		}
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// Returns the next chunk of output, which remains valid until the next call,
+// or NULL when there is no more.
+
+const char *stemple_NextChunk (stemple_Expansion *expansion, size_t *length)
+{
+	if (length) *length = 0;
+	if (expansion && !expansion->failed) {
+		try {
+			if (expansion->expansion->Next()) {
+				const std::string &chunk = expansion->expansion->GetChunk();
+				if (length) *length = chunk.size();
+				return chunk.data();
+			}
+		} catch (...) {
+			expansion->failed = true;
+		}
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// Once stemple_NextChunk() has returned NULL, tells whether that was because
+// of an error, or the expansion going too deep to finish, rather than the end
+// of the output.
+
+bool stemple_ExpansionFailed (stemple_Expansion *expansion)
+{
+	return !expansion || expansion->failed || expansion->expansion->Failed();
+}
+
+//------------------------------------------------------------------------------
+void stemple_DestroyExpansion (stemple_Expansion *expansion)
+{
+	if (expansion) {
+		try {
+			delete expansion;
+		} catch (...) {
+		}
+	}
+}
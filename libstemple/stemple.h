@@ -11,6 +11,7 @@
 
 // The C++ API...
 #include "Expander.h"
+#include "Expansion.h"
 
 extern "C" {
 #endif	// __cplusplus
@@ -33,8 +34,55 @@ void stemple_SetMacro (stemple_Expander *expander, const char *name, const char
 
 void stemple_SetMacroSimple (stemple_Expander *expander, const char *name, const char *body);
 
+// Defines count macros at once: names[i] with bodies[i].
+void stemple_SetMacros (stemple_Expander *expander, const char *const *names, const char *const *bodies, size_t count);
+
 void stemple_SetSpecialChars (stemple_Expander *expander, char escape, char intro, char open, char argSep, char close);
 
+// Limits the nesting of directives and expansions; 0 for no limit. By
+// default, it's deep enough for any template, but stops runaway recursion.
+void stemple_SetMaxDepth (stemple_Expander *expander, size_t depth);
+
+// Callbacks for streaming input and output. Each returns the number of bytes
+// actually read or written: a reader returns 0 at the end of its input, and a
+// writer returning less than length aborts the expansion.
+typedef size_t (*stemple_ReadFunc) (void *context, char *buffer, size_t capacity);
+
+typedef size_t (*stemple_WriteFunc) (void *context, const char *data, size_t length);
+
+size_t stemple_ExpandStringN (stemple_Expander *expander, const char *input, size_t length, char *output, size_t capacity);
+
+bool stemple_ExpandStringToWriter (stemple_Expander *expander, const char *input, size_t length, stemple_WriteFunc write, void *writeContext);
+
+bool stemple_ExpandReader (stemple_Expander *expander, stemple_ReadFunc read, void *readContext, const char *inputName, stemple_WriteFunc write, void *writeContext);
+
+// A native builtin directive, $(name,...), given its count arguments, which
+// aren't NUL-terminated, and where to write its result. Returns false on an
+// error. The result is taken literally unless stemple_SetRescan() is called.
+typedef struct stemple_Output stemple_Output;
+
+typedef bool (*stemple_BuiltinFunc) (void *context, size_t count, const char *const *args, const size_t *lengths, stemple_Output *output);
+
+void stemple_RegisterBuiltin (stemple_Expander *expander, const char *name, stemple_BuiltinFunc builtin, void *context);
+
+void stemple_Write (stemple_Output *output, const char *data, size_t length);
+
+void stemple_SetRescan (stemple_Output *output, bool rescan);
+
+typedef struct stemple_Expansion stemple_Expansion;
+
+stemple_Expansion *stemple_CreateStringExpansion (stemple_Expander *expander, const char *input, size_t chunkSize);
+
+stemple_Expansion *stemple_CreateBufferExpansion (stemple_Expander *expander, const char *input, size_t length, size_t chunkSize);
+
+stemple_Expansion *stemple_CreateFileExpansion (stemple_Expander *expander, FILE *input, const char *inputName, size_t chunkSize);
+
+const char *stemple_NextChunk (stemple_Expansion *expansion, size_t *length);
+
+bool stemple_ExpansionFailed (stemple_Expansion *expansion);
+
+void stemple_DestroyExpansion (stemple_Expansion *expansion);
+
 #if defined __cplusplus
 }
 #endif	// __cplusplus
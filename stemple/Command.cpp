@@ -0,0 +1,293 @@
+// Command
+// Command processing, shared by the program and by its server mode: the
+// arguments are applied to an expander, and the command they describe is run.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+using namespace std;
+
+int usage (const Session &session);
+int version (const Session &session);
+bool specialChars (const std::vector<std::string> &, size_t &, stemple::Expander &, const Session &);
+bool definesFile (const std::string &, stemple::Expander &, const Session &);
+
+std::string program;
+
+//------------------------------------------------------------------------------
+// Relative paths are taken from the session's directory, if it has one.
+
+std::string resolve (const std::string &pathname, const Session &session)
+{
+	if (session.Directory.empty() || pathname.empty() || pathname[0] == '/' || pathname[0] == '\\' ||
+		(pathname.length() > 1 && pathname[1] == ':')) {
+		return pathname;
+	}
+	return session.Directory + '/' + pathname;
+}
+
+//------------------------------------------------------------------------------
+// Definitions and special characters are applied to expander in the order
+// they're given. Returns -1 if the command should go ahead, or the exit status
+// if it has already been dealt with (help, or an error).
+
+int parse (const std::vector<std::string> &args, stemple::Expander &expander, Options &options, const Session &session)
+{
+	for (size_t i = 0; i < args.size(); ++ i) {
+		std::string arg = args[i];
+		if (arg.length() > 1 && arg[0] == '-') {
+			if ((arg[1] == 'd' || arg[1] == 'D') || arg == "--define") {
+				std::string definition;
+				if (arg != "--define" && arg.length() > 2) {
+					definition = arg.substr(2);
+				} else {
+					++ i;
+					if (i < args.size()) definition = args[i];
+				}
+				std::string name;
+				std::string body;
+				size_t eq = definition.find('=');
+				if (eq != std::string::npos) {
+					name = definition.substr(0, eq);
+					if (definition.length() > eq + 1) {
+						body = definition.substr(eq + 1);
+					}
+				}
+				expander.SetMacro(name, body);
+			} else if (arg == "--help") {
+				return usage(session);
+			} else if (arg == "--version") {
+				return version(session);
+			} else if (arg == "--defines-file") {
+				++ i;
+				if (i < args.size()) {
+					std::string pathname = resolve(args[i], session);
+					if (!definesFile(pathname, expander, session)) return 1;
+					options.DefinesFiles.push_back(pathname);
+				}
+			} else if (arg == "--compile") {
+				options.Compile = true;
+			} else if (arg == "--write-if-changed") {
+				options.WriteIfChanged = true;
+			} else if (arg == "--pipeline") {
+				options.Pipeline = true;
+			} else if (arg == "--output-root") {
+				++ i;
+				if (i < args.size()) {
+					expander.SetOutputRoot(args[i]);
+				}
+			} else if (arg == "--parallel") {
+				++ i;
+				if (i < args.size()) {
+					expander.SetParallelism((unsigned)atoi(args[i].c_str()));
+				}
+			} else if (arg == "--chars") {
+				++ i;
+				if (!specialChars(args, i, expander, session)) return 1;
+			} else if (arg[1] != '-') {
+				for (size_t c = 1; c < arg.length(); ++ c) {
+					if (arg[c] == 'h') {
+						return usage(session);
+					} else if (arg[c] == 'v') {
+						return version(session);
+					} else if (arg[c] == 'c') {
+						++ i;
+						if (!specialChars(args, i, expander, session)) return 1;
+					} else {
+						return usage(session);
+					}
+				}
+			} else {
+				return usage(session);
+			}
+		} else if (options.Compile) {
+			options.Sources.push_back(arg);
+		} else if (options.Input.empty()) {
+			options.Input = arg;
+		} else if (options.Output.empty()) {
+			options.Output = arg;
+		} else {
+			return usage(session);
+		}
+	}
+	return -1;
+}
+
+//------------------------------------------------------------------------------
+int run (const Options &options, stemple::Expander &expander, const Session &session)
+{
+	std::string input = options.Input;
+	std::string output = options.Output;
+	std::unique_ptr<std::streambuf> inputBuf;
+	std::unique_ptr<std::istream> inputStream;
+	std::unique_ptr<std::ostream> outputStream;
+
+	// Compile the template files rather than expanding them. Compile just what
+	// was given: the arguments may appear before --compile.
+	if (options.Compile) {
+		std::vector<std::string> sources = options.Sources;
+		if (!input.empty()) sources.insert(sources.begin(), input);
+		if (!output.empty()) sources.insert(sources.begin() + 1, output);
+		if (sources.empty()) return usage(session);
+		for (auto &source : sources) {
+			if (!expander.Compile(resolve(source, session))) {
+				session.Err << "Cannot compile " << source << std::endl;
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	// Open input, preferring its compiled form if that's up to date, or a copy
+	// that's already in memory if there's a cache
+	std::shared_ptr<stemple::CompiledTemplate> compiled;
+	if (input.empty() || input == "-") {
+		// std::cin hands over its input a character at a time, so read the
+		// descriptor in blocks ourselves. Served requests have their own input.
+		if (&session.In == &std::cin) {
+			inputBuf = std::unique_ptr<stemple::fdreadbuf>(new stemple::fdreadbuf(fileno(stdin)));
+		}
+		inputStream = std::unique_ptr<std::istream>(new std::istream(inputBuf ? inputBuf.get() : session.In.rdbuf()));
+		input = "Standard Input";
+	} else {
+		std::string pathname = resolve(input, session);
+		auto &cache = expander.GetTemplateCache();
+		if (!(compiled = cache ? cache->Get(pathname) : stemple::CompiledTemplate::Load(pathname))) {
+			inputStream = std::unique_ptr<std::ifstream>(new std::ifstream(pathname));
+		}
+	}
+	if (!compiled && !inputStream->good()) {
+		session.Err << "Cannot open " << input << std::endl;
+		return 1;
+	}
+
+	// Open output. If it's only to be written if it changes, it's compared
+	// with what's there as it's expanded, and replaced once it's complete.
+	stemple::ChangedFile *changedFile = nullptr;
+	if (output.empty() || output == "-") {
+		outputStream = std::unique_ptr<std::ostream>(new std::ostream(session.Out.rdbuf()));
+		output = "Standard Output";
+	} else if (options.WriteIfChanged) {
+		outputStream.reset(changedFile = new stemple::ChangedFile(resolve(output, session)));
+	} else {
+		outputStream = std::unique_ptr<std::ofstream>(new std::ofstream(resolve(output, session)));
+	}
+	if (!outputStream->good()) {
+		session.Err << "Cannot open " << output << std::endl;
+		return 1;
+	}
+
+	// Pipelined, input is read ahead, and output written behind, on threads
+	// of their own, so that waiting for I/O overlaps with expansion. A
+	// compiled template is already in memory.
+	std::istream *in = inputStream.get();
+	std::ostream *out = outputStream.get();
+	std::unique_ptr<stemple::ReadAhead> readAhead;
+	std::unique_ptr<stemple::WriteBehind> writeBehind;
+	if (options.Pipeline) {
+		if (!compiled) {
+			readAhead = std::unique_ptr<stemple::ReadAhead>(new stemple::ReadAhead(inputStream->rdbuf()));
+			in = readAhead.get();
+		}
+		writeBehind = std::unique_ptr<stemple::WriteBehind>(new stemple::WriteBehind(outputStream->rdbuf()));
+		out = writeBehind.get();
+	}
+
+	// Process
+	try {
+		bool ok = compiled ? expander.Expand(compiled, input, *out) :
+							 expander.Expand(*in, input, *out);
+		if (!ok) {
+			if (expander.ExceededMaxDepth()) {
+				session.Err << "Error! Directives or macros nested too deeply" << std::endl;
+			} else if (expander.ArithmeticFailed()) {
+				session.Err << "Error! Cannot evaluate $((...)) expression" << std::endl;
+			} else {
+				session.Err << "Error!" << std::endl;
+			}
+			return 1;
+		}
+		if (writeBehind && !writeBehind->flush().good()) {
+			session.Err << "Cannot write " << output << std::endl;
+			return 1;
+		}
+		if (changedFile && !changedFile->Commit()) {
+			session.Err << "Cannot write " << output << std::endl;
+			return 1;
+		}
+	} catch (const std::exception &e) {
+		session.Err << "Error! " << e.what() << std::endl;
+		return 1;
+	}
+
+	outputStream->flush();
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+bool specialChars (const std::vector<std::string> &args, size_t &index, stemple::Expander &expander, const Session &session)
+{
+	if (index < args.size()) {
+		std::string c = args[index];
+		if (c.length() != 5) {
+			session.Out << "Must define 5 special characters" << std::endl;
+			return false;
+		}
+		expander.SetSpecialChars(c[0], c[1], c[2], c[3], c[4]);
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool definesFile (const std::string &pathname, stemple::Expander &expander, const Session &session)
+{
+	if (!expander.SetMacrosFromFile(pathname)) {
+		session.Err << "Cannot read definitions from " << pathname << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+int usage (const Session &session)
+{
+	std::string name = program;
+	size_t slash;
+#if defined _WIN32
+	slash = name.rfind('\\');
+	if (slash == std::string::npos)
+#endif
+	slash = name.rfind('/');
+	if (slash != std::string::npos) {
+		name = name.substr(slash + 1);
+	}
+
+	session.Out << "Usage: " << name << " [options] [<input>|- [<output>|-]]" << std::endl;
+	session.Out << "       " << name << " [options] --compile <input>..." << std::endl;
+	session.Out << "       " << name << " --serve <socket> [--workers <n>] [--timeout <seconds>] [options]" << std::endl;
+	session.Out << "       " << name << " --client <socket> <arguments>..." << std::endl;
+	session.Out << std::endl;
+	session.Out << "Options:" << std::endl;
+	session.Out << "-d[name[=body]], --define name[=body]\tDefine a macro." << std::endl;
+	session.Out << "--defines-file <file>\t\t\tDefine macros from a file." << std::endl;
+	session.Out << "--compile <input>...\t\t\tPrecompile templates for faster loading." << std::endl;
+	session.Out << "--write-if-changed\t\t\tOnly replace the output file if it changes." << std::endl;
+	session.Out << "--output-root <dir>\t\t\tWhere files named by $(output) go." << std::endl;
+	session.Out << "--pipeline\t\t\t\tRead, expand and write on separate threads." << std::endl;
+	session.Out << "--parallel <threads>\t\t\tExpand large inputs in pieces, in parallel." << std::endl;
+	session.Out << "-c,--chars <special_chars>\t\tDefine special chars (default: \"$(),$\")" << std::endl;
+	session.Out << "-h,--help\t\t\t\tThis help." << std::endl;
+	session.Out << "-v,--version\t\t\t\tPrint version information." << std::endl;
+	session.Out << std::endl;
+	session.Out << "--serve keeps the options' macros, and templates, in memory to expand" << std::endl;
+	session.Out << "requests from --client, which takes the same arguments as " << name << " itself." << std::endl;
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+int version (const Session &session)
+{
+	session.Out << "stemple version 1.0" << std::endl;
+	return 0;
+}
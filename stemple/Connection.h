@@ -0,0 +1,138 @@
+// Connection
+// The messages that server and client exchange over a socket. Each is a type,
+// a 32-bit little-endian length, and that many bytes of data. The client
+// sends a REQUEST, holding its directory and then its arguments, each
+// preceded by a 32-bit length. The server sends back OUTPUT and ERROR text,
+// then EXIT with the exit status. If it needs the client's standard input, it
+// sends INPUT, and the client sends it back in DATA messages, the last one
+// empty.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Connection__
+#define __stemple__Connection__
+
+#if !defined _WIN32
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+#include <unistd.h>
+
+// Largest message either end will accept, so that a bad length can't make it
+// allocate without limit. Text is sent in blocks much smaller than this; only
+// a request with very long arguments comes near it.
+const size_t MaxMessage = 16 * 1024 * 1024;
+
+//------------------------------------------------------------------------------
+inline void putLength (std::string &data, size_t length)
+{
+	char bytes[4] = { (char)length, (char)(length >> 8), (char)(length >> 16), (char)(length >> 24) };
+	data.append(bytes, sizeof bytes);
+}
+
+//------------------------------------------------------------------------------
+inline uint32_t getLength (const char *data)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+//==============================================================================
+// One end of a connection, which it closes.
+//==============================================================================
+class Connection
+{
+public:
+	enum Type : char
+	{
+		REQUEST = 'R',
+		INPUT = 'I',
+		DATA = 'D',
+		OUTPUT = 'O',
+		ERROR = 'E',
+		EXIT = 'X',
+	};
+
+	//--------------------------------------------------------------------------
+	Connection (int fd) :
+		fd(fd)
+	{
+	}
+
+	//--------------------------------------------------------------------------
+	~Connection ()
+	{
+		if (fd >= 0) close(fd);
+	}
+
+	Connection (const Connection &) = delete;
+
+	Connection &operator= (const Connection &) = delete;
+
+	//--------------------------------------------------------------------------
+	bool Send (Type type, const char *data, size_t length)
+	{
+		std::string header(1, type);
+		putLength(header, length);
+		return write(header.data(), header.size()) && write(data, length);
+	}
+
+	//--------------------------------------------------------------------------
+	bool Send (Type type, const std::string &data)
+	{
+		return Send(type, data.data(), data.size());
+	}
+
+	//--------------------------------------------------------------------------
+	// Returns false if the connection has closed, or the message is larger
+	// than MaxMessage, after which nothing more can be received.
+	bool Receive (Type &type, std::string &data)
+	{
+		char header[5];
+		if (!read(header, sizeof header)) return false;
+		type = (Type)header[0];
+		size_t length = getLength(header + 1);
+		if (length > MaxMessage) return false;
+		data.resize(length);
+		return read(&data[0], data.size());
+	}
+
+private:
+	//--------------------------------------------------------------------------
+	// Interrupted calls are retried; anything else means the connection has
+	// gone, or timed out.
+
+	bool write (const char *data, size_t length)
+	{
+		while (length) {
+			ssize_t n = ::write(fd, data, length);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			length -= n;
+		}
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	bool read (char *data, size_t length)
+	{
+		while (length) {
+			ssize_t n = ::read(fd, data, length);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			length -= n;
+		}
+		return true;
+	}
+
+	int fd;
+};
+
+#endif
+
+#endif	// __stemple__Connection__
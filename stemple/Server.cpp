@@ -0,0 +1,521 @@
+// Server
+// Expands requests from clients over a Unix domain socket.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#include "stdafx.h"
+
+#if !defined _WIN32
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Connection.h"
+
+using namespace std;
+
+namespace
+{
+	typedef Connection::Type Type;
+
+	const size_t BlockSize = 64 * 1024;
+
+	//==========================================================================
+	// Sends what's written to it as messages of the given type.
+	//==========================================================================
+	class sendbuf: public std::streambuf
+	{
+	public:
+		//----------------------------------------------------------------------
+		sendbuf (Connection &connection, Type type) :
+			connection(connection),
+			type(type),
+			buffer(BlockSize)
+		{
+			setp(buffer.data(), buffer.data() + buffer.size());
+		}
+
+	protected:
+		//----------------------------------------------------------------------
+		virtual int overflow (int c = EOF)
+		{
+			if (sync() != 0) {
+				return EOF;
+			}
+			if (c != EOF) {
+				*pptr() = traits_type::to_char_type(c);
+				pbump(1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		//----------------------------------------------------------------------
+		virtual int sync ()
+		{
+			size_t n = pptr() - pbase();
+			bool ok = !n || connection.Send(type, pbase(), n);
+			setp(buffer.data(), buffer.data() + buffer.size());
+			return ok ? 0 : -1;
+		}
+
+	private:
+		Connection &connection;
+		Type type;
+		std::vector<char> buffer;
+	};
+
+	//==========================================================================
+	// Reads the client's standard input, asking for it only if it's needed.
+	//==========================================================================
+	class receivebuf: public std::streambuf
+	{
+	public:
+		//----------------------------------------------------------------------
+		receivebuf (Connection &connection) :
+			connection(connection),
+			requested(false),
+			ended(false),
+			failed(false)
+		{
+			setg(nullptr, nullptr, nullptr);
+		}
+
+		//----------------------------------------------------------------------
+		// Whether the input was cut off, by the connection closing or timing
+		// out, rather than ended by the client.
+		bool Failed () const
+		{
+			return failed;
+		}
+
+	protected:
+		//----------------------------------------------------------------------
+		virtual int underflow ()
+		{
+			if (gptr() < egptr()) {
+				return traits_type::to_int_type(*gptr());
+			}
+			if (!requested) {
+				requested = true;
+				ended = failed = !connection.Send(Connection::INPUT, string());
+			}
+			Type type;
+			if (ended) {
+				return EOF;
+			}
+			if (!connection.Receive(type, data) || type != Connection::DATA) {
+				ended = failed = true;
+				return EOF;
+			}
+			if (data.empty()) {
+				ended = true;
+				return EOF;
+			}
+			setg(&data[0], &data[0], &data[0] + data.size());
+			return traits_type::to_int_type(*gptr());
+		}
+
+	private:
+		Connection &connection;
+		string data;
+		bool requested;
+		bool ended;
+		bool failed;
+	};
+}
+
+//------------------------------------------------------------------------------
+Server::Server (const vector<string> &args) :
+	args(args),
+	timeout(DefaultTimeout),
+	reloading(false)
+{
+}
+
+//------------------------------------------------------------------------------
+bool Server::Load ()
+{
+	auto expander = make_shared<stemple::Expander>();
+	Options options;
+	Session session = { cin, cerr, cerr, string() };
+	if (parse(args, *expander, options, session) >= 0) {
+		return false;
+	}
+	if (!cache) {
+		cache = make_shared<stemple::TemplateCache>(expander->GetSyntax());
+	}
+	expander->SetTemplateCache(cache);
+	expander->SetMaxDepth(MaxDepth);
+	if (!options.Input.empty() || options.Compile) {
+		cerr << "Server options can't include input, output or --compile" << endl;
+		return false;
+	}
+	vector<pair<string, Info>> files;
+	for (auto &pathname : options.DefinesFiles) {
+		files.emplace_back(pathname, getInfo(pathname));
+	}
+	auto pool = make_shared<stemple::ExpanderPool>(expander);
+	lock_guard<std::mutex> lock(mutex);
+	this->pool = pool;
+	this->files = move(files);
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Zero means requests may wait as long as their clients like.
+
+void Server::SetTimeout (unsigned seconds)
+{
+	timeout = seconds;
+}
+
+//------------------------------------------------------------------------------
+// Runs one request, on a pooled expander layered over the base one. A client
+// that stops sending, or stops reading the output, has the request fail once
+// the timeout passes, rather than holding on to a worker for good.
+
+void Server::Handle (int fd)
+{
+	Connection connection(fd);
+	timeval limit = { (time_t)timeout, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof limit);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof limit);
+	try {
+		Type type;
+		string request;
+		if (!connection.Receive(type, request) || type != Connection::REQUEST) {
+			return;
+		}
+		vector<string> fields;
+		for (size_t pos = 0; pos + 4 <= request.size(); ) {
+			size_t length = getLength(&request[pos]);
+			pos += 4;
+			if (length > request.size() - pos) return;
+			fields.emplace_back(request, pos, length);
+			pos += length;
+		}
+		if (fields.empty()) {
+			return;
+		}
+
+		receivebuf inBuf(connection);
+		sendbuf outBuf(connection, Connection::OUTPUT);
+		sendbuf errBuf(connection, Connection::ERROR);
+		istream in(&inBuf);
+		ostream out(&outBuf);
+		ostream err(&errBuf);
+		Session session = { in, out, err, fields[0] };
+
+		auto pool = get();
+		auto expander = pool->Acquire();
+		expander->SetDirectory(session.Directory);
+		Options options;
+		int status = parse(vector<string>(fields.begin() + 1, fields.end()), *expander, options, session);
+		options.Pipeline = false;	// Input and output share the connection
+		if (status < 0) {
+			status = run(options, *expander, session);
+		}
+		if (inBuf.Failed()) {
+			// What was expanded is only part of the input
+			cerr << "Request failed: input cut off" << endl;
+			return;
+		}
+		out.flush();
+		err.flush();
+		connection.Send(Connection::EXIT, to_string(status));
+	} catch (const exception &e) {
+		// Such as running out of memory. The client sees the connection close.
+		cerr << "Request failed: " << e.what() << endl;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Expanders with the options applied, reloaded if need be. If they can no
+// longer be loaded, the last good ones are kept. Only one worker reloads at
+// a time; the rest carry on with the current ones until it's done.
+
+shared_ptr<stemple::ExpanderPool> Server::get ()
+{
+	bool changed = false;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (!reloading) {
+			for (auto &file : files) {
+				changed = changed || getInfo(file.first) != file.second;
+			}
+			reloading = changed;
+		}
+	}
+	if (changed) {
+		cerr << "Reloading definitions" << endl;
+		bool loaded = false;
+		try {
+			loaded = Load();
+		} catch (...) {
+			lock_guard<std::mutex> lock(mutex);
+			reloading = false;
+			throw;
+		}
+		lock_guard<std::mutex> lock(mutex);
+		if (!loaded) {
+			// Don't keep trying until something changes again
+			for (auto &file : files) {
+				file.second = getInfo(file.first);
+			}
+		}
+		reloading = false;
+	}
+	lock_guard<std::mutex> lock(mutex);
+	return pool;
+}
+
+//------------------------------------------------------------------------------
+Server::Info Server::getInfo (const string &pathname)
+{
+	Info info(0, 0);
+	stemple::CompiledTemplate::GetSourceInfo(pathname, info.first, info.second);
+	return info;
+}
+
+//------------------------------------------------------------------------------
+// Connections are accepted here, and handed out to a pool of worker threads.
+
+int serve (const string &socketPath, const vector<string> &args)
+{
+	vector<string> baseArgs;
+	unsigned workers = thread::hardware_concurrency();
+	unsigned timeout = Server::DefaultTimeout;
+	for (size_t i = 0; i < args.size(); ++ i) {
+		if (args[i] == "--workers" && i + 1 < args.size()) {
+			workers = (unsigned)atoi(args[++ i].c_str());
+		} else if (args[i] == "--timeout" && i + 1 < args.size()) {
+			timeout = (unsigned)atoi(args[++ i].c_str());
+		} else {
+			baseArgs.push_back(args[i]);
+		}
+	}
+	if (!workers) workers = 1;
+
+	Server server(baseArgs);
+	server.SetTimeout(timeout);
+	if (!server.Load()) {
+		return 1;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof address.sun_path) {
+		cerr << "Socket path too long: " << socketPath << endl;
+		return 1;
+	}
+	strcpy(address.sun_path, socketPath.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());
+	if (listener < 0 || ::bind(listener, (sockaddr *)&address, sizeof address) != 0 || listen(listener, SOMAXCONN) != 0) {
+		cerr << "Cannot listen on " << socketPath << endl;
+		return 1;
+	}
+
+	// A client that goes away mid-request mustn't take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	// While every worker is busy and the queue is full, connections are left
+	// waiting in the listen backlog rather than taking up descriptors here
+	std::mutex mutex;
+	condition_variable ready;
+	condition_variable room;
+	deque<int> pending;
+	size_t maxPending = (size_t)workers * Server::PendingPerWorker;
+	unsigned retryMs = Server::AcceptRetryMs;
+	vector<thread> pool;
+	for (unsigned i = 0; i < workers; ++ i) {
+		pool.emplace_back([&]() {
+			for (;;) {
+				int fd;
+				{
+					unique_lock<std::mutex> lock(mutex);
+					ready.wait(lock, [&]() { return !pending.empty(); });
+					fd = pending.front();
+					pending.pop_front();
+				}
+				room.notify_one();
+				server.Handle(fd);
+			}
+		});
+	}
+
+	for (;;) {
+		{
+			unique_lock<std::mutex> lock(mutex);
+			room.wait(lock, [&]() { return pending.size() < maxPending; });
+		}
+		int fd = accept(listener, nullptr, nullptr);
+		if (fd < 0) {
+			// Out of descriptors or memory, say, which won't clear up at once;
+			// a client giving up before it was accepted is no reason to wait
+			if (errno != EINTR && errno != ECONNABORTED) {
+				this_thread::sleep_for(chrono::milliseconds(retryMs));
+			}
+			continue;
+		}
+		{
+			lock_guard<std::mutex> lock(mutex);
+			pending.push_back(fd);
+		}
+		ready.notify_one();
+	}
+}
+
+//------------------------------------------------------------------------------
+int client (const string &socketPath, const vector<string> &args)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	int fd = socketPath.size() < sizeof address.sun_path ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+	if (fd >= 0) {
+		strcpy(address.sun_path, socketPath.c_str());
+	}
+	if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof address) != 0) {
+		cerr << "Cannot connect to " << socketPath << endl;
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+
+	// The server may finish, and close the connection, while input is still
+	// being sent; that mustn't kill the client before it reports the status
+	signal(SIGPIPE, SIG_IGN);
+
+	return client(fd, args, stdin, stdout, stderr);
+}
+
+//------------------------------------------------------------------------------
+// Standard input is sent from a thread of its own, so that output is received
+// while it's sent: the server writes output as it expands, and if it weren't
+// read, the server and the client could each be stuck writing to the other.
+// The thread only reads input once there is some, so that it can be stopped
+// as soon as the server has finished, however slowly the input comes.
+
+int client (int fd, const vector<string> &args, FILE *in, FILE *out, FILE *err)
+{
+	Connection connection(fd);
+
+	string request;
+	char *cwd = getcwd(nullptr, 0);
+	string directory(cwd ? cwd : "");
+	free(cwd);
+	putLength(request, directory.size());
+	request += directory;
+	for (auto &arg : args) {
+		putLength(request, arg.size());
+		request += arg;
+	}
+	if (request.size() > MaxMessage) {
+		fputs("Arguments too long\n", err);
+		return 1;
+	}
+	if (!connection.Send(Connection::REQUEST, request)) {
+		fputs("Cannot send request to server\n", err);
+		return 1;
+	}
+
+	thread sending;
+	int stop[2] = { -1, -1 };
+	auto finishSending = [&]() {
+		if (sending.joinable()) {
+			// Input the server no longer wants is neither waited for, nor
+			// waits to be read
+			ssize_t written = write(stop[1], "", 1);
+			(void)written;
+			shutdown(fd, SHUT_WR);
+			sending.join();
+			close(stop[0]);
+			close(stop[1]);
+		}
+	};
+
+	Type type;
+	string data;
+	while (connection.Receive(type, data)) {
+		switch (type) {
+		case Connection::OUTPUT:
+			fwrite(data.data(), 1, data.size(), out);
+			break;
+		case Connection::ERROR:
+			fwrite(data.data(), 1, data.size(), err);
+			break;
+		case Connection::INPUT:
+			if (sending.joinable()) {
+				break;
+			}
+			if (pipe(stop) != 0) {
+				fputs("Cannot send standard input\n", err);
+				connection.Send(Connection::DATA, string());
+				break;
+			}
+			sending = thread([&connection, in, &stop]() {
+				vector<char> buffer(BlockSize);
+				pollfd ready[2] = { { fileno(in), POLLIN, 0 }, { stop[0], POLLIN, 0 } };
+				for (;;) {
+					if (poll(ready, 2, -1) < 0) {
+						if (errno == EINTR) continue;
+						return;
+					}
+					if (ready[1].revents) {
+						return;
+					}
+					ssize_t n = read(ready[0].fd, buffer.data(), buffer.size());
+					if (n < 0 && errno == EINTR) {
+						continue;
+					}
+					if (n <= 0) {
+						break;
+					}
+					if (!connection.Send(Connection::DATA, buffer.data(), n)) return;
+				}
+				connection.Send(Connection::DATA, string());
+			});
+			break;
+		case Connection::EXIT:
+			finishSending();
+			fflush(out);
+			return atoi(data.c_str());
+		default:
+			break;
+		}
+	}
+	finishSending();
+	fputs("Lost connection to server\n", err);
+	return 1;
+}
+
+#else
+
+//------------------------------------------------------------------------------
+int serve (const std::string &socketPath, const std::vector<std::string> &args)
+{
+	std::cerr << "--serve is not supported on this platform" << std::endl;
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+int client (const std::string &socketPath, const std::vector<std::string> &args)
+{
+	std::cerr << "--client is not supported on this platform" << std::endl;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,118 @@
+// Server
+// Command processing, shared by the program and by its server mode, which
+// expands requests from clients over a Unix domain socket. The server keeps
+// its base macros, and the templates it reads, in memory between requests,
+// so that a client pays for a round trip rather than for starting up.
+//
+// Copyright  2016 by Paul Ashdown. All Rights Reserved.
+
+#pragma once
+#ifndef __stemple__Server__
+#define __stemple__Server__
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <libstemple/Expander.h>
+#include <libstemple/ExpanderPool.h>
+#include <libstemple/TemplateCache.h>
+
+// Where a command's input and output go, and the directory that relative
+// paths are taken from (the current one if empty).
+struct Session
+{
+	std::istream &In;
+	std::ostream &Out;
+	std::ostream &Err;
+	std::string Directory;
+};
+
+// What's left of the arguments once definitions etc. have been applied.
+struct Options
+{
+	std::string Input;
+	std::string Output;
+	std::vector<std::string> Sources;
+	std::vector<std::string> DefinesFiles;
+	bool Compile = false;
+	bool WriteIfChanged = false;
+	bool Pipeline = false;
+};
+
+// The program's name as invoked, for usage messages.
+extern std::string program;
+
+int parse (const std::vector<std::string> &args, stemple::Expander &expander, Options &options, const Session &session);
+
+int run (const Options &options, stemple::Expander &expander, const Session &session);
+
+//==============================================================================
+// What a server keeps between requests: the options that apply to every one,
+// and expanders with them applied. The options are read again if any of the
+// defines files they name change.
+//==============================================================================
+class Server
+{
+public:
+	// How deeply a request's directives and macros may nest, so that runaway
+	// recursion in one can't take all of the server's memory.
+	static const size_t MaxDepth = 100000;
+
+	// How long, in seconds, a client may keep a request waiting to send it
+	// anything, or to take its output, before the request is dropped.
+	static const unsigned DefaultTimeout = 60;
+
+	// How many accepted connections may wait for each worker. Beyond that,
+	// they're left in the listen backlog until a worker is free.
+	static const unsigned PendingPerWorker = 4;
+
+	// How long, in milliseconds, to wait before accepting again after an
+	// error, such as running out of descriptors, rather than spinning.
+	static const unsigned AcceptRetryMs = 100;
+
+	Server (const std::vector<std::string> &args);
+
+	// Returns false, having reported why, if the options are bad.
+	bool Load ();
+
+	void SetTimeout (unsigned seconds);
+
+	// Runs the request on a connected socket, which it closes. Nothing that
+	// goes wrong with one request is allowed to affect any other.
+	void Handle (int fd);
+
+private:
+	typedef std::pair<uint64_t, int64_t> Info;	// Size and modification time
+
+	std::shared_ptr<stemple::ExpanderPool> get ();
+
+	static Info getInfo (const std::string &pathname);
+
+	std::vector<std::string> args;
+	unsigned timeout;
+	std::shared_ptr<stemple::TemplateCache> cache;
+	std::mutex mutex;
+	std::shared_ptr<stemple::ExpanderPool> pool;
+	std::vector<std::pair<std::string, Info>> files;
+	bool reloading;		// By one of the workers, which the others don't wait for
+};
+
+// Serves requests until killed. The arguments are options applied to every
+// request, --workers <n>, the number of requests handled at once, and
+// --timeout <seconds>, how long a client may leave a request waiting.
+int serve (const std::string &socketPath, const std::vector<std::string> &args);
+
+// Has the server expand the arguments, as if by the program itself.
+int client (const std::string &socketPath, const std::vector<std::string> &args);
+
+// The same, over a socket connected to the server, which it closes. in, out
+// and err stand for the client's standard streams.
+int client (int fd, const std::vector<std::string> &args, FILE *in, FILE *out, FILE *err);
+
+#endif	// __stemple__Server__
@@ -15,8 +15,16 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <vector>
 
 
 // TODO: reference additional headers your program requires here
 #include <libstemple/stemple.h>
 #include <libstemple/Expander.h>
+#include <libstemple/ExpanderPool.h>
+#include <libstemple/DefinesFile.h>
+#include <libstemple/ChangedFile.h>
+#include <libstemple/cstream.h>
+#include <libstemple/Pipeline.h>
+
+#include "Server.h"
@@ -1,5 +1,17 @@
 #include "stdafx.h"
 
+#include <sys/stat.h>
+#if defined _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <utime.h>
+#endif
+
+#include <libstemple/cstream.h>
+
 using namespace std;
 
 class FileTests: public ::testing::Test
@@ -17,6 +29,9 @@ protected:
 		if (!tempOutPathname.empty()) {
 			unlink(tempOutPathname.c_str());
 		}
+		if (!tempInPathname.empty()) {
+			unlink(stemple::CompiledTemplate::GetCompiledPath(tempInPathname).c_str());
+		}
 	}
 
 	stemple::Expander expander;
@@ -50,3 +65,423 @@ TEST_F(FileTests, Expand)
 	// Check result
 	ASSERT_EQ("aaa\n", expansion);
 }
+
+TEST_F(FileTests, SkipBlocks)
+{
+	// Create input file and rewind
+	tempInPathname = tmpnam(nullptr);
+	fstream ifs(tempInPathname, ios::in|ios::out|ios::trunc);
+	if (!ifs) FAIL() << "Can't create input file.";
+	ifs << "$(if $(A))" << endl
+		<< "A $(B=bbb) $(if 1)$(else)$(endif)" << endl
+		<< "$(elseif $(B))" << endl
+		<< "B" << endl
+		<< "$(else)" << endl
+		<< "None $(B)" << endl
+		<< "$(endif)" << endl;
+	ifs.seekg(0, ios_base::beg);
+
+	// Do expansion
+	ostringstream output;
+	bool result = expander.Expand(ifs, tempInPathname, output);
+	ASSERT_TRUE(result);
+
+	// Check result
+	ASSERT_EQ("None \n", output.str());
+}
+
+TEST_F(FileTests, CompiledTemplate)
+{
+	// Create input file
+	tempInPathname = tmpnam(nullptr);
+	ofstream ifs(tempInPathname);
+	if (!ifs) FAIL() << "Can't create input file.";
+	ifs << "$(if $(A))" << endl
+		<< "A" << endl
+		<< "$(else)" << endl
+		<< "None $(B)" << endl
+		<< "$(endif)" << endl;
+	ifs.close();
+
+	// Compile and load it
+	ASSERT_TRUE(expander.Compile(tempInPathname));
+	auto compiled = stemple::CompiledTemplate::Load(tempInPathname);
+	ASSERT_NE(nullptr, compiled);
+	ASSERT_EQ(2u, compiled->GetBlockIndex()->GetTargets().size());
+
+	// Do expansion
+	expander.SetMacro("B", "bbb");
+	ostringstream output;
+	bool result = expander.Expand(compiled, tempInPathname, output);
+	ASSERT_TRUE(result);
+
+	// Check result
+	ASSERT_EQ("None bbb\n", output.str());
+}
+
+TEST_F(FileTests, StaleCompiledTemplate)
+{
+	// Create and compile input file
+	tempInPathname = tmpnam(nullptr);
+	ofstream ifs(tempInPathname);
+	if (!ifs) FAIL() << "Can't create input file.";
+	ifs << "old" << endl;
+	ifs.close();
+	ASSERT_TRUE(expander.Compile(tempInPathname));
+
+	// Change the source, so the compiled form must not be used
+	ifs.open(tempInPathname, ios::trunc);
+	ifs << "changed" << endl;
+	ifs.close();
+	ASSERT_EQ(nullptr, stemple::CompiledTemplate::Load(tempInPathname));
+
+	// Includes fall back to the text
+	ASSERT_EQ("changed\n", expander.Expand("$(include " + tempInPathname + ")"));
+
+	// And use the compiled form once it's been recompiled
+	ASSERT_TRUE(expander.Compile(tempInPathname));
+	ASSERT_NE(nullptr, stemple::CompiledTemplate::Load(tempInPathname));
+	ASSERT_EQ("changed\n", expander.Expand("$(include " + tempInPathname + ")"));
+}
+
+TEST_F(FileTests, ConcurrentCompiles)
+{
+	tempInPathname = tmpnam(nullptr);
+	ofstream ifs(tempInPathname);
+	if (!ifs) FAIL() << "Can't create input file.";
+	ifs << "$(if $(A))A$(endif)" << endl;
+	ifs.close();
+
+	// Each compile writes its own temporary file, so none is lost to another
+	atomic<int> failures(0);
+	vector<thread> compilers;
+	for (int t = 0; t < 8; ++ t) {
+		compilers.emplace_back([&]() {
+			stemple::Expander expander;
+			for (int i = 0; i < 20; ++ i) {
+				if (!expander.Compile(tempInPathname)) {
+					++ failures;
+				}
+			}
+		});
+	}
+	for (auto &compiler : compilers) {
+		compiler.join();
+	}
+	ASSERT_EQ(0, failures.load());
+	ASSERT_NE(nullptr, stemple::CompiledTemplate::Load(tempInPathname));
+}
+
+#if !defined _WIN32
+TEST_F(FileTests, CompiledTemplateEditedInTheSameSecond)
+{
+	// Compile the input file, as of part way through a second
+	tempInPathname = tmpnam(nullptr);
+	ofstream ifs(tempInPathname);
+	if (!ifs) FAIL() << "Can't create input file.";
+	ifs << "old" << endl;
+	ifs.close();
+	struct timespec times[2] = { { 1500000000, 100000000 }, { 1500000000, 100000000 } };
+	ASSERT_EQ(0, utimensat(AT_FDCWD, tempInPathname.c_str(), times, 0));
+	ASSERT_TRUE(expander.Compile(tempInPathname));
+	ASSERT_NE(nullptr, stemple::CompiledTemplate::Load(tempInPathname));
+
+	// Change it later in the same second, keeping its length
+	ifs.open(tempInPathname, ios::trunc);
+	ifs << "new" << endl;
+	ifs.close();
+	times[0].tv_nsec = times[1].tv_nsec = 600000000;
+	ASSERT_EQ(0, utimensat(AT_FDCWD, tempInPathname.c_str(), times, 0));
+	ASSERT_EQ(nullptr, stemple::CompiledTemplate::Load(tempInPathname));
+	ASSERT_EQ("new\n", expander.Expand("$(include " + tempInPathname + ")"));
+}
+#endif
+
+TEST_F(FileTests, TextDefinesFile)
+{
+	// Create definitions file
+	tempInPathname = tmpnam(nullptr);
+	ofstream ifs(tempInPathname, ios::binary);
+	if (!ifs) FAIL() << "Can't create definitions file.";
+	ifs << "# Comment" << endl
+		<< "A=aaa" << endl
+		<< "" << endl
+		<< "B=$(A) = b\r" << endl
+		<< "C";
+	ifs.close();
+
+	// Read them, and define them straight from the file
+	stemple::MacroDefinitions definitions;
+	ASSERT_TRUE(stemple::DefinesFile::Read(tempInPathname, definitions));
+	ASSERT_EQ(3u, definitions.size());
+	ASSERT_TRUE(expander.SetMacrosFromFile(tempInPathname));
+
+	// Check result
+	ASSERT_EQ("[aaa] [aaa = b] [] [1]", expander.Expand("[$(A)] [$(B)] [$(C)] [$(defined C)]"));
+}
+
+TEST_F(FileTests, BinaryDefinesFile)
+{
+	// Create definitions file, with bodies that would be awkward as text
+	tempInPathname = tmpnam(nullptr);
+	stemple::MacroDefinitions definitions = { { "A", "line 1\nline 2" }, { "B", string("x\0y=z", 5) } };
+	ASSERT_TRUE(stemple::DefinesFile::WriteBinary(tempInPathname, definitions));
+
+	// Read them back
+	stemple::MacroDefinitions read;
+	ASSERT_TRUE(stemple::DefinesFile::Read(tempInPathname, read));
+	ASSERT_EQ(definitions, read);
+
+	// A truncated file is rejected, and nothing in it is defined
+	ofstream(tempInPathname, ios::binary | ios::app) << "\x05";
+	read.clear();
+	ASSERT_FALSE(stemple::DefinesFile::Read(tempInPathname, read));
+	ASSERT_TRUE(read.empty());
+	ASSERT_FALSE(expander.SetMacrosFromFile(tempInPathname));
+	ASSERT_EQ("0", expander.Expand("$(defined A)"));
+}
+
+TEST_F(FileTests, WriteIfChanged)
+{
+	auto readOutput = [this]() {
+		ifstream ifs(tempOutPathname, ios::binary);
+		return string((istreambuf_iterator<char>(ifs)), (istreambuf_iterator<char>()));
+	};
+
+	// A new file is created
+	tempOutPathname = tmpnam(nullptr);
+	expander.SetMacro("A", "aaa");
+	{
+		istringstream input("$(A)\n");
+		stemple::ChangedFile output(tempOutPathname);
+		ASSERT_TRUE(expander.Expand(input, "Input", output));
+		ASSERT_TRUE(output.IsChanged());
+		ASSERT_TRUE(output.Commit());
+	}
+	ASSERT_EQ("aaa\n", readOutput());
+
+	// The same output leaves it alone. Backdate it, so that any rewrite would
+	// show.
+	struct stat st;
+	ASSERT_EQ(0, stat(tempOutPathname.c_str(), &st));
+	struct utimbuf times = { st.st_atime - 3600, st.st_mtime - 3600 };
+	ASSERT_EQ(0, utime(tempOutPathname.c_str(), &times));
+	{
+		istringstream input("$(A)\n");
+		stemple::ChangedFile output(tempOutPathname);
+		ASSERT_TRUE(expander.Expand(input, "Input", output));
+		ASSERT_FALSE(output.IsChanged());
+		ASSERT_TRUE(output.Commit());
+	}
+	ASSERT_EQ(0, stat(tempOutPathname.c_str(), &st));
+	ASSERT_EQ(times.modtime, st.st_mtime);
+
+	// Longer, shorter and different output replace it
+	for (string body : { "aaab", "aa", "abc" }) {
+		expander.SetMacro("A", body);
+		istringstream input("$(A)\n");
+		stemple::ChangedFile output(tempOutPathname);
+		ASSERT_TRUE(expander.Expand(input, "Input", output));
+		ASSERT_TRUE(output.Commit());
+		ASSERT_EQ(body + "\n", readOutput());
+	}
+
+	// Without a commit, it's left as it was
+	{
+		stemple::ChangedFile output(tempOutPathname);
+		output << "abandoned";
+	}
+	ASSERT_EQ("abc\n", readOutput());
+
+	// A file beside it that's named like a temporary file is left alone
+	string besidePathname = tempOutPathname + ".tmp";
+	ofstream(besidePathname) << "mine\n";
+	{
+		stemple::ChangedFile output(tempOutPathname);
+		output << "replaced\n";
+		ASSERT_TRUE(output.Commit());
+	}
+	ASSERT_EQ("replaced\n", readOutput());
+	ifstream beside(besidePathname);
+	string line;
+	ASSERT_TRUE(getline(beside, line).good());
+	ASSERT_EQ("mine", line);
+	beside.close();
+	unlink(besidePathname.c_str());
+}
+
+#if !defined _WIN32
+TEST_F(FileTests, WriteIfChangedKeepsMode)
+{
+	tempOutPathname = tmpnam(nullptr);
+	ofstream(tempOutPathname) << "#!/bin/sh\n";
+	ASSERT_EQ(0, chmod(tempOutPathname.c_str(), 0751));
+	{
+		stemple::ChangedFile output(tempOutPathname);
+		output << "#!/bin/sh\necho changed\n";
+		ASSERT_TRUE(output.Commit());
+	}
+	struct stat st;
+	ASSERT_EQ(0, stat(tempOutPathname.c_str(), &st));
+	ASSERT_EQ(0751, st.st_mode & 07777);
+}
+#endif
+
+TEST_F(FileTests, OutputDirective)
+{
+	auto read = [](const string &pathname) {
+		ifstream ifs(pathname, ios::binary);
+		return string((istreambuf_iterator<char>(ifs)), (istreambuf_iterator<char>()));
+	};
+
+	// One file open at a time, so that they're closed and reopened; and the
+	// same again with the input split up to be expanded in parallel
+	string pathname = tmpnam(nullptr);
+	size_t slash = pathname.find_last_of("/\\");
+	string name = pathname.substr(slash + 1);
+	tempOutPathname = pathname + ".a";
+	for (unsigned threads : { 1, 4 }) {
+		stemple::Expander expander;
+		expander.SetOutputRoot(pathname.substr(0, slash), 1);
+		expander.SetParallelism(threads, 1);
+		istringstream input("main 1\n"
+							"$(foreach E, a, b)\n"
+							"$(output " + name + ".$(E))\n"
+							"header $(E)\n"
+							"$(end)\n"
+							"$(output " + name + ".a)more a\n"
+							"$(output)main 2\n"
+							"main 3\n");
+		ostringstream output;
+		ASSERT_TRUE(expander.Expand(input, "Input", output));
+		string b = read(pathname + ".b");
+		unlink((pathname + ".b").c_str());
+		ASSERT_EQ("main 1\nmain 2\nmain 3\n", output.str());
+		ASSERT_EQ("header a\nmore a\n", read(pathname + ".a"));
+		ASSERT_EQ("header b\n", b);
+	}
+}
+
+TEST_F(FileTests, PipeBlockBoundaries)
+{
+	// Reports where each $(where) ends, as an error there would
+	class PositionExpander: public stemple::Expander
+	{
+	public:
+		string Where ()
+		{
+			return currentStream().GetPosition().GetString();
+		}
+	};
+	PositionExpander expander;
+	expander.RegisterBuiltin("where", [&](const vector<stemple::StringView> &, stemple::BuiltinOutput &output) {
+		output.Write(expander.Where());
+		return true;
+	});
+
+	// Directives, one with a line break in its arguments, straddling the
+	// expander's 4K blocks, read from a pipe in smaller blocks than that
+	string text = "$(M=[$(1)|$(2)])\n";
+	string expected;
+	auto where = [&]() {
+		size_t end = text.size() + 7;	// Of the ')' of the $(where) about to be added
+		int line = (int)count(text.begin(), text.end(), '\n') + 1;
+		int column = (int)(end - text.rfind('\n', end - 1));
+		text += "$(where)";
+		return "Pipe, line " + to_string(line) + ", column " + to_string(column);
+	};
+	auto fill = [&](size_t size) {
+		while (text.size() + 7 <= size) {
+			text += "filler\n";
+			expected += "filler\n";
+		}
+		string padding(size - text.size(), 'x');
+		text += padding;
+		expected += padding;
+	};
+	fill(4090);
+	text += "<$(M one,\ntwo) ";
+	expected += "<[one|two] " + where();
+	fill(8188);
+	expected += where() + "\n";
+	text += "\n";
+
+	int fds[2];
+#if defined _WIN32
+	ASSERT_EQ(0, _pipe(fds, 64 * 1024, _O_BINARY));
+#else
+	ASSERT_EQ(0, pipe(fds));
+#endif
+	ASSERT_LT(text.size(), 64 * 1024u) << "fits in the pipe";
+	ASSERT_EQ((int)text.size(), (int)write(fds[1], text.data(), (unsigned)text.size()));
+	close(fds[1]);
+	stemple::fdreadbuf inputBuf(fds[0], 1000);
+	istream input(&inputBuf);
+	ostringstream output;
+	ASSERT_TRUE(expander.Expand(input, "Pipe", output));
+	close(fds[0]);
+	ASSERT_EQ(expected, output.str());
+}
+
+TEST_F(FileTests, CFileExpansion)
+{
+	// Through the C API, from and to FILE*, whole and in chunks
+	string text;
+	for (int i = 0; i < 5000; ++ i) {
+		text += "$(A=a)$(A)$(1)-\n";
+	}
+	string expected;
+	for (int i = 0; i < 5000; ++ i) {
+		expected += "a-\n";
+	}
+	FILE *input = tmpfile();
+	FILE *output = tmpfile();
+	ASSERT_TRUE(input && output);
+	ASSERT_EQ(text.size(), fwrite(text.data(), 1, text.size(), input));
+	rewind(input);
+	stemple_Expander *c = stemple_CreateExpander();
+	ASSERT_TRUE(stemple_ExpandFile(c, input, "File", output));
+	string result(expected.size() + 1, '\0');
+	rewind(output);
+	result.resize(fread(&result[0], 1, result.size(), output));
+	ASSERT_EQ(expected, result);
+
+	rewind(input);
+	stemple_Expansion *expansion = stemple_CreateFileExpansion(c, input, "File", 1000);
+	ASSERT_TRUE(expansion);
+	result.clear();
+	size_t length;
+	while (const char *chunk = stemple_NextChunk(expansion, &length)) {
+		result.append(chunk, length);
+	}
+	ASSERT_FALSE(stemple_ExpansionFailed(expansion));
+	ASSERT_EQ(expected, result);
+	stemple_DestroyExpansion(expansion);
+	stemple_DestroyExpander(c);
+	fclose(input);
+	fclose(output);
+}
+
+TEST_F(FileTests, TemplateCacheLimit)
+{
+	// Room for two of the three templates: the least recently used one goes
+	tempInPathname = tmpnam(nullptr);
+	tempOutPathname = tmpnam(nullptr);
+	string third = tmpnam(nullptr);
+	for (auto &pathname : { tempInPathname, tempOutPathname, third }) {
+		ofstream(pathname) << string(100, 'x');
+	}
+	stemple::TemplateCache cache(expander.GetSyntax(), 250);
+	auto first = cache.Get(tempInPathname);
+	auto second = cache.Get(tempOutPathname);
+	ASSERT_TRUE(first && second);
+	ASSERT_EQ(first, cache.Get(tempInPathname));
+	ASSERT_TRUE(cache.Get(third));
+	ASSERT_EQ(first, cache.Get(tempInPathname));
+	ASSERT_NE(second, cache.Get(tempOutPathname));
+
+	// One that's too big on its own isn't kept
+	stemple::TemplateCache small(expander.GetSyntax(), 50);
+	ASSERT_NE(small.Get(third), small.Get(third));
+	unlink(third.c_str());
+}
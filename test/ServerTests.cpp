@@ -0,0 +1,262 @@
+#include "stdafx.h"
+
+#if !defined _WIN32
+
+#include <sys/socket.h>
+
+#include <stemple/Connection.h>
+#include <stemple/Server.h>
+
+using namespace std;
+
+class ServerTests: public ::testing::Test
+{
+protected:
+	void TearDown()
+	{
+		if (!tempPathname.empty()) {
+			unlink(tempPathname.c_str());
+		}
+	}
+
+	// Runs a client with the given input on one end of a connection, and has
+	// the server handle its request on the other.
+	int request (Server &server, const vector<string> &args, const string &input)
+	{
+		return request(server, args, input, output, errors);
+	}
+
+	static int request (Server &server, const vector<string> &args, const string &input, string &output,
+						string &errors)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+			ADD_FAILURE() << "Can't create socket pair.";
+			return -1;
+		}
+		thread serving([&]() { server.Handle(fds[0]); });
+		FILE *in = tmpfile();
+		FILE *out = tmpfile();
+		FILE *err = tmpfile();
+		fwrite(input.data(), 1, input.size(), in);
+		rewind(in);
+		int status = client(fds[1], args, in, out, err);
+		serving.join();
+		output = contents(out);
+		errors = contents(err);
+		fclose(in);
+		fclose(out);
+		fclose(err);
+		return status;
+	}
+
+	static string contents (FILE *file)
+	{
+		string text;
+		char buffer[256];
+		size_t n;
+		rewind(file);
+		while ((n = fread(buffer, 1, sizeof buffer, file)) > 0) {
+			text.append(buffer, n);
+		}
+		return text;
+	}
+
+	string output;
+	string errors;
+	string tempPathname;
+};
+
+TEST_F(ServerTests, Framing)
+{
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	Connection server(fds[0]);
+	Connection client(fds[1]);
+	string binary("a\0b\xff", 4);
+	string large(100000, 'x');
+	thread sending([&]() {
+		client.Send(Connection::REQUEST, binary);
+		client.Send(Connection::DATA, string());
+		client.Send(Connection::DATA, large);
+	});
+	Connection::Type type;
+	string data;
+	ASSERT_TRUE(server.Receive(type, data));
+	ASSERT_EQ(Connection::REQUEST, type);
+	ASSERT_EQ(binary, data);
+	ASSERT_TRUE(server.Receive(type, data));
+	ASSERT_EQ(Connection::DATA, type);
+	ASSERT_EQ("", data);
+	ASSERT_TRUE(server.Receive(type, data));
+	ASSERT_EQ(large, data);
+	sending.join();
+
+	// A length beyond the limit is refused without reading any further
+	string header(1, Connection::DATA);
+	putLength(header, MaxMessage + 1);
+	ASSERT_EQ((ssize_t)header.size(), write(fds[1], header.data(), header.size()));
+	ASSERT_FALSE(server.Receive(type, data));
+}
+
+TEST_F(ServerTests, ServeInput)
+{
+	Server server({ "-dGREETING=Hello" });
+	ASSERT_TRUE(server.Load());
+	ASSERT_EQ(0, request(server, { "-dNAME=World" }, "$(GREETING), $(NAME)!\n"));
+	ASSERT_EQ("Hello, World!\n", output);
+	ASSERT_EQ("", errors);
+
+	// Definitions made by one request don't last into the next
+	ASSERT_EQ(0, request(server, {}, "$(GREETING), $(NAME)!\n"));
+	ASSERT_EQ("Hello, !\n", output);
+}
+
+TEST_F(ServerTests, ServeLargeInput)
+{
+	// Far more input and output than the socket buffers hold, so output has
+	// to be received while input is still being sent
+	Server server({ "-dA=line" });
+	ASSERT_TRUE(server.Load());
+	string input, expected;
+	for (int i = 0; i < 200000; ++ i) {
+		input += "$(A) " + to_string(i) + "\n";
+		expected += "line " + to_string(i) + "\n";
+	}
+	ASSERT_EQ(0, request(server, {}, input));
+	ASSERT_EQ(expected, output);
+	ASSERT_EQ("", errors);
+}
+
+TEST_F(ServerTests, ServeExitStatus)
+{
+	Server server({});
+	ASSERT_TRUE(server.Load());
+	ASSERT_EQ(1, request(server, { "no such file" }, ""));
+	ASSERT_EQ("", output);
+	ASSERT_EQ("Cannot open no such file\n", errors);
+}
+
+TEST_F(ServerTests, ServeRunawayRecursion)
+{
+	// Stops at the server's depth limit, and the next request is unaffected
+	Server server({});
+	ASSERT_TRUE(server.Load());
+	ASSERT_EQ(1, request(server, {}, "$(c=$(c))$(c)"));
+	ASSERT_EQ("Error! Directives or macros nested too deeply\n", errors);
+	ASSERT_EQ(0, request(server, {}, "ok"));
+	ASSERT_EQ("ok", output);
+}
+
+TEST_F(ServerTests, ServeEndsBeforeInput)
+{
+	// The server gives up part way through input that never ends; the client
+	// returns its status without waiting for more
+	Server server({});
+	ASSERT_TRUE(server.Load());
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	thread serving([&]() { server.Handle(fds[0]); });
+	int input[2];
+	ASSERT_EQ(0, pipe(input));
+	string text = "$(c=$(c))$(c)\n";
+	ASSERT_EQ((ssize_t)text.size(), write(input[1], text.data(), text.size()));
+	FILE *in = fdopen(input[0], "r");
+	FILE *out = tmpfile();
+	FILE *err = tmpfile();
+	ASSERT_EQ(1, client(fds[1], {}, in, out, err));
+	serving.join();
+	ASSERT_EQ("Error! Directives or macros nested too deeply\n", contents(err));
+	close(input[1]);
+	fclose(in);
+	fclose(out);
+	fclose(err);
+}
+
+TEST_F(ServerTests, ServeTimeout)
+{
+	// A client that never sends the input asked for is dropped
+	Server server({});
+	server.SetTimeout(1);
+	ASSERT_TRUE(server.Load());
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	thread serving([&]() { server.Handle(fds[0]); });
+	Connection client(fds[1]);
+	string request;
+	putLength(request, 0);
+	ASSERT_TRUE(client.Send(Connection::REQUEST, request));
+	Connection::Type type;
+	string data;
+	ASSERT_TRUE(client.Receive(type, data));
+	ASSERT_EQ(Connection::INPUT, type);
+	serving.join();
+	ASSERT_FALSE(client.Receive(type, data)) << "connection closed";
+}
+
+TEST_F(ServerTests, ServeOversizedRequest)
+{
+	Server server({});
+	ASSERT_TRUE(server.Load());
+	int fds[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	thread serving([&]() { server.Handle(fds[0]); });
+	string header(1, Connection::REQUEST);
+	putLength(header, 0xFFFFFFFF);
+	ASSERT_EQ((ssize_t)header.size(), write(fds[1], header.data(), header.size()));
+	serving.join();
+	char c;
+	ASSERT_EQ(0, read(fds[1], &c, 1)) << "connection closed";
+	close(fds[1]);
+}
+
+TEST_F(ServerTests, ReloadDefinesFile)
+{
+	tempPathname = tmpnam(nullptr);
+	ofstream(tempPathname, ios::binary) << "A=first" << endl;
+	Server server({ "--defines-file", tempPathname });
+	ASSERT_TRUE(server.Load());
+	ASSERT_EQ(0, request(server, {}, "$(A)"));
+	ASSERT_EQ("first", output);
+
+	// Its size changes, so it's seen to change whatever the clock's resolution
+	ofstream(tempPathname, ios::binary) << "A=second" << endl;
+	ASSERT_EQ(0, request(server, {}, "$(A)"));
+	ASSERT_EQ("second", output);
+}
+
+TEST_F(ServerTests, ReloadOnce)
+{
+	tempPathname = tmpnam(nullptr);
+	ofstream(tempPathname, ios::binary) << "A=first" << endl;
+	Server server({ "--defines-file", tempPathname });
+	ASSERT_TRUE(server.Load());
+	ofstream(tempPathname, ios::binary) << "A=second" << endl;
+
+	// Requests that see the change at once don't all reload it
+	const size_t n = 8;
+	vector<string> outputs(n), errors(n);
+	vector<int> statuses(n);
+	vector<thread> requests;
+	testing::internal::CaptureStderr();
+	for (size_t i = 0; i < n; ++ i) {
+		requests.emplace_back([&, i]() { statuses[i] = request(server, {}, "$(A)", outputs[i], errors[i]); });
+	}
+	for (auto &t : requests) {
+		t.join();
+	}
+	string log = testing::internal::GetCapturedStderr();
+	size_t reloads = 0;
+	for (size_t pos = 0; (pos = log.find("Reloading", pos)) != string::npos; ++ pos) {
+		++ reloads;
+	}
+	ASSERT_EQ(1u, reloads);
+	for (size_t i = 0; i < n; ++ i) {
+		ASSERT_EQ(0, statuses[i]);
+		ASSERT_TRUE(outputs[i] == "first" || outputs[i] == "second") << outputs[i];
+	}
+	ASSERT_EQ(0, request(server, {}, "$(A)"));
+	ASSERT_EQ("second", output);
+}
+
+#endif
@@ -35,6 +35,14 @@ TEST_F(StringTests, SimplestMacro)
 	ASSERT_EQ("aaa", expansion);
 }
 
+TEST_F(StringTests, SetMacros)
+{
+	stemple::MacroDefinitions definitions = { { "A", "aaa" }, { "B", "$(A)" }, { "A", "ccc" } };
+	expander.SetMacros(definitions);
+	string expansion = expander.Expand("$(A) $(B)");
+	ASSERT_EQ("ccc ccc", expansion);
+}
+
 TEST_F(StringTests, RecursiveMacro)
 {
 	expander.SetMacro("A", "$(B)");
@@ -59,6 +67,280 @@ TEST_F(StringTests, MacroWithArguments)
 	ASSERT_EQ("List is [one, two, three].", expansion);
 }
 
+TEST_F(StringTests, ArgumentsOfEnclosingMacro)
+{
+	expander.SetMacro("first", "$(1)");
+	expander.SetMacro("pair", "<$(1):$(2)>");
+	expander.SetMacro("outer", "$(first)$(pair x,y)$(foreach I, a)$(first)$(I)$(end)$(2)");
+	string expansion = expander.Expand("$(outer one,two)");
+	ASSERT_EQ("one<x:y>oneatwo", expansion);
+}
+
+TEST_F(StringTests, BaseExpander)
+{
+	auto base = make_shared<stemple::Expander>();
+	base->SetMacro("A", "aaa");
+	base->SetMacro("B", "bbb");
+	stemple::Expander layered(base);
+	layered.SetMacro("B", "local");
+	string expansion = layered.Expand("$(A)$(B)$(A+=more)$(A)$(defined A)");
+	ASSERT_EQ("aaalocalaaamore1", expansion);
+	ASSERT_EQ("aaabbb", base->Expand("$(A)$(B)"));
+}
+
+TEST_F(StringTests, PipelinedStreams)
+{
+	// Small blocks, so that both queues wrap around many times
+	string text;
+	for (int i = 0; i < 2000; ++ i) text += "$(A" + to_string(i % 7) + "=x)[$(A" + to_string(i % 7) + ")]\n";
+	istringstream source(text);
+	ostringstream sink;
+	{
+		stemple::readaheadbuf inBuf(source.rdbuf(), 37, 3);
+		stemple::writebehindbuf outBuf(sink.rdbuf(), 41, 2);
+		istream in(&inBuf);
+		ostream out(&outBuf);
+		expander.Expand(in, "Input", out);
+		ASSERT_TRUE(out.flush().good());
+	}
+	stemple::Expander plain;
+	ASSERT_EQ(plain.Expand(text), sink.str());
+}
+
+TEST_F(StringTests, ParallelExpansion)
+{
+	// Segments that only read, that read what an earlier one defined, that
+	// append to it, and blocks, arguments and escapes that span lines
+	string text;
+	for (int i = 0; i < 300; ++ i) {
+		string n = to_string(i % 11);
+		switch (i % 9) {
+		case 0: text += "$(V" + n + "=" + to_string(i) + ")\n"; break;
+		case 1: text += "[$(V" + n + ")] [$(B)]\n"; break;
+		case 2: text += "$(L+=" + n + ")$(L)\n"; break;
+		case 3: text += "$(if $(defined V" + n + "))\n  def $(V" + n + ")\n$(else)\n  undef\n$(endif)\n"; break;
+		case 4: text += "$(foreach I, a,\nb)<$(I)>$(end)\n"; break;
+		case 5: text += "$((V" + n + " * 2 + 1)) $\n joined\n"; break;
+		case 6: text += "$(M=$(1)-$(2))$(M x,\ny)\n"; break;
+		case 7: text += "$$(escaped) $(B) $(and 1,\n1)\n"; break;
+		default: text += "plain line " + n + "\n\n"; break;
+		}
+	}
+	stemple::Expander sequential;
+	sequential.SetMacro("B", "base");
+	istringstream sequentialInput(text);
+	ostringstream sequentialOutput;
+	sequential.Expand(sequentialInput, "Input", sequentialOutput);
+
+	expander.SetMacro("B", "base");
+	expander.SetParallelism(4, 1);
+	istringstream input(text);
+	ostringstream output;
+	expander.Expand(input, "Input", output);
+	ASSERT_EQ(sequentialOutput.str(), output.str());
+
+	// And the macros are left the same, and again after a second run over
+	// the macros the first one left
+	string probe = "$(L)|$(M)|$(V0)|$(V5)|$(V10)|$(defined I)";
+	ASSERT_EQ(sequential.Expand(probe), expander.Expand(probe));
+	istringstream sequentialAgain(text), again(text);
+	ostringstream sequentialAgainOutput, againOutput;
+	sequential.Expand(sequentialAgain, "Input", sequentialAgainOutput);
+	expander.Expand(again, "Input", againOutput);
+	ASSERT_EQ(sequentialAgainOutput.str(), againOutput.str());
+	ASSERT_EQ(sequential.Expand(probe), expander.Expand(probe));
+
+	// Input too short to split is expanded as it is
+	expander.SetParallelism(4, text.size());
+	istringstream sequentialShort(text), shortInput(text);
+	ostringstream sequentialShortOutput, shortOutput;
+	sequential.Expand(sequentialShort, "Input", sequentialShortOutput);
+	expander.Expand(shortInput, "Input", shortOutput);
+	ASSERT_EQ(sequentialShortOutput.str(), shortOutput.str());
+}
+
+TEST_F(StringTests, ParallelNativeBuiltin)
+{
+	// A native with side effects is called once per use, in order, and not
+	// on the workers
+	int calls = 0;
+	thread::id caller = this_thread::get_id();
+	bool elsewhere = false;
+	expander.RegisterBuiltin("next", [&](const vector<stemple::StringView> &, stemple::BuiltinOutput &output) {
+		elsewhere = elsewhere || this_thread::get_id() != caller;
+		output.Write(to_string(calls ++));
+		return true;
+	});
+	string text;
+	string expected;
+	for (int i = 0; i < 200; ++ i) {
+		text += i % 3 ? "plain\n" : "[$(next)]\n";
+		expected += i % 3 ? "plain\n" : "[" + to_string(i / 3) + "]\n";
+	}
+	expander.SetParallelism(4, 1);
+	istringstream input(text);
+	ostringstream output;
+	expander.Expand(input, "Input", output);
+	ASSERT_EQ(expected, output.str());
+	ASSERT_EQ(67, calls);
+	ASSERT_FALSE(elsewhere);
+}
+
+TEST_F(StringTests, Reset)
+{
+	expander.SetMacro("A", "a");
+	expander.SetBaseline();
+
+	// Left in the middle of a block, and after an exception
+	expander.SetMacro("B", "b");
+	ASSERT_EQ("", expander.Expand("$(if 0)\n$(A)"));
+	expander.Reset();
+	ASSERT_EQ("ab", expander.Expand("$(A)$(B)"));
+	ASSERT_ANY_THROW(expander.Expand("$(A=x)$(include /nonexistent/dir/file)"));
+	expander.Reset();
+	ASSERT_EQ("xb", expander.Expand("$(A)$(B)"));
+
+	// Back to the baseline
+	expander.SetMaxDepth(2);
+	expander.Reset(true);
+	ASSERT_EQ("a|", expander.Expand("$(A)|$(B)"));
+	ASSERT_EQ("<<<a>>>", expander.Expand("$(X=<$(1)>)$(X $(X $(X $(A))))"));
+}
+
+TEST_F(StringTests, ResetBuiltins)
+{
+	auto upper = [](const vector<stemple::StringView> &, stemple::BuiltinOutput &output) {
+		output.Write("UP");
+		return true;
+	};
+	expander.RegisterBuiltin("up", upper);
+	expander.SetBaseline();
+
+	// Registered since the baseline, or overriding a standard one
+	expander.RegisterBuiltin("late", upper);
+	expander.RegisterBuiltin("equal", upper);
+	ASSERT_EQ("UP UP", expander.Expand("$(late) $(equal a,b)"));
+	expander.Reset(true);
+	ASSERT_EQ("UP  0", expander.Expand("$(up) $(late) $(equal a,b)"));
+}
+
+TEST_F(StringTests, ExpanderPool)
+{
+	auto base = make_shared<stemple::Expander>();
+	base->SetMacro("A", "a");
+	stemple::ExpanderPool pool(base);
+	stemple::Expander *first;
+	{
+		auto expander = pool.Acquire();
+		auto other = pool.Acquire();
+		ASSERT_NE(expander.get(), other.get());
+		first = expander.get();
+		ASSERT_EQ("b", expander->Expand("$(A=b)$(A)"));
+	}
+	// The last one back is the first one out again, reset
+	auto expander = pool.Acquire();
+	ASSERT_EQ(first, expander.get());
+	ASSERT_EQ("a", expander->Expand("$(A)"));
+}
+
+TEST_F(StringTests, NativeBuiltin)
+{
+	expander.RegisterBuiltin("upper", [](const vector<stemple::StringView> &args, stemple::BuiltinOutput &output) {
+		if (args.size() != 1) return false;
+		for (size_t i = 0; i < args[0].Length; ++ i) {
+			output.Put((char)toupper((unsigned char)args[0].Data[i]));
+		}
+		return true;
+	});
+	expander.RegisterBuiltin("ref", [](const vector<stemple::StringView> &args, stemple::BuiltinOutput &output) {
+		output.Write("$(");
+		output.Write(args[0]);
+		output.Put(')');
+		output.SetRescan(args.size() > 1);
+		return true;
+	});
+	expander.SetMacro("A", "aaa");
+	ASSERT_EQ("AAA", expander.Expand("$(upper $(A))"));
+	ASSERT_EQ("[AAA]", expander.Expand("$(if $(equal $(upper $(A)),AAA))[$(upper $(A))]$(endif)"));
+	// The result isn't expanded again unless the builtin asks
+	ASSERT_EQ("$(A) aaa", expander.Expand("$(ref A) $(ref A,rescan)"));
+	// Copies have them too
+	stemple::Expander copy(expander);
+	ASSERT_EQ("X", copy.Expand("$(upper x)"));
+}
+
+TEST_F(StringTests, ConcurrentExpanders)
+{
+	// Expanders of every kind, on many threads at once: their own, layered
+	// over a shared base, copied from it, and from a shared pool. Meant to be
+	// run under ThreadSanitizer too.
+	auto base = make_shared<stemple::Expander>();
+	base->SetMacro("B", "base");
+	base->SetMacro("W", "$(1)-$(2:q)");
+	base->RegisterBuiltin("twice", [](const vector<stemple::StringView> &args, stemple::BuiltinOutput &output) {
+		output.Write(args[0]);
+		output.Write(args[0]);
+		return true;
+	});
+	stemple::ExpanderPool pool(base);
+	string input =
+		"$(N=$(1))\n"
+		"$(foreach I, a, b\t, c)\t[$(W $(I),$(B))]$(end)\n"
+		"$(if $(equal $((N % 2)),0))even$(else)odd$(endif) $(twice $(N))\n"
+		"$(L+=x)$(L)$(L+=y)$(L) $$(B:q) $(B:q)\n";
+
+	const int threads = 8;
+	const int iterations = 200;
+	atomic<int> failures(0);
+	vector<thread> workers;
+	for (int t = 0; t < threads; ++ t) {
+		workers.emplace_back([&, t]() {
+			for (int i = 0; i < iterations; ++ i) {
+				string n = to_string(t * iterations + i);
+				string expected =
+					"\t[a-base]\t[b-base]\t[c-base]\n" +
+					string((t * iterations + i) % 2 ? "odd " : "even ") + n + n + "\n"
+					"xxy $(B:q) base\n";
+				string text = "$(N=" + n + ")" + input.substr(input.find('\n'));
+				string expansion;
+				switch ((t + i) % 4) {
+				case 0: {
+					stemple::Expander own;
+					own.SetMacro("B", "base");
+					own.SetMacro("W", "$(1)-$(2:q)");
+					own.RegisterBuiltin("twice", [](const vector<stemple::StringView> &args, stemple::BuiltinOutput &output) {
+						output.Write(args[0].ToString() + args[0].ToString());
+						return true;
+					});
+					expansion = own.Expand(text);
+					break;
+				}
+				case 1: {
+					stemple::Expander layered(static_pointer_cast<const stemple::Expander>(base));
+					expansion = layered.Expand(text);
+					break;
+				}
+				case 2: {
+					stemple::Expander copy(*base);
+					expansion = copy.Expand(text);
+					break;
+				}
+				default:
+					expansion = pool.Acquire()->Expand(text);
+					break;
+				}
+				if (expansion != expected) {
+					++ failures;
+				}
+			}
+		});
+	}
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	ASSERT_EQ(0, failures.load());
+}
+
 TEST_F(StringTests, Assignment)
 {
 	string expansion = expander.Expand("$(A=aaa)$(A)");
@@ -126,6 +408,350 @@ TEST_F(StringTests, RecursiveAppend)
 	ASSERT_EQ("aaax", expansion);
 }
 
+TEST_F(StringTests, LargeAppend)
+{
+	string expected;
+	string body;
+	for (int i = 0; i < 2000; ++ i) {
+		string item = "$(if $(A))[" + to_string(i) + "]$(else)<" + to_string(i) + ">$(endif)";
+		expander.Expand("$(L+=" + item + ")");
+		expected += "<" + to_string(i) + ">";
+		body += item;
+	}
+	string expansion = expander.Expand("$(L)");
+	ASSERT_EQ(expected, expansion);
+	expansion = expander.Expand("$(L:q)");
+	ASSERT_EQ(body, expansion);
+
+	// A copy has the body in one piece, and can go on appending to it
+	stemple::Expander copy(expander);
+	expansion = copy.Expand("$(L+=$(if 1)!$(endif))$(L)");
+	ASSERT_EQ(expected + "!", expansion);
+}
+
+TEST_F(StringTests, AppendWithoutCopying)
+{
+	// Once a body is large, what's stored already stays where it is however
+	// much more is appended
+	stemple::MacroTable table;
+	auto id = table.Set("L", "", 0);
+	string expected;
+	auto append = [&](int i) {
+		string item = to_string(i) + ",";
+		table.Append(id, item.data(), item.length());
+		expected += item;
+	};
+	int i = 0;
+	while (table.GetLength(id) < 100000) {
+		append(i ++);
+	}
+	auto text = table.GetText(id);
+	ASSERT_FALSE(text.Rest.empty());
+	for (int n = 0; n < 100000; ++ n) {
+		append(i ++);
+	}
+	auto after = table.GetText(id);
+	ASSERT_EQ(text.First.Data, after.First.Data);
+	ASSERT_EQ(text.First.Length, after.First.Length);
+	ASSERT_GE(after.Rest.size(), text.Rest.size());
+	for (size_t n = 0; n < text.Rest.size(); ++ n) {
+		ASSERT_EQ(text.Rest[n].Data, after.Rest[n].Data);
+	}
+	ASSERT_EQ(expected, table.GetString(id));
+	table.Release(id, text.First.Data);
+	table.Release(id, after.First.Data);
+
+	stemple::MacroTable copy(table);
+	ASSERT_TRUE(copy.GetBody(id).Rest.empty());
+	ASSERT_EQ(expected, copy.GetString(id));
+}
+
+TEST_F(StringTests, RemoveMacros)
+{
+	// The others are still found, through growing, copying and compacting
+	stemple::MacroTable table;
+	for (int i = 0; i < 1000; ++ i) {
+		string name = "M" + to_string(i);
+		table.Set(name, name.data(), name.length());
+	}
+	for (int i = 0; i < 1000; i += 3) {
+		table.Remove(table.Find("M" + to_string(i)));
+	}
+	for (int i = 1000; i < 2000; ++ i) {
+		string name = "M" + to_string(i);
+		table.Set(name, name.data(), name.length());
+	}
+	table.Compact();
+	stemple::MacroTable copy(table);
+	for (int i = 0; i < 2000; ++ i) {
+		string name = "M" + to_string(i);
+		for (auto t : { &table, &copy }) {
+			auto id = t->Find(name);
+			if (i < 1000 && i % 3 == 0) {
+				ASSERT_EQ(stemple::MacroTable::None, id) << name;
+			} else {
+				ASSERT_NE(stemple::MacroTable::None, id) << name;
+				ASSERT_EQ(name, t->GetString(id));
+			}
+		}
+	}
+	auto id = table.Set("M0", "again", 5);
+	ASSERT_EQ("again", table.GetString(table.Find("M0")));
+	ASSERT_EQ("M1", table.GetString(table.Find("M1")));
+	ASSERT_NE(stemple::MacroTable::None, id);
+}
+
+TEST_F(StringTests, AppendWhileExpanding)
+{
+	string expansion = expander.Expand("$(L=x$(L+=y))$(L)|$(L)|$(L)");
+	ASSERT_EQ("x|xy|xyy", expansion);
+}
+
+TEST_F(StringTests, RedefineWhileExpanding)
+{
+	string expansion = expander.Expand("$(B=0123456789)$(L=$(L:=$(B)$(B))-$(L)-)$(L)|$(L)");
+	ASSERT_EQ("-01234567890123456789-|01234567890123456789", expansion);
+}
+
+TEST_F(StringTests, RedefineRepeatedly)
+{
+	for (int i = 0; i < 2000; ++ i) {
+		expander.Expand("$(A" + to_string(i % 7) + "=" + string(i % 50, 'x') + to_string(i) + ")");
+	}
+	stemple::Expander copy(expander);
+	string expected;
+	for (int i = 1993; i < 2000; ++ i) {
+		expected += "[" + string(i % 50, 'x') + to_string(i) + "]";
+	}
+	string expansion = copy.Expand("[$(A5)][$(A6)][$(A0)][$(A1)][$(A2)][$(A3)][$(A4)]");
+	ASSERT_EQ(expected, expansion);
+}
+
+TEST_F(StringTests, RedefineOnceRead)
+{
+	// A body is only kept from being written over while it's being read
+	stemple::MacroTable table;
+	auto id = table.Set("A", "0123456789", 10);
+	auto text = table.GetText(id).First;
+	table.Set("A", "abc", 3);
+	ASSERT_NE(text.Data, table.GetBody(id).First.Data);
+	ASSERT_EQ("0123456789", text.ToString());
+	text = table.GetText(id).First;
+	auto again = table.GetText(id).First;
+	table.Release(id, text.Data);
+	table.Release(id, again.Data);
+	table.Set("A", "def", 3);
+	ASSERT_EQ(text.Data, table.GetBody(id).First.Data);
+	ASSERT_EQ("def", table.GetString(id));
+
+	// So a macro redefined each time round a loop that reads it takes no
+	// new space
+	string expansion = expander.Expand("$(N=0)$(foreach I, 1, 2, 3)$(N)$(N:=$(I))$(end)$(N)");
+	ASSERT_EQ("0123", expansion);
+}
+
+TEST_F(StringTests, Foreach)
+{
+	string expansion = expander.Expand("$(foreach I, a, b, c)[$(I)]$(end)");
+	ASSERT_EQ("[a][b][c]", expansion);
+}
+
+TEST_F(StringTests, ForeachRestoresName)
+{
+	// Undefined again afterwards, or back as it was, even in a base
+	ASSERT_EQ("[a][b]|0", expander.Expand("$(foreach I,a,b)[$(I)]$(end)|$(defined I)"));
+	ASSERT_EQ("[a][b]|i", expander.Expand("$(I=i)$(foreach I,a,b)[$(I)]$(end)|$(I)"));
+	ASSERT_EQ("1a1b2a2b|i", expander.Expand("$(foreach I,1,2)$(foreach J,a,b)$(I)$(J)$(end)$(end)|$(I)"));
+	auto base = make_shared<stemple::Expander>();
+	base->SetMacro("I", "base");
+	stemple::Expander layered(base);
+	ASSERT_EQ("[a]|base", layered.Expand("$(foreach I,a)[$(I)]$(end)|$(I)"));
+}
+
+TEST_F(StringTests, ForeachWithoutEnd)
+{
+	// The rest of the input isn't taken as the body
+	ASSERT_EQ("", expander.Expand("$(foreach I,a,b)x$(I)|"));
+	ASSERT_EQ("0", expander.Expand("$(defined I)"));
+}
+
+TEST_F(StringTests, ForeachLines)
+{
+	string expansion = expander.Expand("Start\n$(foreach I, a, b)\n  $(I)\n$(end)\nEnd\n");
+	ASSERT_EQ("Start\n  a\n  b\nEnd\n", expansion);
+}
+
+TEST_F(StringTests, ForeachOnOneLine)
+{
+	string expansion = expander.Expand("$(foreach I, a, b)[$(I)]$(end)\nx\n");
+	ASSERT_EQ("[a][b]\nx\n", expansion);
+	expansion = expander.Expand("w $(foreach I, a, b)[$(I)]$(end) y\nx\n");
+	ASSERT_EQ("w [a][b] y\nx\n", expansion);
+}
+
+TEST_F(StringTests, ForeachMidLine)
+{
+	string expansion = expander.Expand("p $(foreach I, a, b)\n[$(I)]\n$(end)\nx\n");
+	ASSERT_EQ("p \n[a]\n[b]\nx\n", expansion);
+	expansion = expander.Expand("p $(if 1)\n[a]\n$(endif)\nx\n");
+	ASSERT_EQ("p \n[a]\nx\n", expansion);
+}
+
+TEST_F(StringTests, NestedForeach)
+{
+	expander.SetMacro("L", "x,y");
+	string expansion = expander.Expand("$(foreach I, 1, 2)$(foreach J, $(L))$(I)$(J) $(end)$(if $(equal $(I), 1))| $(endif)$(end)");
+	ASSERT_EQ("1x 1y | 2x 2y ", expansion);
+}
+
+TEST_F(StringTests, LongForeach)
+{
+	// Far more iterations than recursion could manage
+	string items;
+	for (int i = 0; i < 100000; ++ i) {
+		items += ",x";
+	}
+	// I is only bound within the loop, so it's expanded as it's appended
+	string expansion = expander.Expand("$(N=)$(foreach I" + items + ")$(N:+=$(I))$(end)$(N)");
+	ASSERT_EQ(100000u, expansion.size());
+}
+
+TEST_F(StringTests, DirectivesAtEndOfInput)
+{
+	// Directives that input ends within are finished with what there is
+	expander.SetMacro("m", "abc");
+	ASSERT_EQ("", expander.Expand("$(if 0"));
+	expander.Reset();
+	ASSERT_EQ("x ", expander.Expand("x $(foreach i"));
+	ASSERT_EQ("x", expander.Expand("$(if 1)x$(else"));
+	expander.Reset();
+	ASSERT_EQ("a yes", expander.Expand("a $(if 1,yes"));
+	ASSERT_EQ("abc", expander.Expand("$(m"));
+	ASSERT_EQ("", expander.Expand("$(n=abc"));
+	ASSERT_EQ("[", expander.Expand("[$(if $(equal 1,"));
+}
+
+TEST_F(StringTests, DeeplyNestedDirectives)
+{
+	// Far deeper than recursion could manage
+	string open, close;
+	for (int i = 0; i < 100000; ++ i) {
+		open += "$(if 1,";
+		close += ")";
+	}
+	string expansion = expander.Expand(open + "x" + close);
+	ASSERT_EQ("x", expansion);
+}
+
+TEST_F(StringTests, MaxDepth)
+{
+	expander.SetMaxDepth(100);
+	string expansion = expander.Expand("$(R=x$(R))$(R)");
+	ASSERT_GT(expansion.size(), 0u);
+	ASSERT_LE(expansion.size(), 100u);
+	ASSERT_EQ(string(expansion.size(), 'x'), expansion);
+	expansion = expander.Expand("$(A=a)$(if 1,$(if 1,$(A)))");
+	ASSERT_EQ("a", expansion);
+}
+
+TEST_F(StringTests, DefaultMaxDepth)
+{
+	// Unbounded recursion stops at the default limit, and is reported
+	string expansion = expander.Expand("$(c=$(c))$(c)");
+	ASSERT_EQ("", expansion);
+	ASSERT_TRUE(expander.ExceededMaxDepth());
+	istringstream input("$(c)");
+	ostringstream output;
+	ASSERT_FALSE(expander.Expand(input, "Input", output));
+	ASSERT_TRUE(expander.ExceededMaxDepth());
+
+	// The next expansion starts afresh
+	ASSERT_EQ("ok", expander.Expand("ok"));
+	ASSERT_FALSE(expander.ExceededMaxDepth());
+}
+
+TEST_F(StringTests, Arithmetic)
+{
+	expander.SetMacro("i", " 6 ");
+	string expansion = expander.Expand("$((1 + 2 * 3)) $((-(i + 1) / 2)) $((i % 4 << 2 | 1)) $((0x10 >= 16 && !(i < 0) ? ~0 : 7)) $((x || 0))");
+	ASSERT_EQ("7 -3 9 -1 0", expansion);
+}
+
+TEST_F(StringTests, ArithmeticOperands)
+{
+	expander.SetMacro("add", "$(($(1) + $(2)))");
+	expander.SetMacro("n", "0");
+	string expansion = expander.Expand("$(add 2, 40) $(foreach I, a, b, c)$(n:=$((n + 1)))$(end)$(n)");
+	ASSERT_EQ("42 3", expansion);
+}
+
+TEST_F(StringTests, ArithmeticErrors)
+{
+	expander.SetMacro("s", "abc");
+	string expansion = expander.Expand("[$((1 / 0))][$((s + 1))][$((1 +))][$(if 0)$((1 / 0))$(else)ok$(endif)]");
+	ASSERT_EQ("[][][][ok]", expansion);
+	ASSERT_TRUE(expander.ArithmeticFailed());
+	ASSERT_EQ("[][ok]", expander.Expand("[$(if 0)$((1 +))$(endif)][ok]"));
+	ASSERT_FALSE(expander.ArithmeticFailed());
+	expander.SetMacro("big", "99999999999999999999999");
+	expander.SetMacro("max", "9223372036854775807");
+	expander.SetMacro("over", "9223372036854775808");
+	expander.SetMacro("min", "-9223372036854775808");
+	expander.SetMacro("under", "-9223372036854775809");
+	expansion = expander.Expand("[$((99999999999999999999999))][$((0x10000000000000000))][$((9223372036854775807))]"
+								"[$((-9223372036854775808))][$((0xFFFFFFFFFFFFFFFF))]");
+	ASSERT_EQ("[][][9223372036854775807][-9223372036854775808][-1]", expansion);
+	expansion = expander.Expand("[$((big))][$((max))][$((over))][$((min))][$((under))]");
+	ASSERT_EQ("[][9223372036854775807][][-9223372036854775808][]", expansion);
+}
+
+TEST_F(StringTests, DeeplyNestedArithmetic)
+{
+	// Deep nesting is an error, rather than running the native stack out
+	string nested = string(100, '(') + "1" + string(100, ')');
+	ASSERT_EQ("[1]", expander.Expand("[$((" + nested + "))]"));
+	string tooDeep = string(2000, '(') + "1" + string(2000, ')');
+	ASSERT_EQ("[]", expander.Expand("[$((" + tooDeep + "))]"));
+	ASSERT_EQ("[]", expander.Expand("[$((" + string(100000, '-') + "1))]"));
+	ASSERT_EQ("[]", expander.Expand("[$((" + string(100000, '+') + "1))]"));
+	string conditionals;
+	for (int i = 0; i < 2000; ++ i) conditionals += "0 ? 0 : ";
+	ASSERT_EQ("[]", expander.Expand("[$((" + conditionals + "1))]"));
+	ASSERT_TRUE(expander.ArithmeticFailed());
+}
+
+TEST_F(StringTests, ArithmeticAtEndOfInput)
+{
+	ASSERT_EQ("[", expander.Expand("[$(("));
+	ASSERT_EQ("a ", expander.Expand("a $((1+"));
+	ASSERT_EQ("a ", expander.Expand("a $((1+2)"));
+	ASSERT_TRUE(expander.ArithmeticFailed());
+	ASSERT_EQ("[3]", expander.Expand("[$((1+2))]"));
+	ASSERT_FALSE(expander.ArithmeticFailed());
+}
+
+TEST_F(StringTests, FailedArithmeticExpansion)
+{
+	// The rest is still expanded, but the expansion fails
+	istringstream input("a$((1 / 0))b\n");
+	ostringstream output;
+	ASSERT_FALSE(expander.Expand(input, "Input", output));
+	ASSERT_EQ("ab\n", output.str());
+	ASSERT_TRUE(expander.ArithmeticFailed());
+	{
+		stemple::Expansion expansion(expander, "$((1 +))ok", 16);
+		while (expansion.Next()) {
+		}
+		ASSERT_TRUE(expansion.Failed());
+	}
+	stemple::Expansion expansion(expander, "$((1 + 1))", 16);
+	ASSERT_TRUE(expansion.Next());
+	ASSERT_EQ("2", expansion.GetChunk());
+	ASSERT_FALSE(expansion.Next());
+	ASSERT_FALSE(expansion.Failed());
+	ASSERT_FALSE(expander.ArithmeticFailed());
+}
+
 TEST_F(StringTests, InlineIfThenElse)
 {
 	string expansion = expander.Expand("$(IF=$(if $(A),True,False))\n$(IF)\n$(A=aaa)\n$(IF)\n$(A=0)\n$(IF)\n");
@@ -466,3 +1092,165 @@ TEST_F(StringTests, QuoteModifier)
 	string expansion = expander.Expand("$(A $(B:q), $(C:q), $(D:q)) - B='$(B:q)', C='$(C:q)' D='$(D:q)'");
 	ASSERT_EQ("1=')'; 2='bbb, ccc'; 3='$(E xxx,yyy)' - B=')', C='bbb, ccc' D='$(E xxx,yyy)'", expansion);
 }
+
+TEST_F(StringTests, QuotedTextIsLiteral)
+{
+	// Quoted text never ends a directive, whatever it's collected into
+	expander.SetMacro("B", ")");
+	expander.SetMacro("E", "$$");
+	string expansion = expander.Expand("$(X:=a$(B:q)b$(E:q))[$(X:q)] $(if $(equal $((2*3)),6),[$(B:q)])");
+	ASSERT_EQ("[a)b$$] [)]", expansion);
+}
+
+TEST_F(StringTests, ArgumentsReused)
+{
+	// Each directive reuses the argument list of the last one at its depth,
+	// so nothing must be left over from a longer or nested list
+	expander.SetMacro("M", "[$(1)|$(2)|$(3)|$(6)]");
+	string expansion = expander.Expand("$(M a,b,c,d,e,f)$(M x)$(M $(M p, q ),  r )$(M)");
+	ASSERT_EQ("[a|b|c|f][x|||][[p|q||]|r||][|||]", expansion);
+}
+
+TEST_F(StringTests, SkippedBlockIsNotExpanded)
+{
+	// Nothing in a false branch is expanded, including assignments
+	string expansion = expander.Expand("$(if 0)\n$(A=aaa)$(B)\n$(else)\nB=[$(B)]\n$(endif)\nA=[$(A)]\n");
+	ASSERT_EQ("B=[]\nA=[]\n", expansion);
+}
+
+TEST_F(StringTests, SkippedBlocksInStream)
+{
+	// A stream has no block index, so each sibling is found by scanning; the
+	// branches after it are still skipped, and their assignments not made
+	string text = "$(if 0)a$(elseif 0)$(x=1)$(elseif 0)$(y=2)$(else)b$(z=3)$(endif)[$(x)][$(y)][$(z)]\n";
+	istringstream input(text);
+	ostringstream output;
+	ASSERT_TRUE(expander.Expand(input, "Input", output));
+	ASSERT_EQ("b[][][3]\n", output.str());
+	ASSERT_EQ(output.str(), stemple::Expander().Expand(text));
+}
+
+TEST_F(StringTests, SkippedBlockWithNestedDirectives)
+{
+	string input = "Before\n"
+		"$(if 0)\n"
+		"  $$(endif) $(if a, b, c) $(X a$,b$), c)\n"
+		"  $(Y=($(endif)))\n"
+		"  $(if 1)\n"
+		"    $(elseif 1)\n"
+		"  $(else)\n"
+		"  $(endif)\n"
+		"$(elseif $(A))\n"
+		"  A True\n"
+		"$(else)\n"
+		"  A False\n"
+		"$(endif)\n"
+		"After\n";
+	string expansion = expander.Expand(input);
+	ASSERT_EQ("Before\n  A False\nAfter\n", expansion);
+	expander.SetMacro("A", "1");
+	expansion = expander.Expand(input);
+	ASSERT_EQ("Before\n  A True\nAfter\n", expansion);
+}
+
+TEST_F(StringTests, SkippedBlocksInMacroBody)
+{
+	expander.SetMacro("M", "$(if $(1))\n"
+					  "one\n"
+					  "$(elseif $(2))\n"
+					  "$(if $(3))\n"
+					  "two three\n"
+					  "$(else)\n"
+					  "two\n"
+					  "$(endif)\n"
+					  "$(else)\n"
+					  "none\n"
+					  "$(endif)\n");
+	string expansion = expander.Expand("$(M 1)$(M 0,1)$(M 0,1,1)$(M 0,0,1)");
+	ASSERT_EQ("one\ntwo\ntwo three\nnone\n", expansion);
+}
+
+TEST_F(StringTests, ChunkedExpansion)
+{
+	expander.SetMacro("A", "aaa");
+	expander.SetMacro("B", "$(A)$(A)$(A)");
+	string input = "Start $(B)\n$(if 1)\n  $(A)\n$(endif)\nEnd\n";
+	string whole = expander.Expand(input);
+
+	// Each chunk is exactly the requested size, except the last
+	auto expandInChunks = [this](const string &input, size_t size) {
+		stemple::Expansion expansion(expander, input, size);
+		string joined;
+		size_t last = size;
+		for (const string &chunk : expansion) {
+			EXPECT_EQ(size, last);
+			EXPECT_GE(chunk.size(), 1u);
+			EXPECT_LE(chunk.size(), size);
+			last = chunk.size();
+			joined += chunk;
+		}
+		EXPECT_TRUE(expansion.IsDone());
+		EXPECT_FALSE(expansion.Next());
+		return joined;
+	};
+	ASSERT_EQ(whole, expandInChunks(input, 4));
+
+	// Even when a long run of leading whitespace is held back, which is still
+	// dropped if the line holds only a directive
+	string spaces(10000, ' ');
+	ASSERT_EQ(spaces + "x\n", expandInChunks(spaces + "x\n", 4));
+	ASSERT_EQ("y\n", expandInChunks(spaces + "$(C=1)\ny\n", 4));
+	ASSERT_EQ("a" + spaces + "b", expandInChunks("a" + spaces + "b", 4));
+}
+
+TEST_F(StringTests, AbandonedChunkedExpansion)
+{
+	expander.SetMacro("A", "aaa");
+	{
+		stemple::Expansion expansion(expander, "$(A) $(A) $(A) $(A)", 2);
+		ASSERT_TRUE(expansion.Next());
+	}
+	// Unread input of an abandoned expansion doesn't leak into the next one
+	string expansion = expander.Expand("$(A)");
+	ASSERT_EQ("aaa", expansion);
+
+	// Nor do the blocks left open in it
+	{
+		stemple::Expansion expansion(expander, "$(if 1)\n$(A) $(A) $(A) $(A)\n$(else)\nno\n$(endif)\n", 2);
+		ASSERT_TRUE(expansion.Next());
+	}
+	expansion = expander.Expand("$(A)\n$(else)\nunmatched\n");
+	ASSERT_NE(string::npos, expansion.find("unmatched"));
+}
+
+TEST_F(StringTests, FailedChunkedExpansion)
+{
+	// Output cut short by runaway recursion is reported, and the next
+	// expansion starts afresh
+	expander.SetMaxDepth(100);
+	{
+		stemple::Expansion expansion(expander, "$(R=x$(R))$(R)", 16);
+		while (expansion.Next()) {
+		}
+		ASSERT_TRUE(expansion.Failed());
+	}
+	ASSERT_TRUE(expander.ExceededMaxDepth());
+	stemple::Expansion expansion(expander, "ok", 16);
+	ASSERT_TRUE(expansion.Next());
+	ASSERT_EQ("ok", expansion.GetChunk());
+	ASSERT_FALSE(expansion.Next());
+	ASSERT_FALSE(expansion.Failed());
+	ASSERT_FALSE(expander.ExceededMaxDepth());
+}
+
+TEST_F(StringTests, BufferExpansion)
+{
+	// Input is read in place and needn't be NUL-terminated
+	const char input[] = "$(if $(A))\nA\n$(else)\nnot A\n$(endif)\nXXXX";
+	stemple::Expansion expansion(expander, input, sizeof(input) - 5, 0);
+	string joined;
+	for (const string &chunk : expansion) {
+		joined += chunk;
+	}
+	ASSERT_EQ("not A\n", joined);
+}
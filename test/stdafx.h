@@ -14,9 +14,14 @@
 #include <cstdio>
 #include <string>
 #include <iostream>
+#include <thread>
 
 // TODO: reference additional headers your program requires here
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <libstemple/stemple.h>
 #include <libstemple/Expander.h>
+#include <libstemple/ExpanderPool.h>
+#include <libstemple/DefinesFile.h>
+#include <libstemple/ChangedFile.h>
+#include <libstemple/Pipeline.h>